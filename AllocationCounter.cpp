@@ -0,0 +1,170 @@
+// Copyright (c) 2017 Trevor Sundberg
+// This code is licensed under the MIT license (see LICENSE.txt for details)
+
+#include "Precompiled.h"
+#include "AllocationCounter.h"
+#include <new>
+#include <stdlib.h>
+
+namespace Skugo
+{
+#ifdef SKUGO_COUNT_ALLOCATIONS
+  // Per thread so counting never makes threads contend (plain data, so they need no initialization
+  // and are safe to touch from operator new at any point in a thread's life)
+  static thread_local uint64_t tAllocations = 0;
+  static thread_local int64_t tBytes = 0;
+
+  // Every block starts with its size (padded so the memory we return stays aligned) so frees can be counted
+  static const size_t cHeaderSize = alignof(max_align_t) > sizeof(size_t) ? alignof(max_align_t) : sizeof(size_t);
+
+  /***********************************************************************************************/
+  static void* CountedAllocate(size_t size)
+  {
+    ++tAllocations;
+    tBytes += static_cast<int64_t>(size);
+
+    uint8_t* memory = static_cast<uint8_t*>(malloc(size + cHeaderSize));
+    if (memory == nullptr)
+    {
+      throw bad_alloc();
+    }
+    *reinterpret_cast<size_t*>(memory) = size;
+    return memory + cHeaderSize;
+  }
+
+  /***********************************************************************************************/
+  static void CountedFree(void* memory)
+  {
+    if (memory == nullptr)
+    {
+      return;
+    }
+
+    uint8_t* block = static_cast<uint8_t*>(memory) - cHeaderSize;
+    tBytes -= static_cast<int64_t>(*reinterpret_cast<size_t*>(block));
+    free(block);
+  }
+#endif
+
+  /***********************************************************************************************/
+  AllocationCounter::AllocationCounter() :
+    mStart(GetTotalAllocations()),
+    mStartBytes(0)
+  {
+#ifdef SKUGO_COUNT_ALLOCATIONS
+    mStartBytes = tBytes;
+#endif
+  }
+
+  /***********************************************************************************************/
+  uint64_t AllocationCounter::GetAllocations() const
+  {
+    return GetTotalAllocations() - mStart;
+  }
+
+  /***********************************************************************************************/
+  int64_t AllocationCounter::GetNetBytes() const
+  {
+#ifdef SKUGO_COUNT_ALLOCATIONS
+    return tBytes - mStartBytes;
+#else
+    return 0;
+#endif
+  }
+
+  /***********************************************************************************************/
+  uint64_t AllocationCounter::GetTotalAllocations()
+  {
+#ifdef SKUGO_COUNT_ALLOCATIONS
+    return tAllocations;
+#else
+    return 0;
+#endif
+  }
+
+  /***********************************************************************************************/
+  bool AllocationCounter::IsCounting()
+  {
+#ifdef SKUGO_COUNT_ALLOCATIONS
+    return true;
+#else
+    return false;
+#endif
+  }
+}
+
+#ifdef SKUGO_COUNT_ALLOCATIONS
+/***********************************************************************************************/
+void* operator new(size_t size)
+{
+  return Skugo::CountedAllocate(size);
+}
+
+/***********************************************************************************************/
+void* operator new[](size_t size)
+{
+  return Skugo::CountedAllocate(size);
+}
+
+/***********************************************************************************************/
+void* operator new(size_t size, const std::nothrow_t&) noexcept
+{
+  try
+  {
+    return Skugo::CountedAllocate(size);
+  }
+  catch (...)
+  {
+    return nullptr;
+  }
+}
+
+/***********************************************************************************************/
+void* operator new[](size_t size, const std::nothrow_t&) noexcept
+{
+  try
+  {
+    return Skugo::CountedAllocate(size);
+  }
+  catch (...)
+  {
+    return nullptr;
+  }
+}
+
+/***********************************************************************************************/
+void operator delete(void* memory) noexcept
+{
+  Skugo::CountedFree(memory);
+}
+
+/***********************************************************************************************/
+void operator delete[](void* memory) noexcept
+{
+  Skugo::CountedFree(memory);
+}
+
+/***********************************************************************************************/
+void operator delete(void* memory, size_t) noexcept
+{
+  Skugo::CountedFree(memory);
+}
+
+/***********************************************************************************************/
+void operator delete[](void* memory, size_t) noexcept
+{
+  Skugo::CountedFree(memory);
+}
+
+/***********************************************************************************************/
+void operator delete(void* memory, const std::nothrow_t&) noexcept
+{
+  Skugo::CountedFree(memory);
+}
+
+/***********************************************************************************************/
+void operator delete[](void* memory, const std::nothrow_t&) noexcept
+{
+  Skugo::CountedFree(memory);
+}
+#endif
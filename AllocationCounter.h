@@ -0,0 +1,33 @@
+// Copyright (c) 2017 Trevor Sundberg
+// This code is licensed under the MIT license (see LICENSE.txt for details)
+
+#pragma once
+
+namespace Skugo
+{
+  // Counts every allocation the calling thread makes through the global operator new from the time
+  // it was constructed, and how many bytes were allocated. Used to check that code which should never
+  // touch the heap really doesn't, and to measure how much memory a data structure takes.
+  // Counting replaces the global operator new and delete, so it only happens in builds that define
+  // SKUGO_COUNT_ALLOCATIONS (the Debug configurations). Everywhere else the counts are always zero.
+  class AllocationCounter
+  {
+  public:
+    AllocationCounter();
+
+    uint64_t GetAllocations() const;
+
+    // Bytes allocated minus bytes freed by this thread (only what was asked for, not the heap's own overhead)
+    int64_t GetNetBytes() const;
+
+    // The total for the calling thread over its whole life
+    static uint64_t GetTotalAllocations();
+
+    // Whether this build counts allocations at all
+    static bool IsCounting();
+
+  private:
+    uint64_t mStart;
+    int64_t mStartBytes;
+  };
+}
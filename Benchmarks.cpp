@@ -0,0 +1,1291 @@
+// Copyright (c) 2017 Trevor Sundberg
+// This code is licensed under the MIT license (see LICENSE.txt for details)
+
+#include "Precompiled.h"
+#include "Benchmarks.h"
+#include "SafeObject.h"
+#include "Serialization.h"
+#include "AllocationCounter.h"
+#include "MappedFile.h"
+#include "std_arena_pstring.h"
+#include "std_pstring.h"
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <numeric>
+#include <random>
+#include <thread>
+#include <stdio.h>
+
+namespace Skugo
+{
+  // We measure wall time rather than using clock() because clock() measures
+  // process time on some platforms, which is wrong once multiple threads are involved
+  class BenchmarkTimer
+  {
+  public:
+    BenchmarkTimer() :
+      mStart(chrono::steady_clock::now())
+    {
+    }
+
+    double Seconds() const
+    {
+      return chrono::duration<double>(chrono::steady_clock::now() - mStart).count();
+    }
+
+  private:
+    chrono::steady_clock::time_point mStart;
+  };
+
+  /***********************************************************************************************/
+  string FormatAllocations(const AllocationCounter& counter, double items)
+  {
+    // Builds that don't count allocations print n/a, so a 0 never looks like a result
+    if (!AllocationCounter::IsCounting())
+    {
+      return "n/a";
+    }
+
+    char text[32];
+    snprintf(text, sizeof(text), "%.2f", counter.GetAllocations() / items);
+    return text;
+  }
+
+  // Mirrors the layout of a SafeObject so the old map based registry allocates the same amount
+  class MapRegisteredObject
+  {
+  public:
+    virtual ~MapRegisteredObject()
+    {
+    }
+
+    uint64_t mReferenceCount;
+    uint64_t mId;
+  };
+
+  // An object that is shared across threads, so it opts into atomic reference counting
+  class SharedBenchmarkObject : public SafeObject
+  {
+  public:
+    typedef AtomicReferenceCounting ReferenceCountingPolicy;
+  };
+
+  // A typical object that gets updated every frame
+  class BenchmarkBody : public SafeObject
+  {
+  public:
+    BenchmarkBody() :
+      mPosition(0.0f),
+      mVelocity(1.0f)
+    {
+    }
+
+    float mPosition;
+    float mVelocity;
+  };
+
+  // A declared hierarchy, so typed handles can check types without a dynamic_cast
+  class BenchmarkShape : public SafeObject
+  {
+  public:
+    SkugoSafeObjectType(BenchmarkShape, SafeObject);
+
+    float mArea;
+  };
+
+  class BenchmarkCircle : public BenchmarkShape
+  {
+  public:
+    SkugoSafeObjectType(BenchmarkCircle, BenchmarkShape);
+  };
+
+  // A piece of a streamed level that links to its parent
+  class BenchmarkLevelNode : public SafeObject
+  {
+  public:
+    BenchmarkLevelNode() :
+      mTransform()
+    {
+    }
+
+    void EnumerateHandles(HandleEnumerator& enumerator) override
+    {
+      enumerator.Visit(mParent);
+    }
+
+    void Serialize(GraphWriter& writer) const
+    {
+      writer.Write(mTransform);
+      writer.WriteHandle(mParent);
+    }
+
+    void Deserialize(GraphReader& reader)
+    {
+      reader.Read(mTransform);
+      reader.ReadHandle(mParent);
+    }
+
+    float mTransform[12];
+    Handle mParent;
+  };
+
+  /***********************************************************************************************/
+  void BenchmarkSafeObjectRegistry()
+  {
+    const size_t count = 500000;
+
+    // Dereference in a shuffled order to simulate handles being followed randomly during a frame
+    vector<size_t> order(count);
+    iota(order.begin(), order.end(), 0);
+    shuffle(order.begin(), order.end(), mt19937(1234));
+
+    size_t checksum = 0;
+
+    // The registry as it used to be: an id counter and a hash map from id to object
+    double mapCreate, mapDereference, mapDestroy;
+    {
+      uint64_t idCounter = 1;
+      unordered_map<uint64_t, MapRegisteredObject*> idToObject;
+      vector<uint64_t> ids(count);
+
+      BenchmarkTimer create;
+      for (size_t i = 0; i < count; ++i)
+      {
+        MapRegisteredObject* object = new MapRegisteredObject();
+        object->mReferenceCount = 0;
+        object->mId = idCounter;
+        ++idCounter;
+        idToObject[object->mId] = object;
+        ids[i] = object->mId;
+      }
+      mapCreate = create.Seconds();
+
+      BenchmarkTimer dereference;
+      for (size_t i = 0; i < count; ++i)
+      {
+        auto it = idToObject.find(ids[order[i]]);
+        if (it != idToObject.end())
+        {
+          checksum += static_cast<size_t>(it->second->mId);
+        }
+      }
+      mapDereference = dereference.Seconds();
+
+      BenchmarkTimer destroy;
+      for (size_t i = 0; i < count; ++i)
+      {
+        auto it = idToObject.find(ids[i]);
+        MapRegisteredObject* object = it->second;
+        idToObject.erase(it);
+        delete object;
+      }
+      mapDestroy = destroy.Seconds();
+    }
+
+    // The generational slot map
+    double slotCreate, slotDereference, slotDestroy;
+    {
+      vector<SafeObject*> objects(count);
+      vector<Handle> handles;
+      handles.reserve(count);
+
+      BenchmarkTimer create;
+      for (size_t i = 0; i < count; ++i)
+      {
+        objects[i] = new SafeObject();
+      }
+      slotCreate = create.Seconds();
+
+      for (size_t i = 0; i < count; ++i)
+      {
+        handles.emplace_back(objects[i]);
+      }
+
+      BenchmarkTimer dereference;
+      for (size_t i = 0; i < count; ++i)
+      {
+        SafeObject* object = handles[order[i]].Dereference();
+        if (object)
+        {
+          checksum += reinterpret_cast<size_t>(object) & 1;
+        }
+      }
+      slotDereference = dereference.Seconds();
+
+      BenchmarkTimer destroy;
+      for (size_t i = 0; i < count; ++i)
+      {
+        delete objects[i];
+      }
+      slotDestroy = destroy.Seconds();
+    }
+
+    printf("SafeObject registry (%zu objects, checksum %zu)\n", count, checksum);
+    printf("  Create:      map %f seconds, slots %f seconds\n", mapCreate, slotCreate);
+    printf("  Dereference: map %f seconds, slots %f seconds\n", mapDereference, slotDereference);
+    printf("  Destroy:     map %f seconds, slots %f seconds\n", mapDestroy, slotDestroy);
+  }
+
+  /***********************************************************************************************/
+  void BenchmarkSafeObjectCreationScaling()
+  {
+    const size_t objectsPerThread = 400000;
+    const size_t batchSize = 1000;
+    size_t maxThreads = max<size_t>(thread::hardware_concurrency(), 1);
+
+    printf("SafeObject creation scaling (%zu objects per thread)\n", objectsPerThread);
+
+    double singleThreadedRate = 0.0;
+    for (size_t threadCount = 1; threadCount <= maxThreads; threadCount *= 2)
+    {
+      vector<thread> threads;
+
+      BenchmarkTimer timer;
+      for (size_t t = 0; t < threadCount; ++t)
+      {
+        // Create and destroy in batches so each thread holds a realistic number of live objects
+        threads.emplace_back([=]()
+        {
+          vector<SafeObject*> objects(batchSize);
+          for (size_t created = 0; created < objectsPerThread; created += batchSize)
+          {
+            for (size_t i = 0; i < batchSize; ++i)
+            {
+              objects[i] = new SafeObject();
+            }
+
+            for (size_t i = 0; i < batchSize; ++i)
+            {
+              delete objects[i];
+            }
+          }
+        });
+      }
+
+      for (thread& worker : threads)
+      {
+        worker.join();
+      }
+      double seconds = timer.Seconds();
+
+      double rate = (objectsPerThread * threadCount) / seconds;
+      if (threadCount == 1)
+      {
+        singleThreadedRate = rate;
+      }
+
+      printf("  %2zu threads: %f seconds, %.2f million objects per second (%.2fx)\n",
+        threadCount, seconds, rate / 1000000.0, rate / singleThreadedRate);
+    }
+  }
+
+  /***********************************************************************************************/
+  void BenchmarkHandleContention()
+  {
+    const size_t handlesPerThread = 2000000;
+    size_t maxThreads = max<size_t>(thread::hardware_concurrency(), 1);
+
+    printf("Handle reference counting (%zu handles per thread)\n", handlesPerThread);
+
+    // The non-atomic policy is the baseline for objects that never leave a single thread
+    {
+      SafeObject* object = SkugoNew(SafeObject);
+      Handle keepAlive(object);
+
+      BenchmarkTimer timer;
+      for (size_t i = 0; i < handlesPerThread; ++i)
+      {
+        Handle handle(object);
+      }
+      printf("  non-atomic, 1 thread: %f seconds\n", timer.Seconds());
+    }
+
+    // Every thread creates and destroys handles to the same object, so they all fight over one count
+    for (size_t threadCount = 1; threadCount <= maxThreads; threadCount *= 2)
+    {
+      SharedBenchmarkObject* object = SkugoNew(SharedBenchmarkObject);
+      Handle keepAlive(object);
+      vector<thread> threads;
+
+      BenchmarkTimer timer;
+      for (size_t t = 0; t < threadCount; ++t)
+      {
+        threads.emplace_back([=]()
+        {
+          for (size_t i = 0; i < handlesPerThread; ++i)
+          {
+            Handle handle(object);
+          }
+        });
+      }
+
+      for (thread& worker : threads)
+      {
+        worker.join();
+      }
+      printf("  atomic, %2zu threads: %f seconds\n", threadCount, timer.Seconds());
+    }
+  }
+
+  /***********************************************************************************************/
+  void BenchmarkBulkCreation()
+  {
+    const size_t count = 10000;
+    const size_t rounds = 50;
+    SafeObjectSingleton& singleton = SafeObjectSingleton::Instance();
+
+    printf("Level load of %zu objects (%zu rounds)\n", count, rounds);
+
+    BenchmarkTimer individualTimer;
+    for (size_t round = 0; round < rounds; ++round)
+    {
+      vector<HandleOf<SafeObject>> handles;
+      for (size_t i = 0; i < count; ++i)
+      {
+        handles.emplace_back(SkugoNew(SafeObject));
+      }
+    }
+    printf("  Individual: %f seconds\n", individualTimer.Seconds());
+
+    BenchmarkTimer bulkTimer;
+    for (size_t round = 0; round < rounds; ++round)
+    {
+      vector<HandleOf<SafeObject>> handles;
+      singleton.NewReferenceCountedSafeObjects(count, handles);
+      singleton.ReleaseHandles(handles);
+    }
+    printf("  Bulk:       %f seconds\n", bulkTimer.Seconds());
+  }
+
+  /***********************************************************************************************/
+  void BenchmarkDenseIteration()
+  {
+    const size_t count = 200000;
+    const size_t frames = 100;
+    SafeObjectSingleton& singleton = SafeObjectSingleton::Instance();
+
+    // Interleave creation with another type, just like the old id map would have held every type
+    vector<HandleOf<BenchmarkBody>> bodies;
+    vector<HandleOf<SafeObject>> others;
+    unordered_map<uint64_t, SafeObject*> idToSafeObject;
+    uint64_t id = 1;
+    for (size_t i = 0; i < count; ++i)
+    {
+      BenchmarkBody* body = SkugoNew(BenchmarkBody);
+      bodies.emplace_back(body);
+      idToSafeObject[id++] = body;
+
+      SafeObject* other = SkugoNew(SafeObject);
+      others.emplace_back(other);
+      idToSafeObject[id++] = other;
+    }
+
+    printf("Updating %zu objects of one type (%zu frames)\n", count, frames);
+
+    // Walking the map means visiting every object of every type and checking its dynamic type
+    BenchmarkTimer mapTimer;
+    for (size_t frame = 0; frame < frames; ++frame)
+    {
+      for (auto& pair : idToSafeObject)
+      {
+        BenchmarkBody* body = dynamic_cast<BenchmarkBody*>(pair.second);
+        if (body)
+        {
+          body->mPosition += body->mVelocity;
+        }
+      }
+    }
+    printf("  Map walk: %f seconds\n", mapTimer.Seconds());
+
+    BenchmarkTimer denseTimer;
+    for (size_t frame = 0; frame < frames; ++frame)
+    {
+      singleton.ForEach<BenchmarkBody>([](BenchmarkBody& body)
+      {
+        body.mPosition += body.mVelocity;
+      });
+    }
+    printf("  ForEach:  %f seconds\n", denseTimer.Seconds());
+
+    BenchmarkTimer rangeTimer;
+    for (size_t frame = 0; frame < frames; ++frame)
+    {
+      for (BenchmarkBody& body : singleton.GetObjects<BenchmarkBody>())
+      {
+        body.mPosition += body.mVelocity;
+      }
+    }
+    printf("  Range:    %f seconds\n", rangeTimer.Seconds());
+  }
+
+  /***********************************************************************************************/
+  void BenchmarkObjectStats()
+  {
+    const size_t count = 1000000;
+
+    printf("Object stats (%zu objects)\n", count);
+
+    // The whole create and destroy path, which includes the counters
+    BenchmarkTimer createTimer;
+    for (size_t i = 0; i < count; ++i)
+    {
+      delete SkugoNew(SafeObject);
+    }
+    double createSeconds = createTimer.Seconds();
+    printf("  Create + destroy: %f seconds, %.2f ns per object\n", createSeconds, createSeconds * 1e9 / count);
+
+    // Just the counter updates that create and destroy perform (on a type nothing else uses)
+    SafeObjectType type("BenchmarkStats", sizeof(SafeObject), alignof(SafeObject), nullptr);
+    BenchmarkTimer counterTimer;
+    for (size_t i = 0; i < count; ++i)
+    {
+      lock_guard<mutex> lock(type.mObjectsMutex);
+      type.RecordCreated();
+      type.RecordDestroyed();
+    }
+    double counterSeconds = counterTimer.Seconds();
+
+    BenchmarkTimer lockTimer;
+    for (size_t i = 0; i < count; ++i)
+    {
+      lock_guard<mutex> lock(type.mObjectsMutex);
+    }
+    double lockSeconds = lockTimer.Seconds();
+    printf("  Type lock alone:  %f seconds, %.2f ns per object\n", lockSeconds, lockSeconds * 1e9 / count);
+    printf("  Counters alone:   %f seconds, %.2f ns per object (%llu counted)\n", counterSeconds - lockSeconds,
+      (counterSeconds - lockSeconds) * 1e9 / count, static_cast<unsigned long long>(type.GetStats().mCreated));
+
+    // Stale handles take the slow path that counts the failure
+    Handle live(SkugoNew(SafeObject));
+    SafeObject* deleted = SkugoNew(SafeObject);
+    Handle stale(deleted);
+    delete deleted;
+
+    size_t found = 0;
+    BenchmarkTimer liveTimer;
+    for (size_t i = 0; i < count; ++i)
+    {
+      found += live.Dereference() != nullptr;
+    }
+    double liveSeconds = liveTimer.Seconds();
+
+    BenchmarkTimer staleTimer;
+    for (size_t i = 0; i < count; ++i)
+    {
+      found += stale.Dereference() != nullptr;
+    }
+    double staleSeconds = staleTimer.Seconds();
+    printf("  Dereference:      live %.2f ns, stale %.2f ns (%zu found)\n", liveSeconds * 1e9 / count,
+      staleSeconds * 1e9 / count, found);
+  }
+
+  /***********************************************************************************************/
+  void BenchmarkGraphStreaming()
+  {
+    const size_t count = 200000;
+
+    GraphSerializer serializer;
+    serializer.RegisterType<BenchmarkLevelNode>("BenchmarkLevelNode");
+
+    // A wide tree where every node links to one created before it
+    vector<Handle> nodes;
+    for (size_t i = 0; i < count; ++i)
+    {
+      BenchmarkLevelNode* node = SkugoNew(BenchmarkLevelNode);
+      node->mTransform[0] = static_cast<float>(i);
+      if (i != 0)
+      {
+        node->mParent = nodes[i / 2];
+      }
+      nodes.push_back(Handle(node));
+    }
+
+    printf("Streaming a level of %zu objects\n", count);
+
+    MemoryStreamSink sink;
+    BenchmarkTimer saveTimer;
+    serializer.Save(nodes, sink);
+    printf("  Save: %f seconds (%.1f MB)\n", saveTimer.Seconds(), sink.mData.size() / (1024.0 * 1024.0));
+
+    vector<Handle> loaded;
+    BenchmarkTimer loadTimer;
+    MemoryStreamSource source(sink.mData.data(), sink.mData.size());
+    bool succeeded = serializer.Load(source, loaded);
+    printf("  Load: %f seconds (%s)\n", loadTimer.Seconds(), succeeded ? "succeeded" : "failed");
+  }
+
+  /***********************************************************************************************/
+  void BenchmarkTypedDereference()
+  {
+    const size_t count = 100000;
+    const size_t passes = 20;
+
+    vector<HandleOf<BenchmarkCircle>> circles;
+    vector<HandleOf<BenchmarkShape>> shapes;
+    for (size_t i = 0; i < count; ++i)
+    {
+      BenchmarkCircle* circle = SkugoNew(BenchmarkCircle);
+      circle->mArea = 1.0f;
+      circles.emplace_back(circle);
+      shapes.emplace_back(circle);
+    }
+
+    printf("Typed dereference (%zu handles, %zu passes)\n", count, passes);
+
+    // The object is exactly the handle's type, so the check is a single compare
+    float area = 0.0f;
+    BenchmarkTimer exactTimer;
+    for (size_t pass = 0; pass < passes; ++pass)
+    {
+      for (const HandleOf<BenchmarkCircle>& circle : circles)
+      {
+        area += circle.Dereference()->mArea;
+      }
+    }
+    double exactSeconds = exactTimer.Seconds();
+
+    // The handle's type is a base of the object's type, so the check looks at the object's ancestors
+    BenchmarkTimer baseTimer;
+    for (size_t pass = 0; pass < passes; ++pass)
+    {
+      for (const HandleOf<BenchmarkShape>& shape : shapes)
+      {
+        area += shape.Dereference()->mArea;
+      }
+    }
+    double baseSeconds = baseTimer.Seconds();
+
+    BenchmarkTimer dynamicTimer;
+    for (size_t pass = 0; pass < passes; ++pass)
+    {
+      for (const HandleOf<BenchmarkShape>& shape : shapes)
+      {
+        area += dynamic_cast<BenchmarkShape*>(static_cast<const Handle&>(shape).Dereference())->mArea;
+      }
+    }
+    double dynamicSeconds = dynamicTimer.Seconds();
+
+    BenchmarkTimer uncheckedTimer;
+    for (size_t pass = 0; pass < passes; ++pass)
+    {
+      for (const HandleOf<BenchmarkShape>& shape : shapes)
+      {
+        area += static_cast<BenchmarkShape*>(static_cast<const Handle&>(shape).Dereference())->mArea;
+      }
+    }
+    double uncheckedSeconds = uncheckedTimer.Seconds();
+
+    size_t dereferences = count * passes;
+    printf("  Exact type:   %f seconds (%.2f ns each)\n", exactSeconds, exactSeconds * 1e9 / dereferences);
+    printf("  Base type:    %f seconds (%.2f ns each)\n", baseSeconds, baseSeconds * 1e9 / dereferences);
+    printf("  dynamic_cast: %f seconds (%.2f ns each)\n", dynamicSeconds, dynamicSeconds * 1e9 / dereferences);
+    printf("  Unchecked:    %f seconds (%.2f ns each, area %.0f)\n", uncheckedSeconds,
+      uncheckedSeconds * 1e9 / dereferences, area);
+  }
+
+  /***********************************************************************************************/
+  void BenchmarkWeakHandles()
+  {
+    const size_t count = 100000;
+    const size_t copies = 20;
+
+    vector<Handle> objects;
+    vector<Handle> sharedObjects;
+    for (size_t i = 0; i < count; ++i)
+    {
+      objects.push_back(Handle(SkugoNew(SafeObject)));
+      sharedObjects.push_back(Handle(SkugoNew(SharedBenchmarkObject)));
+    }
+
+    printf("Copying %zu handles (%zu times)\n", count, copies);
+
+    // Like a listener list that is copied every time an event is dispatched
+    BenchmarkTimer strongTimer;
+    for (size_t i = 0; i < copies; ++i)
+    {
+      vector<Handle> listeners(objects);
+    }
+    printf("  Handle:        %f seconds\n", strongTimer.Seconds());
+
+    BenchmarkTimer atomicTimer;
+    for (size_t i = 0; i < copies; ++i)
+    {
+      vector<Handle> listeners(sharedObjects);
+    }
+    printf("  Handle atomic: %f seconds\n", atomicTimer.Seconds());
+
+    vector<WeakHandle> weakObjects(objects.begin(), objects.end());
+    BenchmarkTimer weakTimer;
+    for (size_t i = 0; i < copies; ++i)
+    {
+      vector<WeakHandle> listeners(weakObjects);
+    }
+    printf("  WeakHandle:    %f seconds\n", weakTimer.Seconds());
+  }
+
+  // The same pool as pstring, but with a single lock like it used to have
+  typedef pooled<istring, hash<istring>, equal_to<istring>, allocator<istring>, 1> SingleLockPString;
+
+  /***********************************************************************************************/
+  template <typename PooledString>
+  double RunInterningThreads(size_t threadCount, size_t internsPerThread, const vector<string>& names)
+  {
+    vector<thread> threads;
+    BenchmarkTimer timer;
+    for (size_t t = 0; t < threadCount; ++t)
+    {
+      // Each loader thread keeps a window of the names it interned alive, like a streaming level would
+      threads.emplace_back([=, &names]()
+      {
+        const size_t window = 256;
+        vector<PooledString> interned(window);
+        for (size_t i = 0; i < internsPerThread; ++i)
+        {
+          interned[i % window] = PooledString(names[(i * 7 + t * 977) % names.size()]);
+        }
+      });
+    }
+
+    for (thread& worker : threads)
+    {
+      worker.join();
+    }
+    return timer.Seconds();
+  }
+
+  /***********************************************************************************************/
+  void BenchmarkInterning()
+  {
+    const size_t nameCount = 20000;
+    const size_t internsPerThread = 100000;
+
+    vector<string> names;
+    for (size_t i = 0; i < nameCount; ++i)
+    {
+      names.push_back("Assets/Textures/Rock" + to_string(i) + ".png");
+    }
+
+    // Sharding only pays off when the threads actually run in parallel
+    printf("Interning asset names (%zu per thread, %u hardware threads)\n", internsPerThread, thread::hardware_concurrency());
+    for (size_t threadCount = 1; threadCount <= 32; threadCount *= 2)
+    {
+      double singleLockSeconds = RunInterningThreads<SingleLockPString>(threadCount, internsPerThread, names);
+      double shardedSeconds = RunInterningThreads<pstring>(threadCount, internsPerThread, names);
+      double interns = static_cast<double>(threadCount * internsPerThread);
+      printf("  %2zu threads: single lock %.2f, sharded %.2f million interns per second\n", threadCount,
+        interns / singleLockSeconds / 1000000.0, interns / shardedSeconds / 1000000.0);
+    }
+  }
+
+  // Mirrors how pooled used to count references: every copy takes the lock, and every
+  // release takes it and finds the value in the map again
+  class LockedCountString
+  {
+  public:
+    LockedCountString(const string& value)
+    {
+      lock_guard<mutex> guard(Mutex());
+      mPair = &*Map().insert(make_pair(value, 0)).first;
+      ++mPair->second;
+    }
+
+    LockedCountString(const LockedCountString& rhs) :
+      mPair(rhs.mPair)
+    {
+      lock_guard<mutex> guard(Mutex());
+      ++mPair->second;
+    }
+
+    ~LockedCountString()
+    {
+      lock_guard<mutex> guard(Mutex());
+      unordered_map<string, int>::iterator it = Map().find(mPair->first);
+      if (--it->second == 0)
+      {
+        Map().erase(it);
+      }
+    }
+
+  private:
+    LockedCountString& operator=(const LockedCountString&) = delete;
+
+    static mutex& Mutex()
+    {
+      static mutex instance;
+      return instance;
+    }
+
+    static unordered_map<string, int>& Map()
+    {
+      static unordered_map<string, int> instance;
+      return instance;
+    }
+
+    pair<const string, int>* mPair;
+  };
+
+  /***********************************************************************************************/
+  template <typename PooledString>
+  double RunCopyingThreads(size_t threadCount, size_t copies, const vector<string>& names)
+  {
+    vector<PooledString> strings(names.begin(), names.end());
+
+    // Every thread copies (and then destroys) the same strings, so they all fight over the same counts
+    vector<thread> threads;
+    BenchmarkTimer timer;
+    for (size_t t = 0; t < threadCount; ++t)
+    {
+      threads.emplace_back([&]()
+      {
+        for (size_t i = 0; i < copies; ++i)
+        {
+          vector<PooledString> copied(strings);
+        }
+      });
+    }
+
+    for (thread& worker : threads)
+    {
+      worker.join();
+    }
+    return timer.Seconds();
+  }
+
+  /***********************************************************************************************/
+  void BenchmarkPooledCopying()
+  {
+    const size_t nameCount = 10000;
+    const size_t copies = 50;
+
+    vector<string> names;
+    for (size_t i = 0; i < nameCount; ++i)
+    {
+      names.push_back("Assets/Meshes/Tree" + to_string(i) + ".mesh");
+    }
+
+    // Pinning is permanent, so the pinned strings get names of their own
+    vector<string> pinnedNames;
+    for (size_t i = 0; i < nameCount; ++i)
+    {
+      pinnedNames.push_back("Assets/Meshes/Rock" + to_string(i) + ".mesh");
+      pstring(pinnedNames.back()).pin();
+    }
+
+    printf("Copying and destroying %zu pooled strings (%zu times per thread)\n", nameCount, copies);
+    for (size_t threadCount = 1; threadCount <= 8; threadCount *= 2)
+    {
+      double lockedSeconds = RunCopyingThreads<LockedCountString>(threadCount, copies, names);
+      double atomicSeconds = RunCopyingThreads<pstring>(threadCount, copies, names);
+      double pinnedSeconds = RunCopyingThreads<pstring>(threadCount, copies, pinnedNames);
+      double operations = static_cast<double>(threadCount * copies * nameCount);
+      printf("  %zu threads: locked count %.2f ns, atomic count %.2f ns, pinned %.2f ns per copy and destroy\n",
+        threadCount, lockedSeconds * 1e9 / operations, atomicSeconds * 1e9 / operations, pinnedSeconds * 1e9 / operations);
+    }
+  }
+
+  /***********************************************************************************************/
+  void BenchmarkPooledLiterals()
+  {
+    const size_t eventCount = 1000000;
+
+    // A stream of events being dispatched to handlers that check their names against literals
+    const char* kinds[] = { "OnCollisionStarted", "OnCollisionPersisted", "OnCollisionEnded", "OnUpdate" };
+    vector<pstring> events;
+    for (size_t i = 0; i < eventCount; ++i)
+    {
+      events.push_back(pstring(kinds[(i * 7) % 4]));
+    }
+
+    printf("Dispatching %zu events by name\n", eventCount);
+
+    size_t collisions = 0;
+    BenchmarkTimer runtimeTimer;
+    for (const pstring& name : events)
+    {
+      if (name == pstring("OnCollisionStarted") || name == pstring("OnCollisionEnded"))
+      {
+        ++collisions;
+      }
+    }
+    printf("  Interned each time: %f seconds (%zu collisions)\n", runtimeTimer.Seconds(), collisions);
+
+    size_t literalCollisions = 0;
+    BenchmarkTimer literalTimer;
+    for (const pstring& name : events)
+    {
+      if (name == PSTRING("OnCollisionStarted") || name == PSTRING("OnCollisionEnded"))
+      {
+        ++literalCollisions;
+      }
+    }
+    printf("  PSTRING:            %f seconds (%zu collisions)\n", literalTimer.Seconds(), literalCollisions);
+  }
+
+  /***********************************************************************************************/
+  size_t GetInternedBytes(const pstring*)
+  {
+    // The pool's nodes hold each istring, and longer strings keep their characters on the heap
+    pooled_memory_stats stats = pstring::get_memory_stats();
+    size_t bytes = stats.m_node_bytes + stats.m_table_bytes;
+    pstring::for_each_value([&bytes](const istring& value)
+    {
+      const char* inside = reinterpret_cast<const char*>(&value);
+      if (value.data() < inside || value.data() >= inside + sizeof(value))
+      {
+        bytes += value.capacity() + 1;
+      }
+    });
+    return bytes;
+  }
+
+  /***********************************************************************************************/
+  size_t GetInternedBytes(const arena_pstring*)
+  {
+    arena_pstring_stats stats = arena_pstring::get_stats();
+    return stats.m_table_bytes + stats.m_slab_bytes;
+  }
+
+  /***********************************************************************************************/
+  template <typename InternedString>
+  void MeasureInternedStrings(const char* label, const vector<string>& names)
+  {
+    vector<InternedString> interned;
+    interned.reserve(names.size());
+
+    // Builds that don't count allocations ask the interned strings' own structures instead
+    size_t bytesBefore = GetInternedBytes(static_cast<const InternedString*>(nullptr));
+    AllocationCounter counter;
+    BenchmarkTimer internTimer;
+    for (const string& name : names)
+    {
+      interned.push_back(InternedString(name));
+    }
+    double internSeconds = internTimer.Seconds();
+    double bytes = static_cast<double>(counter.GetNetBytes());
+    if (!AllocationCounter::IsCounting())
+    {
+      bytes = static_cast<double>(GetInternedBytes(static_cast<const InternedString*>(nullptr)) - bytesBefore);
+    }
+    string allocations = FormatAllocations(counter, static_cast<double>(names.size()));
+
+    // Looking up names that are already interned (like resolving references while loading)
+    size_t matches = 0;
+    BenchmarkTimer lookupTimer;
+    for (size_t i = 0; i < names.size(); ++i)
+    {
+      if (InternedString(names[i]) == interned[i])
+      {
+        ++matches;
+      }
+    }
+    double lookupSeconds = lookupTimer.Seconds();
+
+    printf("  %s: %.1f MB (%.1f bytes and %s allocations per name), intern %f seconds, lookup %f seconds (%zu)\n",
+      label, bytes / (1024.0 * 1024.0), bytes / names.size(), allocations.c_str(),
+      internSeconds, lookupSeconds, matches);
+  }
+
+  /***********************************************************************************************/
+  void BenchmarkInternedStringMemory()
+  {
+    const size_t nameCount = 1000000;
+
+    // A mix of short names (that fit in a std::string without allocating) and longer paths
+    vector<string> names;
+    for (size_t i = 0; i < nameCount; ++i)
+    {
+      switch (i % 3)
+      {
+      case 0:
+        names.push_back("Entity" + to_string(i));
+        break;
+      case 1:
+        names.push_back("Player.Inventory.Slot" + to_string(i));
+        break;
+      default:
+        names.push_back("Assets/Textures/Environment/Rock" + to_string(i) + ".png");
+        break;
+      }
+    }
+
+    // The heap's own overhead per allocation isn't counted either way, which flatters the pooled layout
+    printf("Interning %zu identifiers (%s, not counting heap overhead)\n", nameCount,
+      AllocationCounter::IsCounting() ? "heap bytes requested" : "bytes in the pool and arena structures");
+    MeasureInternedStrings<pstring>("pstring      ", names);
+    MeasureInternedStrings<arena_pstring>("arena_pstring", names);
+
+    arena_pstring_stats stats = arena_pstring::get_stats();
+    printf("  arena_pstring: %zu entries, %.1f MB of tables, %.1f MB of slabs (%.1f MB used)\n", stats.m_entries,
+      stats.m_table_bytes / (1024.0 * 1024.0), stats.m_slab_bytes / (1024.0 * 1024.0),
+      stats.m_used_slab_bytes / (1024.0 * 1024.0));
+  }
+
+  /***********************************************************************************************/
+  void BenchmarkPooledIdTables()
+  {
+    const size_t propertyCount = 1000;
+    const size_t lookupCount = 10000000;
+
+    vector<pstring> properties;
+    unordered_map<pstring, int> byName;
+    vector<int> byId;
+    for (size_t i = 0; i < propertyCount; ++i)
+    {
+      pstring name("Property" + to_string(i));
+      properties.push_back(name);
+      byName[name] = static_cast<int>(i);
+      byId.resize(max<size_t>(byId.size(), name.id() + 1), -1);
+      byId[name.id()] = static_cast<int>(i);
+    }
+
+    printf("Looking up %zu properties by name (%zu times)\n", propertyCount, lookupCount);
+
+    long long sum = 0;
+    BenchmarkTimer mapTimer;
+    for (size_t i = 0; i < lookupCount; ++i)
+    {
+      sum += byName.find(properties[(i * 7) % propertyCount])->second;
+    }
+    printf("  unordered_map by pointer hash: %f seconds\n", mapTimer.Seconds());
+
+    long long idSum = 0;
+    BenchmarkTimer idTimer;
+    for (size_t i = 0; i < lookupCount; ++i)
+    {
+      idSum += byId[properties[(i * 7) % propertyCount].id()];
+    }
+    printf("  Flat array by id:              %f seconds (%s)\n", idTimer.Seconds(), sum == idSum ? "same results" : "different results");
+  }
+
+  /***********************************************************************************************/
+  double RunScriptInterning(size_t threadCount, bool useCache, const vector<string>& names, size_t interns,
+    pooled_cache_stats& statsOut)
+  {
+    // Like a script VM resolving the name in each instruction it runs: a few names are very hot
+    vector<vector<uint32_t>> sequences(threadCount);
+    for (size_t t = 0; t < threadCount; ++t)
+    {
+      mt19937 random(static_cast<unsigned>(t));
+      for (size_t i = 0; i < interns; ++i)
+      {
+        size_t index = random() % names.size();
+        sequences[t].push_back(static_cast<uint32_t>(index * (random() % names.size()) / names.size()));
+      }
+    }
+
+    vector<pooled_cache_stats> stats(threadCount);
+    vector<thread> threads;
+    BenchmarkTimer timer;
+    for (size_t t = 0; t < threadCount; ++t)
+    {
+      threads.emplace_back([&, t]()
+      {
+        pstring::set_thread_cache_enabled(useCache);
+
+        size_t checksum = 0;
+        for (uint32_t index : sequences[t])
+        {
+          checksum += pstring(names[index])->size();
+        }
+
+        stats[t] = pstring::get_thread_cache_stats();
+        pstring::set_thread_cache_enabled(false);
+        if (checksum == 0)
+        {
+          printf("  (no names were interned)\n");
+        }
+      });
+    }
+
+    for (thread& worker : threads)
+    {
+      worker.join();
+    }
+    double seconds = timer.Seconds();
+
+    statsOut = pooled_cache_stats();
+    for (pooled_cache_stats& threadStats : stats)
+    {
+      statsOut.m_hits += threadStats.m_hits;
+      statsOut.m_misses += threadStats.m_misses;
+    }
+    return seconds;
+  }
+
+  /***********************************************************************************************/
+  void BenchmarkPooledThreadCache()
+  {
+    const size_t interns = 2000000;
+
+    printf("Interning script names (%zu per thread)\n", interns);
+    for (size_t nameCount = 500; nameCount <= 5000; nameCount *= 10)
+    {
+      // Every name is kept alive elsewhere (like the constants of loaded scripts)
+      vector<string> names;
+      vector<pstring> loaded;
+      for (size_t i = 0; i < nameCount; ++i)
+      {
+        names.push_back("Script.Component" + to_string(i % 37) + ".Property" + to_string(i));
+        loaded.push_back(pstring(names.back()));
+      }
+
+      for (size_t threadCount = 1; threadCount <= 4; threadCount *= 4)
+      {
+        pooled_cache_stats stats;
+        double offSeconds = RunScriptInterning(threadCount, false, names, interns, stats);
+        double onSeconds = RunScriptInterning(threadCount, true, names, interns, stats);
+        double total = static_cast<double>(threadCount * interns);
+        printf("  %zu names, %zu threads: cache off %.1f ns, cache on %.1f ns per intern (%.1f%% hits)\n",
+          nameCount, threadCount, offSeconds * 1e9 / total, onSeconds * 1e9 / total,
+          100.0 * stats.m_hits / static_cast<double>(stats.m_hits + stats.m_misses));
+      }
+    }
+  }
+
+  /***********************************************************************************************/
+  void BenchmarkDeferredPooledRelease()
+  {
+    const size_t frames = 2000;
+    const size_t tokensPerFrame = 500;
+    const size_t tokenCount = 2000;
+
+    // Like a parser that interns every token of each line it reads and lets go of them all at the
+    // end of the frame, when most of the same tokens are about to show up again
+    vector<string> tokens;
+    for (size_t i = 0; i < tokenCount; ++i)
+    {
+      tokens.push_back("token_" + to_string(i % 61) + "_" + to_string(i));
+    }
+
+    printf("Interning temporary tokens (%zu frames of %zu)\n", frames, tokensPerFrame);
+    for (size_t threshold = 0; threshold <= 1024; threshold += 1024)
+    {
+      pstring::defer_release(threshold);
+
+      mt19937 random(7);
+      vector<pstring> frame;
+      frame.reserve(tokensPerFrame);
+      AllocationCounter counter;
+      BenchmarkTimer timer;
+      for (size_t f = 0; f < frames; ++f)
+      {
+        for (size_t i = 0; i < tokensPerFrame; ++i)
+        {
+          frame.push_back(pstring(tokens[random() % tokenCount]));
+        }
+        frame.clear();
+
+        // A small budget each frame keeps dead entries from piling up
+        pstring::collect(64);
+      }
+      double seconds = timer.Seconds();
+
+      double total = static_cast<double>(frames * tokensPerFrame);
+      printf("  %s: %.1f ns and %s allocations per token\n", threshold == 0 ? "Released right away" : "Deferred           ",
+        seconds * 1e9 / total, FormatAllocations(counter, total).c_str());
+    }
+    pstring::defer_release(0);
+  }
+
+  /***********************************************************************************************/
+  string ReadWholeFile(const char* path)
+  {
+    FileStreamSource source(path);
+    string contents;
+    char chunk[64 * 1024];
+    for (size_t read = source.Read(chunk, sizeof(chunk)); read != 0; read = source.Read(chunk, sizeof(chunk)))
+    {
+      contents.append(chunk, read);
+    }
+    return contents;
+  }
+
+  /***********************************************************************************************/
+  template <typename Function>
+  void ForEachLine(const string& text, Function function)
+  {
+    size_t start = 0;
+    for (size_t end = text.find('\n'); end != string::npos; end = text.find('\n', start))
+    {
+      function(istring_view(text.data() + start, end - start));
+      start = end + 1;
+    }
+  }
+
+  /***********************************************************************************************/
+  void BenchmarkStringTableStartup()
+  {
+    const size_t nameCount = 300000;
+    const char* textPath = "SkugoStartupNames.txt";
+    const char* tablePath = "SkugoStartupNames.table";
+
+    // The names a program needs at startup, one per line (like a manifest of assets and properties)
+    {
+      FileStreamSink sink(textPath);
+      for (size_t i = 0; i < nameCount; ++i)
+      {
+        string name = "Startup/Level" + to_string(i % 97) + "/Prop" + to_string(i) + ".Transform\n";
+        sink.Write(name.data(), name.size());
+      }
+    }
+
+    printf("Starting up with %zu names\n", nameCount);
+    BenchmarkTimer textTimer;
+    string text = ReadWholeFile(textPath);
+    vector<pstring> interned;
+    interned.reserve(nameCount);
+    ForEachLine(text, [&interned](const istring_view& name)
+    {
+      interned.push_back(pstring(name));
+    });
+    printf("  Interning each name from text: %.2f ms\n", textTimer.Seconds() * 1000.0);
+
+    // The tool side: save everything that was interned
+    {
+      string table = arena_pstring::build_table_from_pstrings();
+      FileStreamSink sink(tablePath);
+      sink.Write(table.data(), table.size());
+    }
+    interned.clear();
+
+    // Loaded strings are immortal, so the file stays mapped for the rest of the program
+    BenchmarkTimer mapTimer;
+    MappedFile* mapped = new MappedFile(tablePath);
+    bool loaded = mapped->IsOpen() && arena_pstring::load_table(mapped->GetData(), mapped->GetSize());
+    printf("  Mapping the prebuilt table:    %.2f ms (%zu bytes, %s)\n", mapTimer.Seconds() * 1000.0, mapped->GetSize(),
+      loaded ? "loaded" : "failed to load");
+
+    // Every name is then found in the mapped table (touching its pages for the first time)
+    AllocationCounter counter;
+    BenchmarkTimer lookupTimer;
+    size_t outside = 0;
+    const char* begin = static_cast<const char*>(mapped->GetData());
+    ForEachLine(text, [&](const istring_view& name)
+    {
+      const char* found = arena_pstring(name).c_str();
+      if (found < begin || found >= begin + mapped->GetSize())
+      {
+        ++outside;
+      }
+    });
+    printf("  Then looking up every name:    %.2f ms (%s allocations, %zu not in the table)\n",
+      lookupTimer.Seconds() * 1000.0, FormatAllocations(counter, 1.0).c_str(), outside);
+
+    // The table can't be removed while it's mapped on some platforms, which is fine for a benchmark
+    remove(textPath);
+    remove(tablePath);
+  }
+
+  /***********************************************************************************************/
+  template <typename Function>
+  void ForEachToken(const pstring& source, Function function)
+  {
+    // Identifiers and numbers are whole tokens, and every other character that isn't a space is its own
+    const istring& text = *source;
+    size_t i = 0;
+    while (i < text.size())
+    {
+      unsigned char character = static_cast<unsigned char>(text[i]);
+      if (isspace(character))
+      {
+        ++i;
+        continue;
+      }
+
+      size_t start = i++;
+      if (isalnum(character) || character == '_')
+      {
+        while (i < text.size() && (isalnum(static_cast<unsigned char>(text[i])) || text[i] == '_'))
+        {
+          ++i;
+        }
+      }
+      function(start, i - start);
+    }
+  }
+
+  /***********************************************************************************************/
+  void BenchmarkTokenizing()
+  {
+    const size_t corpusSize = 50 * 1024 * 1024;
+
+    // Script source where most identifiers repeat (like the locals and members of many small functions)
+    string text;
+    text.reserve(corpusSize + 256);
+    for (size_t i = 0; text.size() < corpusSize; ++i)
+    {
+      string index = to_string(i % 4099);
+      text += "function Update" + index + "(entity, deltaTime)\n{\n";
+      text += "  var velocity" + index + " = entity.rigidBody.velocity * deltaTime;\n";
+      text += "  if (velocity" + index + ".length > 0.5) { entity.transform.position += velocity" + index + "; }\n";
+      text += "  return entity.health - " + to_string(i % 100) + ";\n}\n";
+    }
+    pstring source(text);
+    text = string();
+
+    printf("Tokenizing %.1f MB of script\n", source->size() / (1024.0 * 1024.0));
+    pstring keyword("entity");
+
+    // What istring::substr does for every token
+    {
+      size_t tokens = 0;
+      size_t matches = 0;
+      AllocationCounter counter;
+      BenchmarkTimer timer;
+      ForEachToken(source, [&](size_t start, size_t length)
+      {
+        pstring token(string(source->data() + start, length));
+        matches += token == keyword;
+        ++tokens;
+      });
+      double seconds = timer.Seconds();
+      printf("  Interning each token: %.1f ns and %s allocations per token (%zu tokens, %zu matches)\n",
+        seconds * 1e9 / tokens, FormatAllocations(counter, static_cast<double>(tokens)).c_str(), tokens, matches);
+    }
+
+    {
+      size_t tokens = 0;
+      size_t matches = 0;
+      AllocationCounter counter;
+      BenchmarkTimer timer;
+      ForEachToken(source, [&](size_t start, size_t length)
+      {
+        pstring_view token = source->slice(start, length);
+        matches += token == keyword;
+        ++tokens;
+      });
+      double seconds = timer.Seconds();
+      printf("  Slicing views:        %.1f ns and %s allocations per token (%zu tokens, %zu matches)\n",
+        seconds * 1e9 / tokens, FormatAllocations(counter, static_cast<double>(tokens)).c_str(), tokens, matches);
+    }
+  }
+
+  /***********************************************************************************************/
+  void RunBenchmarks()
+  {
+    if (!AllocationCounter::IsCounting())
+    {
+      printf("(Allocations are only counted in builds that define SKUGO_COUNT_ALLOCATIONS, so they read as n/a)\n");
+    }
+
+    BenchmarkSafeObjectRegistry();
+    BenchmarkSafeObjectCreationScaling();
+    BenchmarkHandleContention();
+    BenchmarkBulkCreation();
+    BenchmarkDenseIteration();
+    BenchmarkObjectStats();
+    BenchmarkGraphStreaming();
+    BenchmarkTypedDereference();
+    BenchmarkWeakHandles();
+    BenchmarkInterning();
+    BenchmarkPooledCopying();
+    BenchmarkPooledLiterals();
+    BenchmarkInternedStringMemory();
+    BenchmarkPooledIdTables();
+    BenchmarkPooledThreadCache();
+    BenchmarkDeferredPooledRelease();
+    BenchmarkStringTableStartup();
+    BenchmarkTokenizing();
+  }
+}
@@ -0,0 +1,9 @@
+// Copyright (c) 2017 Trevor Sundberg
+// This code is licensed under the MIT license (see LICENSE.txt for details)
+
+#pragma once
+
+namespace Skugo
+{
+  void RunBenchmarks();
+}
@@ -0,0 +1,407 @@
+// Copyright (c) 2017 Trevor Sundberg
+// This code is licensed under the MIT license (see LICENSE.txt for details)
+
+#include "Precompiled.h"
+#include "CycleCollector.h"
+#include <chrono>
+
+namespace Skugo
+{
+  /***********************************************************************************************/
+  CycleCollector::CycleCollector() :
+    mPhase(Phase::Idle),
+    mEnabled(true),
+    mStats(),
+    mScanPosition(0)
+  {
+  }
+
+  /***********************************************************************************************/
+  CycleCollector::~CycleCollector()
+  {
+    // Normally a disabled collector is wound down over slices before it is destroyed, but if the
+    // singleton is going away first, whatever is left has to be unwound all at once
+    mEnabled = false;
+    while (!Step())
+    {
+    }
+  }
+
+  /***********************************************************************************************/
+  void CycleCollector::PossibleRoot(SafeObject* safeObject)
+  {
+    // Anything in progress is being given up on, so there is no need to track changes either
+    if (!mEnabled)
+    {
+      return;
+    }
+
+    uint8_t flags = safeObject->mCycleFlags;
+    if (flags & cInCollection)
+    {
+      safeObject->mCycleFlags |= cDirty;
+    }
+
+    // Garbage that is being freed releases its references to other garbage
+    if ((flags & (cBuffered | cCondemned)) == 0)
+    {
+      safeObject->mCycleFlags |= cBuffered;
+      mPossibleRoots.push_back(safeObject->mId);
+    }
+  }
+
+  /***********************************************************************************************/
+  bool CycleCollector::Collect(uint64_t budgetMicroseconds)
+  {
+    chrono::steady_clock::time_point deadline = chrono::steady_clock::now() + chrono::microseconds(budgetMicroseconds);
+
+    size_t work = 0;
+    while (!Step())
+    {
+      ++work;
+      if (work % cWorkPerClockCheck == 0 && chrono::steady_clock::now() >= deadline)
+      {
+        return mPhase == Phase::Idle && mPossibleRoots.empty();
+      }
+    }
+    return true;
+  }
+
+  /***********************************************************************************************/
+  void CycleCollector::SetEnabled(bool enabled)
+  {
+    mEnabled = enabled;
+  }
+
+  /***********************************************************************************************/
+  bool CycleCollector::IsEnabled() const
+  {
+    return mEnabled;
+  }
+
+  /***********************************************************************************************/
+  const CycleCollectorStats& CycleCollector::GetStats() const
+  {
+    return mStats;
+  }
+
+  /***********************************************************************************************/
+  void CycleCollector::Visit(const Handle& handle)
+  {
+    SafeObject* child = Find(GetId(handle));
+    if (child == nullptr || !IsCollectable(child))
+    {
+      return;
+    }
+
+    size_t childIndex = GetNode(child);
+    mEdges.push_back(childIndex);
+    ++mNodes[childIndex].mInternalReferences;
+  }
+
+  /***********************************************************************************************/
+  bool CycleCollector::Step()
+  {
+    switch (mPhase)
+    {
+    case Phase::Idle:
+      if (mPossibleRoots.empty())
+      {
+        return true;
+      }
+
+      if (mEnabled)
+      {
+        BeginCollection();
+      }
+      else
+      {
+        ForgetRootStep();
+      }
+      break;
+    case Phase::Trace:
+    case Phase::Scan:
+    case Phase::Condemn:
+      // A disabled collector gives up on whatever it was in the middle of
+      if (!mEnabled)
+      {
+        BeginAbort();
+      }
+      else if (mPhase == Phase::Trace)
+      {
+        TraceStep();
+      }
+      else if (mPhase == Phase::Scan)
+      {
+        ScanStep();
+      }
+      else
+      {
+        CondemnStep();
+      }
+      break;
+    case Phase::Free:
+      FreeStep();
+      break;
+    case Phase::Abort:
+      AbortStep();
+      break;
+    }
+    return false;
+  }
+
+  /***********************************************************************************************/
+  void CycleCollector::BeginCollection()
+  {
+    mRoots.swap(mPossibleRoots);
+    mScanPosition = 0;
+    mPhase = Phase::Trace;
+  }
+
+  /***********************************************************************************************/
+  void CycleCollector::TraceStep()
+  {
+    // The roots are taken one per step before anything they reach is traced
+    if (mScanPosition < mRoots.size())
+    {
+      // The root may have died (or been explicitly deleted) since it was buffered
+      SafeObject* safeObject = Find(mRoots[mScanPosition]);
+      ++mScanPosition;
+      if (safeObject)
+      {
+        safeObject->mCycleFlags &= ~cBuffered;
+        if (IsCollectable(safeObject))
+        {
+          GetNode(safeObject);
+          ++mStats.mRootsScanned;
+        }
+      }
+      return;
+    }
+
+    if (mWorkList.empty())
+    {
+      mScanPosition = 0;
+      mPhase = Phase::Scan;
+      return;
+    }
+
+    size_t index = mWorkList.back();
+    mWorkList.pop_back();
+
+    // Anything we found may have been deleted since the last slice
+    SafeObject* safeObject = Find(mNodes[index].mId);
+    if (safeObject == nullptr)
+    {
+      BeginAbort();
+      return;
+    }
+
+    // Visiting adds nodes, so we can't hold onto a reference to ours
+    mNodes[index].mReferenceCount = safeObject->mReferenceCount.load(memory_order_relaxed);
+    mNodes[index].mEdgesBegin = mEdges.size();
+    safeObject->EnumerateHandles(*this);
+    mNodes[index].mEdgesEnd = mEdges.size();
+    ++mStats.mObjectsTraced;
+  }
+
+  /***********************************************************************************************/
+  void CycleCollector::ScanStep()
+  {
+    // Everything a live object references is also live
+    if (!mWorkList.empty())
+    {
+      size_t index = mWorkList.back();
+      mWorkList.pop_back();
+
+      for (size_t i = mNodes[index].mEdgesBegin; i < mNodes[index].mEdgesEnd; ++i)
+      {
+        Node& child = mNodes[mEdges[i]];
+        if (!child.mIsLive)
+        {
+          child.mIsLive = true;
+          mWorkList.push_back(mEdges[i]);
+        }
+      }
+      return;
+    }
+
+    // An object with references that don't come from traced objects is held from outside
+    if (mScanPosition < mNodes.size())
+    {
+      Node& node = mNodes[mScanPosition];
+      if (!node.mIsLive && node.mReferenceCount > node.mInternalReferences)
+      {
+        node.mIsLive = true;
+        mWorkList.push_back(mScanPosition);
+      }
+      ++mScanPosition;
+      return;
+    }
+
+    mScanPosition = 0;
+    mPhase = Phase::Condemn;
+  }
+
+  /***********************************************************************************************/
+  void CycleCollector::CondemnStep()
+  {
+    if (mScanPosition == mNodes.size())
+    {
+      mStats.mGarbageFound += mGarbage.size();
+      mPhase = Phase::Free;
+      return;
+    }
+
+    // If anything was deleted or had its count changed since we traced it, the graph we saw is stale
+    Node& node = mNodes[mScanPosition];
+    SafeObject* safeObject = Find(node.mId);
+    if (safeObject == nullptr || (safeObject->mCycleFlags & cDirty))
+    {
+      BeginAbort();
+      return;
+    }
+
+    safeObject->mCycleFlags &= ~(cInCollection | cDirty);
+    ++mScanPosition;
+
+    // Nothing outside the garbage can reach it, so it is safe to free over the next slices
+    if (!node.mIsLive)
+    {
+      safeObject->mCycleFlags |= cCondemned;
+      safeObject->AddReference();
+      mGarbage.push_back(node.mId);
+    }
+  }
+
+  /***********************************************************************************************/
+  void CycleCollector::FreeStep()
+  {
+    if (mGarbage.empty())
+    {
+      EndCollection();
+      return;
+    }
+
+    uint64_t id = mGarbage.back();
+    mGarbage.pop_back();
+
+    // We hold a reference to all of the garbage, so deleting one object never frees another
+    SafeObject* safeObject = Find(id);
+    SafeObjectSingleton::Instance().Delete(safeObject);
+  }
+
+  /***********************************************************************************************/
+  void CycleCollector::AbortStep()
+  {
+    // First every node loses its marks (and condemned nodes get back the reference we took)
+    if (mScanPosition < mNodes.size())
+    {
+      SafeObject* safeObject = Find(mNodes[mScanPosition].mId);
+      ++mScanPosition;
+      if (safeObject)
+      {
+        uint8_t flags = safeObject->mCycleFlags;
+        safeObject->mCycleFlags = flags & ~(cInCollection | cDirty | cCondemned);
+        if ((flags & cCondemned) && safeObject->ReleaseReference())
+        {
+          SafeObjectSingleton::Instance().Delete(safeObject);
+        }
+      }
+      return;
+    }
+
+    // The roots are still worth looking at again once things settle down
+    size_t rootIndex = mScanPosition - mNodes.size();
+    if (rootIndex < mRoots.size())
+    {
+      SafeObject* safeObject = Find(mRoots[rootIndex]);
+      ++mScanPosition;
+      if (safeObject && IsCollectable(safeObject))
+      {
+        PossibleRoot(safeObject);
+      }
+      return;
+    }
+
+    ++mStats.mCollectionsAborted;
+    Reset();
+  }
+
+  /***********************************************************************************************/
+  void CycleCollector::ForgetRootStep()
+  {
+    SafeObject* safeObject = Find(mPossibleRoots.back());
+    mPossibleRoots.pop_back();
+    if (safeObject)
+    {
+      safeObject->mCycleFlags &= ~cBuffered;
+    }
+  }
+
+  /***********************************************************************************************/
+  void CycleCollector::BeginAbort()
+  {
+    mScanPosition = 0;
+    mPhase = Phase::Abort;
+  }
+
+  /***********************************************************************************************/
+  void CycleCollector::EndCollection()
+  {
+    ++mStats.mCollectionsCompleted;
+    Reset();
+  }
+
+  /***********************************************************************************************/
+  void CycleCollector::Reset()
+  {
+    mRoots.clear();
+    mNodes.clear();
+    mEdges.clear();
+    mIdToNode.clear();
+    mWorkList.clear();
+    mGarbage.clear();
+    mScanPosition = 0;
+    mPhase = Phase::Idle;
+  }
+
+  /***********************************************************************************************/
+  size_t CycleCollector::GetNode(SafeObject* safeObject)
+  {
+    unordered_map<uint64_t, size_t>::iterator it = mIdToNode.find(safeObject->mId);
+    if (it != mIdToNode.end())
+    {
+      return it->second;
+    }
+
+    Node node;
+    node.mId = safeObject->mId;
+    node.mReferenceCount = 0;
+    node.mInternalReferences = 0;
+    node.mEdgesBegin = 0;
+    node.mEdgesEnd = 0;
+    node.mIsLive = false;
+
+    size_t index = mNodes.size();
+    mNodes.push_back(node);
+    mIdToNode.insert(make_pair(node.mId, index));
+    mWorkList.push_back(index);
+
+    safeObject->mCycleFlags = (safeObject->mCycleFlags & ~cDirty) | cInCollection;
+    return index;
+  }
+
+  /***********************************************************************************************/
+  SafeObject* CycleCollector::Find(uint64_t id)
+  {
+    return SafeObjectSingleton::Instance().Find(id);
+  }
+
+  /***********************************************************************************************/
+  bool CycleCollector::IsCollectable(SafeObject* safeObject)
+  {
+    return safeObject->mReferenceCountingMode == ReferenceCountingMode::NonAtomic &&
+      (safeObject->mCycleFlags & cCondemned) == 0;
+  }
+}
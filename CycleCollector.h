@@ -0,0 +1,153 @@
+// Copyright (c) 2017 Trevor Sundberg
+// This code is licensed under the MIT license (see LICENSE.txt for details)
+
+#pragma once
+
+#include "SafeObject.h"
+
+namespace Skugo
+{
+  // Totals accumulated over every collection the cycle collector has run
+  class CycleCollectorStats
+  {
+  public:
+    // Possible roots (objects whose count dropped without reaching zero) that started a collection
+    uint64_t mRootsScanned;
+
+    // Every object reached from the roots through the handles they enumerated
+    uint64_t mObjectsTraced;
+
+    // Objects that were only kept alive by cycles and were deleted
+    uint64_t mGarbageFound;
+
+    uint64_t mCollectionsCompleted;
+
+    // Collections that were thrown away because the mutator touched an object that was being examined
+    uint64_t mCollectionsAborted;
+  };
+
+  // Finds reference cycles that are no longer reachable and deletes them, using trial deletion:
+  // starting from the possible roots, we trace every reachable object and count how many of its
+  // references come from other traced objects. Any object with more references than that is held from
+  // outside, and so is everything it reaches. Whatever is left is only referenced by garbage.
+  // The work is split into slices that each run for a budget of time, so a collection may be spread
+  // over many frames. Every phase (including giving up on a collection and shutting down) works through
+  // its objects a step at a time, so no slice does more than a few objects of work past its budget.
+  // Objects are only referred to by id between slices, and any handle made to or released from an
+  // object being examined marks it dirty, which makes the collection start over.
+  // Only objects with non-atomic reference counting take part (their handles all live on one thread),
+  // and the collector must be run on that same thread. Objects that hold handles must override
+  // SafeObject::EnumerateHandles or their cycles will never be found.
+  class CycleCollector : public HandleEnumerator
+  {
+  public:
+    // Bits of SafeObject::mCycleFlags
+    static const uint8_t cBuffered = 1 << 0;
+    static const uint8_t cInCollection = 1 << 1;
+    static const uint8_t cDirty = 1 << 2;
+    static const uint8_t cCondemned = 1 << 3;
+
+    CycleCollector();
+    ~CycleCollector();
+
+    // Called whenever a reference to the object was released but the object is still alive
+    void PossibleRoot(SafeObject* safeObject);
+
+    // Works for roughly the given budget and then returns (checking the clock every few objects)
+    // Returns true once there is nothing left to do, meaning every buffered root has been examined
+    bool Collect(uint64_t budgetMicroseconds);
+
+    // A disabled collector stops buffering roots, and Collect winds it down instead: any collection in
+    // progress is given up on, garbage that was already condemned is freed, and every mark it left on an
+    // object is cleared. Once Collect returns true the collector holds nothing and may be destroyed.
+    void SetEnabled(bool enabled);
+    bool IsEnabled() const;
+
+    const CycleCollectorStats& GetStats() const;
+
+  private:
+    CycleCollector(const CycleCollector&) = delete;
+    CycleCollector& operator=(const CycleCollector&) = delete;
+
+    void Visit(const Handle& handle) override;
+
+    enum class Phase
+    {
+      // Waiting for possible roots
+      Idle,
+      // Finding every object reachable from the roots
+      Trace,
+      // Marking everything that is referenced from outside the traced objects (and what it reaches) as live
+      Scan,
+      // Checking that nothing changed since tracing while taking a reference to each piece of garbage
+      Condemn,
+      // Deleting the garbage
+      Free,
+      // Undoing everything a collection that went stale did to its objects
+      Abort
+    };
+
+    class Node
+    {
+    public:
+      uint64_t mId;
+
+      // The count the object had when it was traced, and how much of it comes from other traced objects
+      uint32_t mReferenceCount;
+      uint32_t mInternalReferences;
+
+      // The children of this node are mEdges[mEdgesBegin, mEdgesEnd)
+      size_t mEdgesBegin;
+      size_t mEdgesEnd;
+
+      bool mIsLive;
+    };
+
+    // Does one step of whatever phase we are in (returns true when there is nothing left to do)
+    bool Step();
+
+    // Takes the buffered roots as the start of a new collection
+    void BeginCollection();
+
+    // Each step does a small amount of work and moves on to the next phase once its phase is done
+    void TraceStep();
+    void ScanStep();
+    void CondemnStep();
+    void FreeStep();
+    void AbortStep();
+
+    // Clears the mark of one buffered root without examining it (only while disabled)
+    void ForgetRootStep();
+
+    void BeginAbort();
+    void EndCollection();
+    void Reset();
+
+    // Returns the node for the object, tracing it later if it has not been seen yet
+    size_t GetNode(SafeObject* safeObject);
+
+    static SafeObject* Find(uint64_t id);
+    static bool IsCollectable(SafeObject* safeObject);
+
+    // How many objects are processed between checks of the clock
+    static const size_t cWorkPerClockCheck = 32;
+
+    Phase mPhase;
+    bool mEnabled;
+    CycleCollectorStats mStats;
+
+    // Ids of objects whose count dropped without reaching zero (they are flagged cBuffered)
+    vector<uint64_t> mPossibleRoots;
+
+    // The state of the collection in progress
+    vector<uint64_t> mRoots;
+    vector<Node> mNodes;
+    vector<size_t> mEdges;
+    unordered_map<uint64_t, size_t> mIdToNode;
+    vector<size_t> mWorkList;
+
+    // How far the current phase has walked through the roots or nodes
+    size_t mScanPosition;
+    vector<uint64_t> mGarbage;
+  };
+}
@@ -6,14 +6,35 @@
 namespace Skugo
 {
   // Class forward declarations (sorted)
+  class CycleCollector;
+  class CycleCollectorStats;
   class EmptyBase;
   class Handle;
+  class HandleEnumerator;
   class SafeObject;
+  class SafeObjectReadSection;
   class SafeObjectSingleton;
+  class SafeObjectStats;
+  class SafeObjectType;
+  class SafeObjectTypeInfo;
+  class SafeObjectTypeStats;
+  class SlabAllocator;
+  class SlabAllocatorStats;
+  class WeakHandle;
 
   // Templated forward declarations (sorted)
   template <typename T>
   class HandleOf;
+  template <typename T>
+  class SafeObjectRange;
+  template <typename T>
+  class SafeObjectTypeIndex;
+  template <typename T>
+  class SafeObjectTypeInfoOf;
+  template <typename T>
+  class SafeObjectTypeTraits;
   template <typename SelfType, typename BaseType = EmptyBase>
   class Singleton;
+  template <typename T>
+  class WeakHandleOf;
 }
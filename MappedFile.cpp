@@ -0,0 +1,119 @@
+// Copyright (c) 2017 Trevor Sundberg
+// This code is licensed under the MIT license (see LICENSE.txt for details)
+
+#include "Precompiled.h"
+#include "MappedFile.h"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace Skugo
+{
+#ifdef _WIN32
+  /***********************************************************************************************/
+  MappedFile::MappedFile(const char* path) :
+    mData(nullptr),
+    mSize(0),
+    mFile(INVALID_HANDLE_VALUE),
+    mMapping(nullptr)
+  {
+    // Empty files can't be mapped, so they're treated as missing
+    mFile = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    LARGE_INTEGER size;
+    if (mFile == INVALID_HANDLE_VALUE || !GetFileSizeEx(mFile, &size) || size.QuadPart == 0)
+    {
+      return;
+    }
+
+    mMapping = CreateFileMappingA(mFile, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (mMapping == nullptr)
+    {
+      return;
+    }
+
+    mData = MapViewOfFile(mMapping, FILE_MAP_READ, 0, 0, 0);
+    if (mData != nullptr)
+    {
+      mSize = static_cast<size_t>(size.QuadPart);
+    }
+  }
+
+  /***********************************************************************************************/
+  MappedFile::~MappedFile()
+  {
+    if (mData != nullptr)
+    {
+      UnmapViewOfFile(mData);
+    }
+    if (mMapping != nullptr)
+    {
+      CloseHandle(mMapping);
+    }
+    if (mFile != INVALID_HANDLE_VALUE)
+    {
+      CloseHandle(mFile);
+    }
+  }
+#else
+  /***********************************************************************************************/
+  MappedFile::MappedFile(const char* path) :
+    mData(nullptr),
+    mSize(0)
+  {
+    int file = open(path, O_RDONLY);
+    if (file < 0)
+    {
+      return;
+    }
+
+    // Empty files can't be mapped, so they're treated as missing (and the mapping
+    // keeps its own reference to the file, so the descriptor can be closed right away)
+    struct stat status;
+    if (fstat(file, &status) == 0 && status.st_size > 0)
+    {
+      void* data = mmap(nullptr, static_cast<size_t>(status.st_size), PROT_READ, MAP_PRIVATE, file, 0);
+      if (data != MAP_FAILED)
+      {
+        mData = data;
+        mSize = static_cast<size_t>(status.st_size);
+      }
+    }
+    close(file);
+  }
+
+  /***********************************************************************************************/
+  MappedFile::~MappedFile()
+  {
+    if (mData != nullptr)
+    {
+      munmap(const_cast<void*>(mData), mSize);
+    }
+  }
+#endif
+
+  /***********************************************************************************************/
+  bool MappedFile::IsOpen() const
+  {
+    return mData != nullptr;
+  }
+
+  /***********************************************************************************************/
+  const void* MappedFile::GetData() const
+  {
+    return mData;
+  }
+
+  /***********************************************************************************************/
+  size_t MappedFile::GetSize() const
+  {
+    return mSize;
+  }
+}
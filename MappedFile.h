@@ -0,0 +1,35 @@
+// Copyright (c) 2017 Trevor Sundberg
+// This code is licensed under the MIT license (see LICENSE.txt for details)
+
+#pragma once
+
+namespace Skugo
+{
+  // Maps a whole file into memory (read only), so nothing is read up front and each page is only
+  // loaded the first time it's touched. The memory stays valid for as long as the object lives.
+  class MappedFile
+  {
+  public:
+    MappedFile(const char* path);
+    ~MappedFile();
+
+    bool IsOpen() const;
+
+    // Page aligned (and null when the file couldn't be mapped)
+    const void* GetData() const;
+    size_t GetSize() const;
+
+  private:
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    const void* mData;
+    size_t mSize;
+
+#ifdef _WIN32
+    // The file and mapping handles (kept as pointers so this header doesn't need windows.h)
+    void* mFile;
+    void* mMapping;
+#endif
+  };
+}
@@ -3,11 +3,17 @@
 
 #pragma once
 
+#include <cstddef>
 #include <cstdint>
+#include <algorithm>
 #include <unordered_map>
+#include <vector>
 #include <utility>
 #include <string>
 #include <memory>
+#include <typeinfo>
+#include <atomic>
+#include <mutex>
 
 namespace Skugo
 {
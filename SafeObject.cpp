@@ -3,42 +3,1032 @@
 
 #include "Precompiled.h"
 #include "SafeObject.h"
+#include "CycleCollector.h"
 #include "Logging.h"
+#include <stdio.h>
 
 namespace Skugo
 {
+  /***********************************************************************************************/
+  void SafeObjectTypeTraits<SafeObject>::FillAncestors(SafeObjectTypeInfo& info)
+  {
+    info.mAncestors[0] = &SafeObjectTypeInfoOf<SafeObject>::sInfo;
+  }
+
+  /***********************************************************************************************/
+  SafeObjectType::SafeObjectType(const char* name, size_t size, size_t alignment, const SafeObjectTypeInfo* typeInfo) :
+    mName(name),
+    mTypeInfo(typeInfo),
+    mAllocator(name, size, alignment),
+    mWalks(0),
+    mHoles(0),
+    mCreated(0),
+    mDestroyed(0),
+    mHighWaterMark(0)
+  {
+  }
+
+  /***********************************************************************************************/
+  void SafeObjectType::Add(SafeObject* safeObject)
+  {
+    lock_guard<mutex> lock(mObjectsMutex);
+    safeObject->mDenseIndex = mObjects.size();
+    mObjects.push_back(safeObject);
+    RecordCreated();
+  }
+
+  /***********************************************************************************************/
+  void SafeObjectType::Remove(SafeObject* safeObject)
+  {
+    lock_guard<mutex> lock(mObjectsMutex);
+
+    // A walk would either skip the moved object or visit it twice
+    size_t index = safeObject->mDenseIndex;
+    if (mWalks != 0)
+    {
+      mObjects[index] = nullptr;
+      ++mHoles;
+      RecordDestroyed();
+      return;
+    }
+
+    // Move the last object into our spot so the array stays packed
+    SafeObject* last = mObjects.back();
+    mObjects[index] = last;
+    last->mDenseIndex = index;
+    mObjects.pop_back();
+    RecordDestroyed();
+  }
+
+  /***********************************************************************************************/
+  void SafeObjectType::BeginWalk()
+  {
+    lock_guard<mutex> lock(mObjectsMutex);
+    ++mWalks;
+  }
+
+  /***********************************************************************************************/
+  void SafeObjectType::EndWalk()
+  {
+    lock_guard<mutex> lock(mObjectsMutex);
+    --mWalks;
+    if (mWalks != 0 || mHoles == 0)
+    {
+      return;
+    }
+
+    // Close the holes (keeping the order of what's left)
+    size_t packed = 0;
+    for (SafeObject* safeObject : mObjects)
+    {
+      if (safeObject)
+      {
+        safeObject->mDenseIndex = packed;
+        mObjects[packed] = safeObject;
+        ++packed;
+      }
+    }
+    mObjects.resize(packed);
+    mHoles = 0;
+  }
+
+  /***********************************************************************************************/
+  void SafeObjectType::RecordCreated()
+  {
+    ++mCreated;
+    if (mObjects.size() - mHoles > mHighWaterMark)
+    {
+      mHighWaterMark = mObjects.size() - mHoles;
+    }
+  }
+
+  /***********************************************************************************************/
+  void SafeObjectType::RecordDestroyed()
+  {
+    ++mDestroyed;
+  }
+
+  /***********************************************************************************************/
+  SafeObjectTypeStats SafeObjectType::GetStats()
+  {
+    SafeObjectTypeStats stats;
+    stats.mName = mName;
+    stats.mBlockSize = mAllocator.GetStats().mBlockSize;
+
+    lock_guard<mutex> lock(mObjectsMutex);
+    stats.mLive = mObjects.size() - mHoles;
+    stats.mCreated = mCreated;
+    stats.mDestroyed = mDestroyed;
+    stats.mHighWaterMark = mHighWaterMark;
+    stats.mBytesAllocated = mCreated * stats.mBlockSize;
+    stats.mLiveBytes = stats.mLive * stats.mBlockSize;
+    return stats;
+  }
+
+  /***********************************************************************************************/
+  static atomic<uint64_t> sSafeObjectSingletonSerial(0);
+
   /***********************************************************************************************/
   SafeObjectSingleton::SafeObjectSingleton() :
-    mIdCounter(1),
-    mIsNextObjectReferenceCounted(false)
+    mSlotCount(1),
+    mSerial(++sSafeObjectSingletonSerial),
+    mEpoch(1),
+    mFailedDereferences(0)
+  {
+    for (uint32_t i = 0; i < cMaxSlotPages; ++i)
+    {
+      mPages[i].store(nullptr, memory_order_relaxed);
+    }
+
+    for (uint32_t i = 0; i < cMaxTypes; ++i)
+    {
+      mTypes[i].store(nullptr, memory_order_relaxed);
+    }
+
+    // Reserve slot 0 for the null id (see mPages)
+    AllocatePages(0, 1);
+    GetSlot(0).mId.store(0, memory_order_relaxed);
+  }
+
+  /***********************************************************************************************/
+  SafeObjectSingleton::~SafeObjectSingleton()
+  {
+    // The collector may still have garbage to delete
+    mCycleCollector.reset();
+
+    // Nobody can be reading anymore, so free all retired memory before the allocators go away
+    for (unique_ptr<EpochRecord>& record : mEpochRecords)
+    {
+      for (RetiredMemory& retired : record->mRetired)
+      {
+        record->mPending.push_back(make_pair(retired.mAllocator, retired.mMemory));
+      }
+      FreeMemory(record->mPending);
+    }
+
+    for (uint32_t i = 0; i < cMaxSlotPages; ++i)
+    {
+      delete[] mPages[i].load(memory_order_relaxed);
+    }
+
+    for (uint32_t i = 0; i < cMaxTypes; ++i)
+    {
+      delete mTypes[i].load(memory_order_relaxed);
+    }
+  }
+
+  /***********************************************************************************************/
+  vector<SlabAllocatorStats> SafeObjectSingleton::GetAllocatorStats() const
+  {
+    vector<SlabAllocatorStats> stats;
+    for (uint32_t i = 0; i < cMaxTypes; ++i)
+    {
+      SafeObjectType* type = mTypes[i].load(memory_order_acquire);
+      if (type)
+      {
+        stats.push_back(type->mAllocator.GetStats());
+      }
+    }
+    return stats;
+  }
+
+  /***********************************************************************************************/
+  SafeObjectStats SafeObjectSingleton::GetObjectStats() const
+  {
+    SafeObjectStats stats;
+    stats.mBytesAllocated = 0;
+    stats.mLiveBytes = 0;
+    stats.mFailedDereferences = mFailedDereferences.load(memory_order_relaxed);
+
+    for (uint32_t i = 0; i < cMaxTypes; ++i)
+    {
+      SafeObjectType* type = mTypes[i].load(memory_order_acquire);
+      if (type)
+      {
+        stats.mTypes.push_back(type->GetStats());
+        stats.mBytesAllocated += stats.mTypes.back().mBytesAllocated;
+        stats.mLiveBytes += stats.mTypes.back().mLiveBytes;
+      }
+    }
+    return stats;
+  }
+
+  /***********************************************************************************************/
+  void SafeObjectSingleton::LogObjectStats() const
+  {
+    SafeObjectStats stats = GetObjectStats();
+    sort(stats.mTypes.begin(), stats.mTypes.end(), [](const SafeObjectTypeStats& lhs, const SafeObjectTypeStats& rhs)
+    {
+      return lhs.mLiveBytes > rhs.mLiveBytes;
+    });
+
+    LoggingSingleton& logging = LoggingSingleton::Instance();
+    const char* tags = "SafeObject Stats";
+    char message[512];
+
+    snprintf(message, sizeof(message), "SafeObjects: %llu live bytes, %llu bytes allocated, %llu failed dereferences",
+      static_cast<unsigned long long>(stats.mLiveBytes),
+      static_cast<unsigned long long>(stats.mBytesAllocated),
+      static_cast<unsigned long long>(stats.mFailedDereferences));
+    logging.SignalEvent(message, tags);
+
+    for (SafeObjectTypeStats& type : stats.mTypes)
+    {
+      snprintf(message, sizeof(message), "  %s: %llu live (%llu bytes), %llu created, %llu destroyed, %llu peak",
+        type.mName,
+        static_cast<unsigned long long>(type.mLive),
+        static_cast<unsigned long long>(type.mLiveBytes),
+        static_cast<unsigned long long>(type.mCreated),
+        static_cast<unsigned long long>(type.mDestroyed),
+        static_cast<unsigned long long>(type.mHighWaterMark));
+      logging.SignalEvent(message, tags);
+    }
+  }
+
+  /***********************************************************************************************/
+  void SafeObjectSingleton::SetCycleCollectionEnabled(bool enabled)
+  {
+    if (mCycleCollector)
+    {
+      mCycleCollector->SetEnabled(enabled);
+    }
+    else if (enabled)
+    {
+      mCycleCollector.reset(new CycleCollector());
+    }
+  }
+
+  /***********************************************************************************************/
+  bool SafeObjectSingleton::CollectCycles(uint64_t budgetMicroseconds)
+  {
+    if (!mCycleCollector)
+    {
+      return true;
+    }
+
+    // A collector that was turned off is only kept around until it has wound down
+    bool finished = mCycleCollector->Collect(budgetMicroseconds);
+    if (finished && !mCycleCollector->IsEnabled())
+    {
+      mCycleCollector.reset();
+    }
+    return finished;
+  }
+
+  /***********************************************************************************************/
+  CycleCollectorStats SafeObjectSingleton::GetCycleCollectorStats() const
+  {
+    if (!mCycleCollector)
+    {
+      return CycleCollectorStats();
+    }
+    return mCycleCollector->GetStats();
+  }
+
+  /***********************************************************************************************/
+  uint32_t SafeObjectSingleton::AllocateTypeIndex()
+  {
+    static atomic<uint32_t> typeCount(0);
+    uint32_t index = typeCount.fetch_add(1, memory_order_relaxed);
+    SkugoErrorIf(index >= cMaxTypes, "Too many SafeObject types were allocated via SkugoNew");
+    return index;
+  }
+
+  /***********************************************************************************************/
+  SafeObjectType* SafeObjectSingleton::CreateType(uint32_t index, const char* name, size_t size, size_t alignment,
+    const SafeObjectTypeInfo* typeInfo)
+  {
+    lock_guard<mutex> lock(mTypesMutex);
+
+    // Another thread may have created the type while we were waiting
+    SafeObjectType* type = mTypes[index].load(memory_order_relaxed);
+    if (type == nullptr)
+    {
+      type = new SafeObjectType(name, size, alignment, typeInfo);
+      mTypes[index].store(type, memory_order_release);
+    }
+    return type;
+  }
+
+  /***********************************************************************************************/
+  SafeObjectSingleton::ThreadContext::ThreadContext() :
+    mSingletonSerial(0),
+    mReservedBegin(0),
+    mReservedEnd(0),
+    mNextObjectReferenceCounting(ReferenceCountingMode::None),
+    mNextObjectType(nullptr),
+    mDeletingAllocator(nullptr),
+    mNextObjectId(0),
+    mBatchReleaseDepth(0),
+    mEpochRecord(nullptr),
+    mReadSectionDepth(0)
+  {
+  }
+
+  /***********************************************************************************************/
+  SafeObjectSingleton::ThreadContext::~ThreadContext()
+  {
+    // Give everything we cached back so that threads coming and going don't leak slots
+    if (!SafeObjectSingleton::IsInitialized())
+    {
+      return;
+    }
+
+    SafeObjectSingleton& singleton = SafeObjectSingleton::Instance();
+    if (singleton.mSerial != mSingletonSerial)
+    {
+      return;
+    }
+
+    for (uint32_t i = mReservedBegin; i < mReservedEnd; ++i)
+    {
+      mFreeSlots.push_back(i);
+    }
+
+    if (!mFreeSlots.empty())
+    {
+      lock_guard<mutex> lock(singleton.mFreeBatchesMutex);
+      singleton.mFreeBatches.push_back(move(mFreeSlots));
+    }
+
+    // Our retired memory stays in the record, and whoever claims the record next will free it
+    if (mEpochRecord)
+    {
+      mEpochRecord->mActiveEpoch.store(0, memory_order_release);
+      mEpochRecord->mInUse.store(false, memory_order_release);
+    }
+  }
+
+  /***********************************************************************************************/
+  void SafeObjectSingleton::ThreadContext::Validate(uint64_t singletonSerial)
+  {
+    if (mSingletonSerial != singletonSerial)
+    {
+      mSingletonSerial = singletonSerial;
+      mFreeSlots.clear();
+      mReservedBegin = 0;
+      mReservedEnd = 0;
+      mEpochRecord = nullptr;
+      mReadSectionDepth = 0;
+    }
+  }
+
+  /***********************************************************************************************/
+  SafeObjectSingleton::ThreadContext& SafeObjectSingleton::GetThreadContext()
+  {
+    static thread_local ThreadContext context;
+    return context;
+  }
+
+  /***********************************************************************************************/
+  SafeObject* SafeObjectSingleton::Find(uint64_t id)
+  {
+    Slot& slot = GetSlot(GetSlotIndex(id));
+
+    // If the slot was released and reused after we loaded the object, the id will no longer match
+    SafeObject* safeObject = slot.mObject.load(memory_order_acquire);
+    if (slot.mId.load(memory_order_acquire) == id)
+    {
+      return safeObject;
+    }
+
+    return nullptr;
+  }
+
+  /***********************************************************************************************/
+  SafeObject* SafeObjectSingleton::Find(uint64_t id, const SafeObjectTypeInfo*& typeInfoOut)
+  {
+    Slot& slot = GetSlot(GetSlotIndex(id));
+
+    // Both loads are validated by the id just like in Find above
+    SafeObject* safeObject = slot.mObject.load(memory_order_acquire);
+    const SafeObjectTypeInfo* typeInfo = slot.mTypeInfo.load(memory_order_acquire);
+    if (slot.mId.load(memory_order_acquire) == id)
+    {
+      typeInfoOut = typeInfo;
+      return safeObject;
+    }
+
+    typeInfoOut = nullptr;
+    return nullptr;
+  }
+
+  /***********************************************************************************************/
+  uint64_t SafeObjectSingleton::Register(SafeObject* safeObject, const SafeObjectTypeInfo* typeInfo, ThreadContext& context)
+  {
+    uint32_t slotIndex = AcquireSlot(context);
+    uint64_t id = GetNextId(slotIndex);
+    Publish(slotIndex, safeObject, typeInfo, id);
+    return id;
+  }
+
+  /***********************************************************************************************/
+  void SafeObjectSingleton::Unregister(uint64_t id, ThreadContext& context)
+  {
+    uint32_t slotIndex = GetSlotIndex(id);
+    Slot& slot = GetSlot(slotIndex);
+    SkugoReturnVoidIf(slotIndex == 0 || slot.mId.load(memory_order_relaxed) != id,
+      "The SafeObject did not exist within the SafeObjectSingleton");
+
+    slot.mId.store(0, memory_order_release);
+    slot.mObject.store(nullptr, memory_order_release);
+
+    // Skip generation 0 when we wrap around so that a reused slot can never produce the null id
+    ++slot.mGeneration;
+    if (slot.mGeneration == 0)
+    {
+      slot.mGeneration = 1;
+    }
+
+    ReleaseSlot(slotIndex, context);
+  }
+
+  /***********************************************************************************************/
+  void SafeObjectSingleton::Detach(SafeObject* safeObject, ThreadContext& context)
+  {
+    // A detached object has no id, so the destructor knows it has nothing left to do
+    if (safeObject->mId == 0)
+    {
+      return;
+    }
+
+    Unregister(safeObject->mId, context);
+    safeObject->mId = 0;
+
+    if (safeObject->mType)
+    {
+      safeObject->mType->Remove(safeObject);
+    }
+  }
+
+  /***********************************************************************************************/
+  void SafeObjectSingleton::Delete(SafeObject* safeObject)
+  {
+    if (safeObject)
+    {
+      // Readers must stop finding the object before the derived destructors start tearing it down
+      Detach(safeObject, GetThreadContext());
+      delete safeObject;
+    }
+  }
+
+  /***********************************************************************************************/
+  uint32_t SafeObjectSingleton::AcquireSlot(ThreadContext& context)
+  {
+    context.Validate(mSerial);
+
+    if (!context.mFreeSlots.empty())
+    {
+      uint32_t slotIndex = context.mFreeSlots.back();
+      context.mFreeSlots.pop_back();
+      return slotIndex;
+    }
+
+    if (context.mReservedBegin == context.mReservedEnd)
+    {
+      {
+        lock_guard<mutex> lock(mFreeBatchesMutex);
+        if (!mFreeBatches.empty())
+        {
+          context.mFreeSlots = move(mFreeBatches.back());
+          mFreeBatches.pop_back();
+        }
+      }
+
+      if (!context.mFreeSlots.empty())
+      {
+        uint32_t slotIndex = context.mFreeSlots.back();
+        context.mFreeSlots.pop_back();
+        return slotIndex;
+      }
+
+      // Nobody has any free slots, so reserve a fresh range of slots for this thread
+      uint32_t beginSlot = mSlotCount.fetch_add(cSlotBatchSize, memory_order_relaxed);
+      SkugoErrorIf(static_cast<uint64_t>(beginSlot) + cSlotBatchSize > cMaxSlots, "Ran out of SafeObject slots");
+      AllocatePages(beginSlot, beginSlot + cSlotBatchSize);
+      context.mReservedBegin = beginSlot;
+      context.mReservedEnd = beginSlot + cSlotBatchSize;
+    }
+
+    uint32_t slotIndex = context.mReservedBegin;
+    ++context.mReservedBegin;
+    return slotIndex;
+  }
+
+  /***********************************************************************************************/
+  void SafeObjectSingleton::AcquireSlots(size_t count, ThreadContext& context, vector<uint32_t>& slotsOut)
+  {
+    context.Validate(mSerial);
+    slotsOut.reserve(slotsOut.size() + count);
+
+    // Use up what this thread has already cached first
+    while (count != 0 && !context.mFreeSlots.empty())
+    {
+      slotsOut.push_back(context.mFreeSlots.back());
+      context.mFreeSlots.pop_back();
+      --count;
+    }
+
+    while (count != 0 && context.mReservedBegin != context.mReservedEnd)
+    {
+      slotsOut.push_back(context.mReservedBegin);
+      ++context.mReservedBegin;
+      --count;
+    }
+
+    if (count != 0)
+    {
+      lock_guard<mutex> lock(mFreeBatchesMutex);
+      while (count != 0 && !mFreeBatches.empty())
+      {
+        vector<uint32_t>& batch = mFreeBatches.back();
+        while (count != 0 && !batch.empty())
+        {
+          slotsOut.push_back(batch.back());
+          batch.pop_back();
+          --count;
+        }
+
+        if (batch.empty())
+        {
+          mFreeBatches.pop_back();
+        }
+      }
+    }
+
+    if (count != 0)
+    {
+      // Whatever is left comes from a single fresh range, so the slot pages grow once per batch
+      uint32_t beginSlot = mSlotCount.fetch_add(static_cast<uint32_t>(count), memory_order_relaxed);
+      SkugoErrorIf(static_cast<uint64_t>(beginSlot) + count > cMaxSlots, "Ran out of SafeObject slots");
+      uint32_t endSlot = beginSlot + static_cast<uint32_t>(count);
+      AllocatePages(beginSlot, endSlot);
+
+      for (uint32_t i = beginSlot; i < endSlot; ++i)
+      {
+        slotsOut.push_back(i);
+      }
+    }
+  }
+
+  /***********************************************************************************************/
+  void SafeObjectSingleton::Publish(uint32_t slotIndex, SafeObject* safeObject, const SafeObjectTypeInfo* typeInfo, uint64_t id)
+  {
+    // The object must be visible before the id, since readers validate the object they loaded by the id
+    Slot& slot = GetSlot(slotIndex);
+    slot.mObject.store(safeObject, memory_order_release);
+    slot.mTypeInfo.store(typeInfo, memory_order_release);
+    slot.mId.store(id, memory_order_release);
+  }
+
+  /***********************************************************************************************/
+  uint64_t SafeObjectSingleton::GetNextId(uint32_t slotIndex)
+  {
+    return MakeId(slotIndex, GetSlot(slotIndex).mGeneration);
+  }
+
+  /***********************************************************************************************/
+  void SafeObjectSingleton::BeginBatchRelease(ThreadContext& context)
+  {
+    ++context.mBatchReleaseDepth;
+  }
+
+  /***********************************************************************************************/
+  void SafeObjectSingleton::EndBatchRelease(ThreadContext& context)
+  {
+    --context.mBatchReleaseDepth;
+    if (context.mBatchReleaseDepth != 0)
+    {
+      return;
+    }
+
+    EpochRecord& record = GetEpochRecord(context);
+    record.mPending.insert(record.mPending.end(), context.mBatchFrees.begin(), context.mBatchFrees.end());
+    context.mBatchFrees.clear();
+
+    if (record.mPending.size() >= cReclaimThreshold)
+    {
+      Reclaim(record);
+    }
+  }
+
+  /***********************************************************************************************/
+  SafeObjectSingleton::EpochRecord::EpochRecord() :
+    mActiveEpoch(0),
+    mInUse(false)
+  {
+  }
+
+  /***********************************************************************************************/
+  void SafeObjectSingleton::EnterReadSection()
+  {
+    ThreadContext& context = GetThreadContext();
+    EpochRecord& record = GetEpochRecord(context);
+
+    ++context.mReadSectionDepth;
+    if (context.mReadSectionDepth == 1)
+    {
+      record.mActiveEpoch.store(mEpoch.load(memory_order_acquire), memory_order_relaxed);
+
+      // Our epoch must be visible before we load any slots (this pairs with the fence in Reclaim)
+      atomic_thread_fence(memory_order_seq_cst);
+    }
+  }
+
+  /***********************************************************************************************/
+  void SafeObjectSingleton::LeaveReadSection()
+  {
+    ThreadContext& context = GetThreadContext();
+    SkugoReturnVoidIf(context.mReadSectionDepth == 0, "LeaveReadSection was called without EnterReadSection");
+
+    --context.mReadSectionDepth;
+    if (context.mReadSectionDepth == 0)
+    {
+      GetEpochRecord(context).mActiveEpoch.store(0, memory_order_release);
+    }
+  }
+
+  /***********************************************************************************************/
+  void SafeObjectSingleton::ReclaimMemory()
+  {
+    Reclaim(GetEpochRecord(GetThreadContext()));
+
+    // Threads that exited may have left retired memory behind in records nobody has claimed since
+    vector<EpochRecord*> abandoned;
+    {
+      lock_guard<mutex> lock(mEpochRecordsMutex);
+      for (unique_ptr<EpochRecord>& record : mEpochRecords)
+      {
+        bool inUse = false;
+        if (record->mInUse.compare_exchange_strong(inUse, true, memory_order_acquire))
+        {
+          abandoned.push_back(record.get());
+        }
+      }
+    }
+
+    for (EpochRecord* record : abandoned)
+    {
+      Reclaim(*record);
+      record->mInUse.store(false, memory_order_release);
+    }
+  }
+
+  /***********************************************************************************************/
+  SafeObjectSingleton::EpochRecord& SafeObjectSingleton::GetEpochRecord(ThreadContext& context)
+  {
+    context.Validate(mSerial);
+    if (context.mEpochRecord)
+    {
+      return *context.mEpochRecord;
+    }
+
+    lock_guard<mutex> lock(mEpochRecordsMutex);
+    for (unique_ptr<EpochRecord>& record : mEpochRecords)
+    {
+      bool inUse = false;
+      if (record->mInUse.compare_exchange_strong(inUse, true, memory_order_acquire))
+      {
+        context.mEpochRecord = record.get();
+        return *context.mEpochRecord;
+      }
+    }
+
+    mEpochRecords.push_back(unique_ptr<EpochRecord>(new EpochRecord()));
+    context.mEpochRecord = mEpochRecords.back().get();
+    context.mEpochRecord->mInUse.store(true, memory_order_relaxed);
+    return *context.mEpochRecord;
+  }
+
+  /***********************************************************************************************/
+  void SafeObjectSingleton::Retire(SlabAllocator* allocator, void* memory, ThreadContext& context)
+  {
+    EpochRecord& record = GetEpochRecord(context);
+    record.mPending.push_back(make_pair(allocator, memory));
+
+    if (record.mPending.size() >= cReclaimThreshold)
+    {
+      Reclaim(record);
+    }
+  }
+
+  /***********************************************************************************************/
+  void SafeObjectSingleton::Reclaim(EpochRecord& record)
+  {
+    if (!record.mPending.empty())
+    {
+      // The pending objects were unregistered before this increment, so any reader that enters at the
+      // new epoch (or later) synchronizes with us and can no longer find them through the registry
+      uint64_t safeEpoch = mEpoch.fetch_add(1, memory_order_acq_rel) + 1;
+
+      for (pair<SlabAllocator*, void*>& pending : record.mPending)
+      {
+        RetiredMemory retired;
+        retired.mAllocator = pending.first;
+        retired.mMemory = pending.second;
+        retired.mSafeEpoch = safeEpoch;
+        record.mRetired.push_back(retired);
+      }
+      record.mPending.clear();
+    }
+
+    if (record.mRetired.empty())
+    {
+      return;
+    }
+
+    // Pairs with the fence in EnterReadSection, so either we see the reader's epoch or they see our unregister
+    atomic_thread_fence(memory_order_seq_cst);
+
+    uint64_t oldestActiveEpoch = static_cast<uint64_t>(-1);
+    {
+      lock_guard<mutex> lock(mEpochRecordsMutex);
+      for (unique_ptr<EpochRecord>& other : mEpochRecords)
+      {
+        uint64_t activeEpoch = other->mActiveEpoch.load(memory_order_acquire);
+        if (activeEpoch != 0 && activeEpoch < oldestActiveEpoch)
+        {
+          oldestActiveEpoch = activeEpoch;
+        }
+      }
+    }
+
+    vector<pair<SlabAllocator*, void*>> freeable;
+    size_t kept = 0;
+    for (RetiredMemory& retired : record.mRetired)
+    {
+      if (retired.mSafeEpoch <= oldestActiveEpoch)
+      {
+        freeable.push_back(make_pair(retired.mAllocator, retired.mMemory));
+      }
+      else
+      {
+        record.mRetired[kept] = retired;
+        ++kept;
+      }
+    }
+    record.mRetired.resize(kept);
+
+    FreeMemory(freeable);
+  }
+
+  /***********************************************************************************************/
+  void SafeObjectSingleton::FreeMemory(vector<pair<SlabAllocator*, void*>>& memory)
+  {
+    // Group the memory by allocator so each allocator is only locked once
+    sort(memory.begin(), memory.end());
+
+    vector<void*> blocks;
+    size_t i = 0;
+    while (i < memory.size())
+    {
+      SlabAllocator* allocator = memory[i].first;
+      blocks.clear();
+      for (; i < memory.size() && memory[i].first == allocator; ++i)
+      {
+        blocks.push_back(memory[i].second);
+      }
+
+      if (allocator)
+      {
+        allocator->FreeBatch(blocks.data(), blocks.size());
+      }
+      else
+      {
+        for (void* block : blocks)
+        {
+          ::operator delete(block);
+        }
+      }
+    }
+    memory.clear();
+  }
+
+  /***********************************************************************************************/
+  void SafeObjectSingleton::ReleaseSlot(uint32_t slotIndex, ThreadContext& context)
+  {
+    context.Validate(mSerial);
+    context.mFreeSlots.push_back(slotIndex);
+
+    // A thread that destroys far more than it creates hands whole batches back to everyone else
+    if (context.mFreeSlots.size() >= cSlotBatchSize * 2)
+    {
+      vector<uint32_t> batch(context.mFreeSlots.end() - cSlotBatchSize, context.mFreeSlots.end());
+      context.mFreeSlots.resize(context.mFreeSlots.size() - cSlotBatchSize);
+
+      lock_guard<mutex> lock(mFreeBatchesMutex);
+      mFreeBatches.push_back(move(batch));
+    }
+  }
+
+  /***********************************************************************************************/
+  void SafeObjectSingleton::AllocatePages(uint32_t beginSlot, uint32_t endSlot)
+  {
+    uint32_t beginPage = beginSlot >> cSlotPageBits;
+    uint32_t endPage = (endSlot - 1) >> cSlotPageBits;
+
+    for (uint32_t pageIndex = beginPage; pageIndex <= endPage; ++pageIndex)
+    {
+      if (mPages[pageIndex].load(memory_order_acquire) != nullptr)
+      {
+        continue;
+      }
+
+      lock_guard<mutex> lock(mPagesMutex);
+      if (mPages[pageIndex].load(memory_order_relaxed) != nullptr)
+      {
+        continue;
+      }
+
+      Slot* page = new Slot[cSlotsPerPage];
+      for (uint32_t i = 0; i < cSlotsPerPage; ++i)
+      {
+        page[i].mObject.store(nullptr, memory_order_relaxed);
+        page[i].mId.store(0, memory_order_relaxed);
+        page[i].mTypeInfo.store(nullptr, memory_order_relaxed);
+        page[i].mGeneration = 1;
+      }
+      mPages[pageIndex].store(page, memory_order_release);
+    }
+  }
+
+  /***********************************************************************************************/
+  SafeObjectSingleton::Slot& SafeObjectSingleton::GetSlot(uint32_t slotIndex)
+  {
+    Slot* page = mPages[slotIndex >> cSlotPageBits].load(memory_order_acquire);
+    return page[slotIndex & (cSlotsPerPage - 1)];
+  }
+
+  /***********************************************************************************************/
+  uint32_t SafeObjectSingleton::GetSlotIndex(uint64_t id)
+  {
+    return static_cast<uint32_t>(id);
+  }
+
+  /***********************************************************************************************/
+  uint32_t SafeObjectSingleton::GetGeneration(uint64_t id)
+  {
+    return static_cast<uint32_t>(id >> 32);
+  }
+
+  /***********************************************************************************************/
+  uint64_t SafeObjectSingleton::MakeId(uint32_t slotIndex, uint32_t generation)
   {
+    return (static_cast<uint64_t>(generation) << 32) | slotIndex;
   }
 
   /***********************************************************************************************/
   SafeObject::SafeObject()
   {
     SafeObjectSingleton& singleton = SafeObjectSingleton::Instance();
-    mId = singleton.mIdCounter;
-    ++singleton.mIdCounter;
-    singleton.mIdToSafeObject[mId] = this;
+    SafeObjectSingleton::ThreadContext& context = SafeObjectSingleton::GetThreadContext();
 
-    if (singleton.mIsNextObjectReferenceCounted)
+    // Objects created in a batch already had their slot reserved and are published by the batch
+    if (context.mNextObjectId != 0)
     {
-      mReferenceCount = 0;
-      singleton.mIsNextObjectReferenceCounted = false;
+      mId = context.mNextObjectId;
+      context.mNextObjectId = 0;
     }
     else
     {
-      mReferenceCount = cNoReferenceCounting;
+      mId = singleton.Register(this, context.mNextObjectType ? context.mNextObjectType->mTypeInfo : nullptr, context);
+    }
+
+    mReferenceCount.store(0, memory_order_relaxed);
+    mCycleFlags = 0;
+    mReferenceCountingMode = context.mNextObjectReferenceCounting;
+    mType = context.mNextObjectType;
+    context.mNextObjectReferenceCounting = ReferenceCountingMode::None;
+    context.mNextObjectType = nullptr;
+
+    if (mType)
+    {
+      mType->Add(this);
     }
   }
 
   /***********************************************************************************************/
   SafeObject::~SafeObject()
   {
-    SafeObjectSingleton& singleton = SafeObjectSingleton::Instance();
-    size_t itemsRemoved = singleton.mIdToSafeObject.erase(mId);
-    SkugoErrorIf(itemsRemoved == 0, "The SafeObject did not exist within the SafeObjectSingleton");
+    // Objects destroyed through SafeObjectSingleton::Delete (or their last handle) were already detached
+    SafeObjectSingleton::ThreadContext& context = SafeObjectSingleton::GetThreadContext();
+    SafeObjectSingleton::Instance().Detach(this, context);
+
+    // This must be the last thing we do, since operator delete runs immediately after us
+    context.mDeletingAllocator = mType ? &mType->mAllocator : nullptr;
+  }
+
+  /***********************************************************************************************/
+  void* SafeObject::operator new(size_t size)
+  {
+    return ::operator new(size);
+  }
+
+  /***********************************************************************************************/
+  void SafeObject::operator delete(void* memory)
+  {
+    // By the time we get here the object is gone, so ~SafeObject left its allocator for us
+    SafeObjectSingleton::ThreadContext& context = SafeObjectSingleton::GetThreadContext();
+    SlabAllocator* allocator = context.mDeletingAllocator;
+    context.mDeletingAllocator = nullptr;
+
+    // Other threads may still be reading the object, so the memory is retired rather than freed
+    if (context.mBatchReleaseDepth != 0)
+    {
+      context.mBatchFrees.push_back(make_pair(allocator, memory));
+    }
+    else
+    {
+      SafeObjectSingleton::Instance().Retire(allocator, memory, context);
+    }
+  }
+
+  /***********************************************************************************************/
+  void SafeObject::EnumerateHandles(HandleEnumerator& /*enumerator*/)
+  {
+  }
+
+  /***********************************************************************************************/
+  void SafeObject::AddReference()
+  {
+    switch (mReferenceCountingMode)
+    {
+    case ReferenceCountingMode::NonAtomic:
+      NonAtomicReferenceCounting::Increment(mReferenceCount);
+
+      // The cycle collector is in the middle of examining us, and what it saw is no longer true
+      if (mCycleFlags & CycleCollector::cInCollection)
+      {
+        mCycleFlags |= CycleCollector::cDirty;
+      }
+      break;
+    case ReferenceCountingMode::Atomic:
+      AtomicReferenceCounting::Increment(mReferenceCount);
+      break;
+    case ReferenceCountingMode::None:
+      break;
+    }
+  }
+
+  /***********************************************************************************************/
+  bool SafeObject::ReleaseReference()
+  {
+    if (mReferenceCountingMode == ReferenceCountingMode::None)
+    {
+      return false;
+    }
+
+    SkugoErrorIf(mReferenceCount.load(memory_order_relaxed) == 0,
+      "The reference count was already zero but we tried to decrement it");
+
+    if (mReferenceCountingMode == ReferenceCountingMode::Atomic)
+    {
+      return AtomicReferenceCounting::Decrement(mReferenceCount);
+    }
+
+    if (NonAtomicReferenceCounting::Decrement(mReferenceCount))
+    {
+      return true;
+    }
+
+    // Whatever still references us might only be a cycle, so the collector should take a look later
+    CycleCollector* collector = SafeObjectSingleton::Instance().mCycleCollector.get();
+    if (collector)
+    {
+      collector->PossibleRoot(this);
+    }
+    return false;
+  }
+
+  /***********************************************************************************************/
+  bool SafeObject::TryAddReference()
+  {
+    // The cycle collector has already decided to free it (a new reference can't change its mind)
+    if (mCycleFlags & CycleCollector::cCondemned)
+    {
+      return false;
+    }
+
+    if (mReferenceCountingMode == ReferenceCountingMode::Atomic)
+    {
+      return AtomicReferenceCounting::IncrementIfNonZero(mReferenceCount);
+    }
+
+    // Non-atomic objects are only released on this thread, so if we found the object it is alive
+    AddReference();
+    return true;
+  }
+
+  /***********************************************************************************************/
+  SafeObjectReadSection::SafeObjectReadSection()
+  {
+    SafeObjectSingleton::Instance().EnterReadSection();
+  }
+
+  /***********************************************************************************************/
+  SafeObjectReadSection::~SafeObjectReadSection()
+  {
+    SafeObjectSingleton::Instance().LeaveReadSection();
   }
 
   /***********************************************************************************************/
@@ -53,13 +1043,9 @@ namespace Skugo
     if (safeObject)
     {
       mId = safeObject->mId;
-      
-      // A reference count of 0 or positive means we are using reference counting
-      // A negative reference count means we are not reference counting (not allocated via SkugoNew)
-      if (safeObject->mReferenceCount != SafeObject::cNoReferenceCounting)
-      {
-        ++safeObject->mReferenceCount;
-      }
+
+      // Objects that were not allocated via SkugoNew ignore this
+      safeObject->AddReference();
     }
     else
     {
@@ -67,37 +1053,179 @@ namespace Skugo
     }
   }
 
+  /***********************************************************************************************/
+  Handle::Handle(const Handle& rhs) :
+    mId(rhs.mId)
+  {
+    // The object may have been explicitly deleted, in which case we just copy the stale id
+    SafeObject* safeObject = SafeObjectSingleton::Instance().Find(mId);
+    if (safeObject)
+    {
+      safeObject->AddReference();
+    }
+  }
+
+  /***********************************************************************************************/
+  Handle::Handle(Handle&& rhs) noexcept :
+    mId(rhs.mId)
+  {
+    // We take over the reference that rhs held, so there is nothing to count
+    rhs.mId = 0;
+  }
+
   /***********************************************************************************************/
   Handle::~Handle()
   {
-    SafeObject* safeObject = Dereference();
+    Release();
+  }
 
-    if (safeObject)
+  /***********************************************************************************************/
+  Handle& Handle::operator=(const Handle& rhs)
+  {
+    if (this != &rhs)
     {
-      if (safeObject->mReferenceCount != SafeObject::cNoReferenceCounting)
-      {
-        SkugoErrorIf(safeObject->mReferenceCount == 0,
-          "The reference count was already zero but we tried to decrement it");
-        --safeObject->mReferenceCount;
+      // Copy first in case releasing our object is what keeps rhs's object alive
+      Handle copy(rhs);
+      Release();
+      mId = copy.mId;
+      copy.mId = 0;
+    }
+    return *this;
+  }
 
-        if (safeObject->mReferenceCount == 0)
-        {
-          delete safeObject;
-        }
-      }
+  /***********************************************************************************************/
+  Handle& Handle::operator=(Handle&& rhs) noexcept
+  {
+    if (this != &rhs)
+    {
+      Release();
+      mId = rhs.mId;
+      rhs.mId = 0;
+    }
+    return *this;
+  }
+
+  /***********************************************************************************************/
+  void Handle::Release()
+  {
+    // Moved from and null handles have nothing to release
+    if (mId == 0)
+    {
+      return;
+    }
+
+    SafeObjectSingleton& singleton = SafeObjectSingleton::Instance();
+    SafeObject* safeObject = singleton.Find(mId);
+    mId = 0;
+
+    if (safeObject && safeObject->ReleaseReference())
+    {
+      singleton.Delete(safeObject);
     }
   }
 
   /***********************************************************************************************/
-  SafeObject* Handle::Dereference()
+  SafeObject* Handle::Dereference() const
   {
     SafeObjectSingleton& singleton = SafeObjectSingleton::Instance();
-    auto it = singleton.mIdToSafeObject.find(mId);
-    if (it != singleton.mIdToSafeObject.end())
+    SafeObject* safeObject = singleton.Find(mId);
+
+    // A non-null handle that finds nothing is stale (its object was destroyed)
+    if (safeObject == nullptr && mId != 0)
     {
-      return it->second;
+      singleton.mFailedDereferences.fetch_add(1, memory_order_relaxed);
     }
+    return safeObject;
+  }
 
-    return nullptr;
+  /***********************************************************************************************/
+  SafeObject* Handle::Dereference(const SafeObjectTypeInfo*& typeInfoOut) const
+  {
+    SafeObjectSingleton& singleton = SafeObjectSingleton::Instance();
+    SafeObject* safeObject = singleton.Find(mId, typeInfoOut);
+    if (safeObject == nullptr && mId != 0)
+    {
+      singleton.mFailedDereferences.fetch_add(1, memory_order_relaxed);
+    }
+    return safeObject;
+  }
+
+  /***********************************************************************************************/
+  HandleEnumerator::~HandleEnumerator()
+  {
+  }
+
+  /***********************************************************************************************/
+  uint64_t HandleEnumerator::GetId(const Handle& handle)
+  {
+    return handle.mId;
+  }
+
+  /***********************************************************************************************/
+  WeakHandle::WeakHandle() :
+    mId(0)
+  {
+  }
+
+  /***********************************************************************************************/
+  WeakHandle::WeakHandle(SafeObject* safeObject) :
+    mId(safeObject ? safeObject->mId : 0)
+  {
+  }
+
+  /***********************************************************************************************/
+  WeakHandle::WeakHandle(const Handle& handle) :
+    mId(handle.mId)
+  {
+  }
+
+  /***********************************************************************************************/
+  SafeObject* WeakHandle::Dereference() const
+  {
+    const SafeObjectTypeInfo* typeInfo = nullptr;
+    return Dereference(typeInfo);
+  }
+
+  /***********************************************************************************************/
+  SafeObject* WeakHandle::Dereference(const SafeObjectTypeInfo*& typeInfoOut) const
+  {
+    SafeObjectSingleton& singleton = SafeObjectSingleton::Instance();
+    SafeObject* safeObject = singleton.Find(mId, typeInfoOut);
+    if (safeObject == nullptr && mId != 0)
+    {
+      singleton.mFailedDereferences.fetch_add(1, memory_order_relaxed);
+    }
+    return safeObject;
+  }
+
+  /***********************************************************************************************/
+  Handle WeakHandle::Promote() const
+  {
+    Handle handle;
+    const SafeObjectTypeInfo* typeInfo = nullptr;
+    Promote(handle, typeInfo);
+    return handle;
+  }
+
+  /***********************************************************************************************/
+  SafeObject* WeakHandle::Promote(Handle& handleOut, const SafeObjectTypeInfo*& typeInfoOut) const
+  {
+    if (mId == 0)
+    {
+      typeInfoOut = nullptr;
+      return nullptr;
+    }
+
+    // Another thread may be releasing the last reference, so the memory must stay valid while we
+    // look at the count (the count is what tells us whether the object is still worth keeping)
+    SafeObjectReadSection readSection;
+    SafeObject* safeObject = SafeObjectSingleton::Instance().Find(mId, typeInfoOut);
+    if (safeObject == nullptr || !safeObject->TryAddReference())
+    {
+      return nullptr;
+    }
+
+    handleOut.mId = mId;
+    return safeObject;
   }
 }
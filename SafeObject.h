@@ -4,75 +4,624 @@
 #pragma once
 
 #include "Singleton.h"
+#include "SlabAllocator.h"
 
 namespace Skugo
 {
   // All objects in Skugo are reference counted with safe handles.
   // Objects may also be explicitly deleted.
 
-  // This class manages which objects are alive via a map (and assigns ids to new objects)
+  // How a particular object's reference count is maintained
+  enum class ReferenceCountingMode : uint8_t
+  {
+    // The object was not allocated via SkugoNew, so its lifetime is controlled elsewhere
+    None,
+    NonAtomic,
+    Atomic
+  };
+
+  // Reference counting policies are chosen per SafeObject type at compile time. Types default to
+  // non-atomic counting, which costs no more than a plain increment and decrement but requires that
+  // every handle to the object lives on one thread. A type whose handles cross threads declares:
+  //   typedef AtomicReferenceCounting ReferenceCountingPolicy;
+  // SkugoNew records the policy on the object, so only objects that are actually shared pay for atomics.
+  class NonAtomicReferenceCounting
+  {
+  public:
+    static const ReferenceCountingMode cMode = ReferenceCountingMode::NonAtomic;
+
+    static void Increment(atomic<uint32_t>& count);
+
+    // Returns true when the last reference was released
+    static bool Decrement(atomic<uint32_t>& count);
+  };
+
+  // Increments are relaxed (a new reference can only be made from an existing one), and decrements
+  // release so that all writes to the object happen before whichever thread ends up deleting it
+  class AtomicReferenceCounting
+  {
+  public:
+    static const ReferenceCountingMode cMode = ReferenceCountingMode::Atomic;
+
+    static void Increment(atomic<uint32_t>& count);
+
+    // Only increments if the count is not already zero (another thread may be about to delete the object)
+    static bool IncrementIfNonZero(atomic<uint32_t>& count);
+
+    // Returns true when the last reference was released
+    static bool Decrement(atomic<uint32_t>& count);
+  };
+
+  // Every type allocated via SkugoNew is assigned a small index the first time it is used
+  template <typename T>
+  class SafeObjectTypeIndex
+  {
+  public:
+    static uint32_t Get();
+  };
+
+  // Describes where a type sits in the SafeObject hierarchy so that HandleOf can check types without
+  // a dynamic_cast. The address of each type's info is its id (it is unique and known at link time).
+  // A declared type at depth D has the ids of all of its ancestors in mAncestors[0..D] (SafeObject is
+  // at depth 0), so an object is a T exactly when its mAncestors[depth of T] is the id of T.
+  class SafeObjectTypeInfo
+  {
+  public:
+    static const uint32_t cMaxDepth = 16;
+
+    // The depth of types that did not declare their base (see SkugoSafeObjectType)
+    static const uint32_t cUndeclared = static_cast<uint32_t>(-1);
+
+    uint32_t mDepth;
+    const SafeObjectTypeInfo* mAncestors[cMaxDepth];
+  };
+
+  // Holds the info for T (which is filled in the first time T is allocated via SkugoNew)
+  template <typename T>
+  class SafeObjectTypeInfoOf
+  {
+  public:
+    static const SafeObjectTypeInfo* Initialize();
+
+    static SafeObjectTypeInfo sInfo;
+
+  private:
+    static once_flag sInitialized;
+  };
+
+  // Computes the depth of T from the base types declared with SkugoSafeObjectType
+  // A type only counts as declared if it and all of its bases declared themselves
+  template <typename T>
+  class SafeObjectTypeTraits
+  {
+  public:
+    typedef typename T::SkugoBaseType BaseType;
+
+    static const bool cDeclared =
+      is_same<typename T::SkugoSelfType, T>::value && SafeObjectTypeTraits<BaseType>::cDeclared;
+    static const uint32_t cDepth = cDeclared ? SafeObjectTypeTraits<BaseType>::cDepth + 1 : 0;
+
+    // Fills in the ids of T and all of its ancestors
+    static void FillAncestors(SafeObjectTypeInfo& info);
+  };
+
+  template <>
+  class SafeObjectTypeTraits<SafeObject>
+  {
+  public:
+    static const bool cDeclared = true;
+    static const uint32_t cDepth = 0;
+
+    static void FillAncestors(SafeObjectTypeInfo& info);
+  };
+
+  // Returns the object as a T (or null if it isn't one) using the type info stored in its slot
+  // Falls back to a dynamic_cast for objects without type info or types that did not declare their base
+  template <typename T>
+  T* SafeObjectCast(SafeObject* safeObject, const SafeObjectTypeInfo* typeInfo);
+
+  // Declares the base type of a SafeObject type (this must be placed in a public section of the class)
+  // Types that declare themselves, and whose bases all do too, are checked by HandleOf::Dereference
+  // with an integer compare rather than a dynamic_cast.
+  #define SkugoSafeObjectType(SelfType, BaseTypeName) \
+    typedef SelfType SkugoSelfType;                   \
+    typedef BaseTypeName SkugoBaseType
+
+  // A snapshot of the counters kept for one type allocated via SkugoNew
+  class SafeObjectTypeStats
+  {
+  public:
+    const char* mName;
+    size_t mBlockSize;
+
+    uint64_t mLive;
+    uint64_t mCreated;
+    uint64_t mDestroyed;
+
+    // The most objects of this type that were ever alive at once
+    uint64_t mHighWaterMark;
+
+    // Every block ever handed out for this type, and the blocks of the live objects
+    uint64_t mBytesAllocated;
+    uint64_t mLiveBytes;
+  };
+
+  // A snapshot of every type's counters along with totals (see SafeObjectSingleton::GetObjectStats)
+  class SafeObjectStats
+  {
+  public:
+    vector<SafeObjectTypeStats> mTypes;
+    uint64_t mBytesAllocated;
+    uint64_t mLiveBytes;
+
+    // Dereferences of non-null handles whose object had already been destroyed
+    uint64_t mFailedDereferences;
+  };
+
+  // Information the singleton keeps about every type that has been allocated via SkugoNew
+  class SafeObjectType
+  {
+  public:
+    SafeObjectType(const char* name, size_t size, size_t alignment, const SafeObjectTypeInfo* typeInfo);
+
+    // Adds to or swap-removes from the dense array of live objects
+    void Add(SafeObject* safeObject);
+    void Remove(SafeObject* safeObject);
+
+    // Bracket a walk over mObjects (see SafeObjectSingleton::ForEach). While any walk is in progress
+    // Remove only nulls out the object's entry, so nothing moves under the walk, and the last walk to
+    // end packs the array again.
+    void BeginWalk();
+    void EndWalk();
+
+    // Updates the counters (only while mObjectsMutex is held, which Add and Remove already take)
+    void RecordCreated();
+    void RecordDestroyed();
+
+    SafeObjectTypeStats GetStats();
+
+    const char* mName;
+
+    // Stored in the slot of every object of this type
+    const SafeObjectTypeInfo* mTypeInfo;
+
+    // All objects of this type allocated via SkugoNew live in this allocator's slabs
+    SlabAllocator mAllocator;
+
+    // Every live object whose dynamic type is exactly this type, packed together so that systems
+    // which update every object of a type stream through memory linearly
+    vector<SafeObject*> mObjects;
+
+    // Objects of one type may be created and destroyed on any thread, so the array needs a lock (an
+    // array per thread would avoid it, but then a type's objects would no longer be one dense range).
+    // It is only contended when several threads churn the same type at once. Uncontended it costs
+    // about 25 ns on each create and destroy (see BenchmarkObjectStats), and the counters come free.
+    mutex mObjectsMutex;
+
+    // Walks in progress, and how many null entries they left in mObjects
+    size_t mWalks;
+    size_t mHoles;
+
+    // The live count is the size of mObjects (less its holes)
+    uint64_t mCreated;
+    uint64_t mDestroyed;
+    uint64_t mHighWaterMark;
+  };
+
+  // A range over every live object whose dynamic type is exactly T (see SafeObjectSingleton::GetObjects)
+  template <typename T>
+  class SafeObjectRange
+  {
+  public:
+    class iterator
+    {
+    public:
+      iterator(SafeObject* const* position);
+
+      T& operator*() const;
+      T* operator->() const;
+      iterator& operator++();
+      bool operator==(const iterator& rhs) const;
+      bool operator!=(const iterator& rhs) const;
+
+    private:
+      SafeObject* const* mPosition;
+    };
+
+    SafeObjectRange(SafeObject* const* begin, SafeObject* const* end);
+
+    iterator begin() const;
+    iterator end() const;
+    size_t size() const;
+    bool empty() const;
+
+  private:
+    SafeObject* const* mBegin;
+    SafeObject* const* mEnd;
+  };
+
+  // This class manages which objects are alive via a generational slot map (and assigns ids to new objects)
+  // An id is the index of the object's slot in the low 32 bits and the generation of that slot in the
+  // high 32 bits. Whenever a slot is released its generation is incremented, so any handle that still
+  // holds the old id will fail to match and will dereference to null (even once the slot is reused).
+  // Objects may be created, destroyed and dereferenced from any thread. Slots live in pages that never
+  // move, so dereferencing is lock free, and each thread hands out slots from its own reserved range.
   class SafeObjectSingleton : public Singleton<SafeObjectSingleton>
   {
   public:
     friend class SafeObject;
     friend class Handle;
+    friend class WeakHandle;
+    friend class CycleCollector;
 
     SafeObjectSingleton();
+    ~SafeObjectSingleton();
 
     template <typename T, typename... Args>
     T* NewReferenceCountedSafeObject(Args&&... args);
 
+    // Creates count reference counted objects of type T (each constructed from the same arguments)
+    // in contiguous memory (see SlabAllocator::AllocateBatch). All of their ids are reserved up front,
+    // so the registry grows at most once, and the objects are published to the registry in a single
+    // pass after construction (so a handle an object makes to itself in its constructor will be null).
+    // A handle to every new object is appended to handles (which keeps them alive).
+    template <typename T, typename... Args>
+    void NewReferenceCountedSafeObjects(size_t count, vector<HandleOf<T>>& handles, Args&&... args);
+
+    // Releases a whole batch of handles at once (and clears the vector). The memory of every object
+    // that dies is collected and returned to its slab allocator in one go rather than one at a time.
+    template <typename HandleType>
+    void ReleaseHandles(vector<HandleType>& handles);
+
+    // Walks every live object whose dynamic type is exactly T (only objects created via SkugoNew or
+    // NewReferenceCountedSafeObjects are tracked). The function may delete any objects of type T (the
+    // ones it hasn't been given yet are then skipped) or create new ones (which are not visited), since
+    // objects deleted during the walk leave a hole in the dense array that is only packed once it ends.
+    // Must not run at the same time as other threads create or destroy objects of type T.
+    template <typename T, typename Function>
+    void ForEach(Function function);
+
+    // The same objects as ForEach, as a range that can be used in a range based for loop
+    // No objects of type T may be created or destroyed while iterating the range, and it must not be
+    // taken during a ForEach over T (which may have left holes in the array).
+    template <typename T>
+    SafeObjectRange<T> GetObjects();
+
+    // Returns the capacity and occupancy of the slab allocator for every type allocated via SkugoNew
+    vector<SlabAllocatorStats> GetAllocatorStats() const;
+
+    // Returns how many objects of each type allocated via SkugoNew are alive, have been created and
+    // destroyed, and how much memory they took. The counters are always on and are updated under the
+    // lock each type already takes to maintain its dense array, so they cost a few increments.
+    SafeObjectStats GetObjectStats() const;
+
+    // Sends the snapshot through the LoggingSingleton, one type per line (busiest types first)
+    void LogObjectStats() const;
+
+    // A SafeObject may be deleted at any time (explicitly or by its last handle) on any thread, so a raw
+    // pointer returned by Dereference is only guaranteed to point at valid memory while the thread is
+    // inside a read section. Destroying an object unregisters it before any destructor runs (see Delete),
+    // so Dereference returns null right away and never returns an object that is being torn down, but
+    // its memory is only freed once every thread that was reading has left its read section.
+    // Read sections may be nested and are very cheap (see SafeObjectReadSection).
+    void EnterReadSection();
+    void LeaveReadSection();
+
+    // Unregisters the object and then deletes it, which is what releasing the last handle does
+    // A plain delete only unregisters once the derived destructors have already run, so objects that
+    // other threads may be dereferencing must be destroyed through here (see SkugoDelete).
+    void Delete(SafeObject* safeObject);
+
+    // Frees any memory this thread retired that no reader can still be looking at
+    // This also happens automatically as objects are deleted, but it is good to call once per frame
+    void ReclaimMemory();
+
+    // Cycle collection is off by default. While it is on, every non-atomic reference counted object whose
+    // count drops without reaching zero is buffered as a possible root of a garbage cycle, and
+    // CollectCycles examines the buffered roots for roughly the given budget (see CycleCollector).
+    // Returns true once every buffered root has been examined. Must be called on the thread that
+    // owns the non-atomic objects. Turning collection off stops buffering roots, and the following
+    // CollectCycles calls (still within their budget) free any garbage that was already found and clear
+    // the collector's marks, returning true once it is gone.
+    void SetCycleCollectionEnabled(bool enabled);
+    bool CollectCycles(uint64_t budgetMicroseconds);
+    CycleCollectorStats GetCycleCollectorStats() const;
+
+    // Only used by SafeObjectTypeIndex (indices are shared by all singleton instances)
+    static uint32_t AllocateTypeIndex();
+
+  private:
+    template <typename T>
+    SafeObjectType& GetType();
+    SafeObjectType* CreateType(uint32_t index, const char* name, size_t size, size_t alignment,
+      const SafeObjectTypeInfo* typeInfo);
+
+    class Slot
+    {
+    public:
+      // The object living in this slot (null when the slot is free)
+      atomic<SafeObject*> mObject;
+
+      // The full id of the object living in this slot (0 when the slot is free)
+      // Readers load the object first and then validate it against this id
+      atomic<uint64_t> mId;
+
+      // The dynamic type of the object (null if it was not allocated via SkugoNew)
+      atomic<const SafeObjectTypeInfo*> mTypeInfo;
+
+      // Generations start at 1 so that no live id is ever 0 (which is reserved for null)
+      // Only the thread that currently owns the free slot modifies this
+      uint32_t mGeneration;
+    };
+
+    // Memory of a destroyed object that is waiting for readers to move on before it is freed
+    class RetiredMemory
+    {
+    public:
+      SlabAllocator* mAllocator;
+      void* mMemory;
+
+      // The memory may be freed once every reader has entered at this epoch or later
+      uint64_t mSafeEpoch;
+    };
+
+    // Every thread that reads or deletes objects claims one of these. Records outlive their threads
+    // (a new thread will claim an unused record) so retired memory is never lost.
+    class EpochRecord
+    {
+    public:
+      EpochRecord();
+
+      // The epoch this thread entered its read section at (0 when it is not reading)
+      atomic<uint64_t> mActiveEpoch;
+
+      // Set while a thread owns this record (or while another thread is reclaiming its memory)
+      atomic<bool> mInUse;
+
+      // Retired memory that has not been given a safe epoch yet, and memory that has
+      vector<pair<SlabAllocator*, void*>> mPending;
+      vector<RetiredMemory> mRetired;
+    };
+
+    // Each thread keeps its own cache of free slots so that threads creating and destroying objects
+    // never contend with each other. Fresh slots are reserved from the shared slot count in ranges,
+    // and free slots are traded with the shared free list in whole batches.
+    class ThreadContext
+    {
+    public:
+      ThreadContext();
+      ~ThreadContext();
+
+      // Drops any cached slots if they were handed out by a previous singleton instance
+      void Validate(uint64_t singletonSerial);
+
+      // Which singleton instance the cached slots belong to
+      uint64_t mSingletonSerial;
+      vector<uint32_t> mFreeSlots;
+      uint32_t mReservedBegin;
+      uint32_t mReservedEnd;
+
+      // We only want to perform reference counting and automatic deletion on objects that were
+      // allocated via the heap (or more importantly, objects whose lifetimes aren't controlled)
+      // For example, a stack object's lifetime is controlled by the compiler and scope, and an
+      // object inside an array is controlled by the lifetime of the array (or clear/remove calls).
+      // We only want objects that are individually allocated, therefore it must be via SkugoNew.
+      // We could try to abuse operator new and assume placement new is used in all cases where memory
+      // is controlled, however there is no guarantee std::vector uses placement new vs normal new.
+      // SkugoNew sets this right before constructing and the constructor of SafeObject consumes it.
+      // Because it is per thread, no other thread can ever observe or steal the decision.
+      ReferenceCountingMode mNextObjectReferenceCounting;
+
+      // The type (and allocator) SkugoNew took the memory for the next object from
+      SafeObjectType* mNextObjectType;
+
+      // When a SafeObject is deleted, its destructor stores its allocator here right before
+      // SafeObject::operator delete runs (on the same thread) so the memory goes back to the right slab
+      SlabAllocator* mDeletingAllocator;
+
+      // When non-zero, the next object takes this id and skips registering (a batch publishes it later)
+      uint64_t mNextObjectId;
+
+      // While releasing a batch of handles, freed memory is collected here and retired all at once
+      size_t mBatchReleaseDepth;
+      vector<pair<SlabAllocator*, void*>> mBatchFrees;
+
+      // Claimed the first time this thread reads or deletes objects
+      EpochRecord* mEpochRecord;
+      size_t mReadSectionDepth;
+    };
+
+    static ThreadContext& GetThreadContext();
+
+    // Returns the object with the id, or null if it has been destroyed
+    SafeObject* Find(uint64_t id);
+    SafeObject* Find(uint64_t id, const SafeObjectTypeInfo*& typeInfoOut);
+
+    // Places the object in a free slot and returns its id
+    uint64_t Register(SafeObject* safeObject, const SafeObjectTypeInfo* typeInfo, ThreadContext& context);
+
+    // Frees the slot the id refers to and bumps the generation so the id can never match again
+    void Unregister(uint64_t id, ThreadContext& context);
+
+    // Unregisters the object and removes it from its type's dense array (only the first call does anything)
+    void Detach(SafeObject* safeObject, ThreadContext& context);
+
+    uint32_t AcquireSlot(ThreadContext& context);
+    // Acquires count slots at once, reserving at most one fresh range of slots
+    void AcquireSlots(size_t count, ThreadContext& context, vector<uint32_t>& slotsOut);
+    void Publish(uint32_t slotIndex, SafeObject* safeObject, const SafeObjectTypeInfo* typeInfo, uint64_t id);
+    uint64_t GetNextId(uint32_t slotIndex);
+
+    void BeginBatchRelease(ThreadContext& context);
+    void EndBatchRelease(ThreadContext& context);
+
+    EpochRecord& GetEpochRecord(ThreadContext& context);
+
+    // Hands memory over to be freed once no reader can still be looking at it
+    void Retire(SlabAllocator* allocator, void* memory, ThreadContext& context);
+    void Reclaim(EpochRecord& record);
+
+    // Frees memory grouped by allocator so that each allocator is only locked once
+    static void FreeMemory(vector<pair<SlabAllocator*, void*>>& memory);
+    void ReleaseSlot(uint32_t slotIndex, ThreadContext& context);
+
+    // Makes sure every page covering the slot range has been allocated
+    void AllocatePages(uint32_t beginSlot, uint32_t endSlot);
+    Slot& GetSlot(uint32_t slotIndex);
+
+    static uint32_t GetSlotIndex(uint64_t id);
+    static uint32_t GetGeneration(uint64_t id);
+    static uint64_t MakeId(uint32_t slotIndex, uint32_t generation);
+
+    static const uint32_t cSlotPageBits = 14;
+    static const uint32_t cSlotsPerPage = 1 << cSlotPageBits;
+    static const uint32_t cMaxSlotPages = 1 << 14;
+    static const uint64_t cMaxSlots = static_cast<uint64_t>(cSlotsPerPage) * cMaxSlotPages;
+
+    // How many slots a thread reserves at a time, and the size of batches moved to the shared free list
+    static const uint32_t cSlotBatchSize = 256;
+
+    // Slot 0 is permanently empty with an id of 0, which means the null id always resolves
+    // to a null object without needing any special case or bounds check
+    atomic<Slot*> mPages[cMaxSlotPages];
+    mutex mPagesMutex;
+
+    // How many slots have ever been reserved by threads
+    atomic<uint32_t> mSlotCount;
+
+    // Batches of free slots that were given back by threads that had too many
+    vector<vector<uint32_t>> mFreeBatches;
+    mutex mFreeBatchesMutex;
+
+    // Distinguishes this instance from previous ones so stale thread caches can be dropped
+    uint64_t mSerial;
+
+    // How much memory a thread retires before it automatically tries to reclaim
+    static const size_t cReclaimThreshold = 128;
+
+    // Starts at 1 since an active epoch of 0 means a thread is not reading
+    atomic<uint64_t> mEpoch;
+    vector<unique_ptr<EpochRecord>> mEpochRecords;
+    mutex mEpochRecordsMutex;
+
+    static const uint32_t cMaxTypes = 4096;
+
+    // Indexed by SafeObjectTypeIndex and created the first time a type is allocated
+    atomic<SafeObjectType*> mTypes[cMaxTypes];
+    mutex mTypesMutex;
+
+    // Null unless cycle collection is enabled
+    unique_ptr<CycleCollector> mCycleCollector;
+
+    // Only incremented when a dereference fails, so valid dereferences never touch it
+    atomic<uint64_t> mFailedDereferences;
+  };
+
+  // Enters a read section for the lifetime of this object (see SafeObjectSingleton::EnterReadSection)
+  class SafeObjectReadSection
+  {
+  public:
+    SafeObjectReadSection();
+    ~SafeObjectReadSection();
+
   private:
-    // Counts up for every object (generally never wraps around because it is 64bit).
-    // Note that 0 is reserved for null, so the count starts at 1.
-    uint64_t mIdCounter;
-    unordered_map<uint64_t, SafeObject*> mIdToSafeObject;
-
-    // We only want to perform reference counting and automatic deletion on objects that were
-    // allocated via the heap (or more importantly, objects whose lifetimes aren't controlled)
-    // For example, a stack object's lifetime is controlled by the compiler and scope, and an
-    // object inside an array is controlled by the lifetime of the array (or clear/remove calls).
-    // We only want objects that are individually allocated, therefore it must be via SkugoNew.
-    // We could try to abuse operator new and assume placement new is used in all cases where memory
-    // is controlled, however there is no guarantee std::vector uses placement new vs normal new.
-    // The constructor of SafeObject utilizes this bool.
-    bool mIsNextObjectReferenceCounted;
+    SafeObjectReadSection(const SafeObjectReadSection&) = delete;
+    SafeObjectReadSection& operator=(const SafeObjectReadSection&) = delete;
   };
 
   // Allocates a SafeObject that is also reference counted
   #define SkugoNew(T, ...) (::Skugo::SafeObjectSingleton::Instance().NewReferenceCountedSafeObject<T>(__VA_ARGS__))
 
+  // Explicitly deletes a SafeObject (see SafeObjectSingleton::Delete)
+  #define SkugoDelete(safeObject) (::Skugo::SafeObjectSingleton::Instance().Delete(safeObject))
+
   // All of our classes should inherit from safe object in order to be refernece counted and looked up via handles
   class SafeObject
   {
   public:
     friend class SafeObjectSingleton;
+    friend class SafeObjectType;
     friend class Handle;
+    friend class WeakHandle;
+    friend class CycleCollector;
+
+    // Derived types may redeclare this to opt into atomic reference counting
+    typedef NonAtomicReferenceCounting ReferenceCountingPolicy;
+
+    // The root of every declared hierarchy (see SkugoSafeObjectType)
+    typedef SafeObject SkugoSelfType;
+    typedef SafeObject SkugoBaseType;
 
     SafeObject();
     virtual ~SafeObject();
 
+    // Objects created with a plain new come from the heap (SkugoNew uses its type's slab allocator)
+    static void* operator new(size_t size);
+
+    // Returns the memory of SkugoNew objects to their type's slab allocator (and everything else to the heap)
+    static void operator delete(void* memory);
+
+    // Objects that hold handles to other objects should visit each of them here, which is how the
+    // cycle collector finds the references between objects (the default holds no handles)
+    virtual void EnumerateHandles(HandleEnumerator& enumerator);
+
   private:
-    uint64_t mReferenceCount;
+    void AddReference();
+
+    // Returns true when the last reference was released and the object should be deleted
+    bool ReleaseReference();
+
+    // Adds a reference unless the object is atomically counted and its count already reached zero,
+    // or the cycle collector has condemned it as garbage
+    bool TryAddReference();
+
+    atomic<uint32_t> mReferenceCount;
+    ReferenceCountingMode mReferenceCountingMode;
     uint64_t mId;
 
-    // A constant we use as the mReferenceCount to signify we aren't doing reference counting for this object
-    static const uint64_t cNoReferenceCounting = static_cast<uint64_t >(-1);
+    // Null unless the object was allocated via SkugoNew
+    SafeObjectType* mType;
+
+    // Where we live in our type's dense array of objects
+    size_t mDenseIndex;
+
+    // Bookkeeping for the cycle collector (see CycleCollector::cBuffered)
+    uint8_t mCycleFlags;
   };
 
   // A handle generically points at any SafeObject
   // The handle will keep the object alive via a reference count, but the object may be explicitly deleted
+  // Moving a handle transfers its reference without touching the registry or the count, which
+  // also means containers of handles (such as std::vector) grow without any reference count traffic
   class Handle
   {
   public:
+    friend class HandleEnumerator;
+    friend class WeakHandle;
+    friend class GraphSerializer;
+
     Handle();
     Handle(SafeObject* safeObject);
+    Handle(const Handle& rhs);
+    Handle(Handle&& rhs) noexcept;
     ~Handle();
 
+    Handle& operator=(const Handle& rhs);
+    Handle& operator=(Handle&& rhs) noexcept;
+
     // Returns a valid SafeObject unless the object has been deleted (then it returns null)
-    SafeObject* Dereference();
+    // This is a lock free load from the slot followed by a compare against the slot's id
+    // If other threads may delete the object, only use the pointer within a read section
+    SafeObject* Dereference() const;
+
+  protected:
+    // Also returns the type info stored in the object's slot
+    SafeObject* Dereference(const SafeObjectTypeInfo*& typeInfoOut) const;
 
   private:
+    // Releases our reference (possibly deleting the object) and leaves us null
+    void Release();
+
     // The id of the object we're pointing at (0 means null)
     uint64_t mId;
   };
@@ -83,9 +632,68 @@ namespace Skugo
   public:
     HandleOf();
     HandleOf(T* instance);
+    HandleOf(const HandleOf& rhs) = default;
+    HandleOf(HandleOf&& rhs) noexcept = default;
+
+    HandleOf& operator=(const HandleOf& rhs) = default;
+    HandleOf& operator=(HandleOf&& rhs) noexcept = default;
+
+    // Returns a valid T unless the object has been deleted (then it returns null)
+    // The type is checked against the type info stored in the object's slot (see SkugoSafeObjectType)
+    T* Dereference() const;
+  };
+
+  // A weak handle refers to an object without keeping it alive. It only stores the id, so copying one
+  // or letting it go never touches the reference count, and once the object is destroyed it
+  // dereferences to null just like a handle does. Promote gives a handle that keeps the object alive.
+  class WeakHandle
+  {
+  public:
+    WeakHandle();
+    WeakHandle(SafeObject* safeObject);
+    WeakHandle(const Handle& handle);
+
+    // Returns a valid SafeObject unless the object has been deleted (then it returns null)
+    SafeObject* Dereference() const;
+
+    // Returns a handle to the object (or a null handle if the object is gone)
+    // Atomically counted objects are only promoted if some other handle still holds them
+    Handle Promote() const;
+
+  protected:
+    SafeObject* Dereference(const SafeObjectTypeInfo*& typeInfoOut) const;
+
+    // Takes a reference to the object into handleOut (which must be null) and returns the object
+    SafeObject* Promote(Handle& handleOut, const SafeObjectTypeInfo*& typeInfoOut) const;
+
+  private:
+    // The id of the object we're pointing at (0 means null)
+    uint64_t mId;
+  };
+
+  template <typename T>
+  class WeakHandleOf : public WeakHandle
+  {
+  public:
+    WeakHandleOf();
+    WeakHandleOf(T* instance);
+    WeakHandleOf(const HandleOf<T>& handle);
 
     // Returns a valid T unless the object has been deleted (then it returns null)
-    T* Dereference();
+    T* Dereference() const;
+
+    HandleOf<T> Promote() const;
+  };
+
+  // Visits every handle an object holds (see SafeObject::EnumerateHandles)
+  class HandleEnumerator
+  {
+  public:
+    virtual ~HandleEnumerator();
+    virtual void Visit(const Handle& handle) = 0;
+
+  protected:
+    static uint64_t GetId(const Handle& handle);
   };
 }
 
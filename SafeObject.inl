@@ -9,10 +9,371 @@ namespace Skugo
   template <typename T, typename... Args>
   T* SafeObjectSingleton::NewReferenceCountedSafeObject(Args&&... args)
   {
-    mIsNextObjectReferenceCounted = true;
+    static_assert(is_base_of<SafeObject, T>::value, "The object being allocated must be a SafeObject");
 
-    // Storing it as a SafeObject* just ensures that the object being allocated is indeed a SafeObject
-    SafeObject* safeObject = new T(std::forward<Args>(args)...);
-    return safeObject;
+    SafeObjectType& type = GetType<T>();
+    void* memory = type.mAllocator.Allocate();
+
+    ThreadContext& context = GetThreadContext();
+    context.mNextObjectReferenceCounting = T::ReferenceCountingPolicy::cMode;
+    context.mNextObjectType = &type;
+    return ::new (memory) T(std::forward<Args>(args)...);
+  }
+
+  /***********************************************************************************************/
+  template <typename T, typename... Args>
+  void SafeObjectSingleton::NewReferenceCountedSafeObjects(size_t count, vector<HandleOf<T>>& handles, Args&&... args)
+  {
+    static_assert(is_base_of<SafeObject, T>::value, "The objects being allocated must be SafeObjects");
+
+    if (count == 0)
+    {
+      return;
+    }
+
+    SafeObjectType& type = GetType<T>();
+    vector<void*> blocks;
+    type.mAllocator.AllocateBatch(count, blocks);
+
+    ThreadContext& context = GetThreadContext();
+    vector<uint32_t> slots;
+    AcquireSlots(count, context, slots);
+
+    vector<T*> instances(count);
+    for (size_t i = 0; i < count; ++i)
+    {
+      context.mNextObjectReferenceCounting = T::ReferenceCountingPolicy::cMode;
+      context.mNextObjectType = &type;
+      context.mNextObjectId = GetNextId(slots[i]);
+      instances[i] = ::new (blocks[i]) T(args...);
+    }
+
+    handles.reserve(handles.size() + count);
+    for (size_t i = 0; i < count; ++i)
+    {
+      T* instance = instances[i];
+      Publish(slots[i], instance, type.mTypeInfo, instance->mId);
+      handles.emplace_back(instance);
+    }
+  }
+
+  /***********************************************************************************************/
+  template <typename HandleType>
+  void SafeObjectSingleton::ReleaseHandles(vector<HandleType>& handles)
+  {
+    ThreadContext& context = GetThreadContext();
+    BeginBatchRelease(context);
+    handles.clear();
+    EndBatchRelease(context);
+  }
+
+  /***********************************************************************************************/
+  template <typename T, typename Function>
+  void SafeObjectSingleton::ForEach(Function function)
+  {
+    // Nothing moves while we walk (objects deleted along the way leave a null entry behind), and
+    // objects created along the way are added past where we started
+    SafeObjectType& type = GetType<T>();
+    vector<SafeObject*>& objects = type.mObjects;
+    type.BeginWalk();
+    for (size_t i = objects.size(); i > 0; --i)
+    {
+      SafeObject* safeObject = objects[i - 1];
+      if (safeObject)
+      {
+        function(*static_cast<T*>(safeObject));
+      }
+    }
+    type.EndWalk();
+  }
+
+  /***********************************************************************************************/
+  template <typename T>
+  SafeObjectRange<T> SafeObjectSingleton::GetObjects()
+  {
+    vector<SafeObject*>& objects = GetType<T>().mObjects;
+    return SafeObjectRange<T>(objects.data(), objects.data() + objects.size());
+  }
+
+  /***********************************************************************************************/
+  template <typename T>
+  SafeObjectType& SafeObjectSingleton::GetType()
+  {
+    uint32_t index = SafeObjectTypeIndex<T>::Get();
+    SafeObjectType* type = mTypes[index].load(memory_order_acquire);
+    if (type == nullptr)
+    {
+      type = CreateType(index, typeid(T).name(), sizeof(T), alignof(T), SafeObjectTypeInfoOf<T>::Initialize());
+    }
+    return *type;
+  }
+
+  /***********************************************************************************************/
+  template <typename T>
+  uint32_t SafeObjectTypeIndex<T>::Get()
+  {
+    static const uint32_t index = SafeObjectSingleton::AllocateTypeIndex();
+    return index;
+  }
+
+  /***********************************************************************************************/
+  template <typename T>
+  SafeObjectTypeInfo SafeObjectTypeInfoOf<T>::sInfo;
+
+  /***********************************************************************************************/
+  template <typename T>
+  once_flag SafeObjectTypeInfoOf<T>::sInitialized;
+
+  /***********************************************************************************************/
+  template <typename T>
+  const SafeObjectTypeInfo* SafeObjectTypeInfoOf<T>::Initialize()
+  {
+    typedef SafeObjectTypeTraits<T> Traits;
+    static_assert(Traits::cDepth < SafeObjectTypeInfo::cMaxDepth, "The SafeObject hierarchy is too deep");
+
+    call_once(sInitialized, []()
+    {
+      if (Traits::cDeclared)
+      {
+        sInfo.mDepth = Traits::cDepth;
+        Traits::FillAncestors(sInfo);
+      }
+      else
+      {
+        sInfo.mDepth = SafeObjectTypeInfo::cUndeclared;
+      }
+    });
+    return &sInfo;
+  }
+
+  /***********************************************************************************************/
+  template <typename T>
+  void SafeObjectTypeTraits<T>::FillAncestors(SafeObjectTypeInfo& info)
+  {
+    SafeObjectTypeTraits<BaseType>::FillAncestors(info);
+    info.mAncestors[cDepth] = &SafeObjectTypeInfoOf<T>::sInfo;
+  }
+
+  /***********************************************************************************************/
+  template <typename T>
+  T* SafeObjectCast(SafeObject* safeObject, const SafeObjectTypeInfo* typeInfo)
+  {
+    typedef SafeObjectTypeTraits<T> Traits;
+    static_assert(is_base_of<SafeObject, T>::value, "Only SafeObjects can be cast");
+
+    // The object is exactly a T (which is the common case)
+    if (typeInfo == &SafeObjectTypeInfoOf<T>::sInfo)
+    {
+      return static_cast<T*>(safeObject);
+    }
+
+    if (safeObject == nullptr)
+    {
+      return nullptr;
+    }
+
+    // The object is a T if T is its ancestor at T's depth
+    if (Traits::cDeclared && typeInfo && typeInfo->mDepth != SafeObjectTypeInfo::cUndeclared)
+    {
+      if (typeInfo->mDepth >= Traits::cDepth && typeInfo->mAncestors[Traits::cDepth] == &SafeObjectTypeInfoOf<T>::sInfo)
+      {
+        return static_cast<T*>(safeObject);
+      }
+      return nullptr;
+    }
+
+    return dynamic_cast<T*>(safeObject);
+  }
+
+  /***********************************************************************************************/
+  inline void NonAtomicReferenceCounting::Increment(atomic<uint32_t>& count)
+  {
+    // A relaxed load and store compiles down to a plain increment (no locked instructions)
+    count.store(count.load(memory_order_relaxed) + 1, memory_order_relaxed);
+  }
+
+  /***********************************************************************************************/
+  inline bool NonAtomicReferenceCounting::Decrement(atomic<uint32_t>& count)
+  {
+    uint32_t newCount = count.load(memory_order_relaxed) - 1;
+    count.store(newCount, memory_order_relaxed);
+    return newCount == 0;
+  }
+
+  /***********************************************************************************************/
+  inline void AtomicReferenceCounting::Increment(atomic<uint32_t>& count)
+  {
+    count.fetch_add(1, memory_order_relaxed);
+  }
+
+  /***********************************************************************************************/
+  inline bool AtomicReferenceCounting::IncrementIfNonZero(atomic<uint32_t>& count)
+  {
+    uint32_t current = count.load(memory_order_relaxed);
+    while (current != 0)
+    {
+      if (count.compare_exchange_weak(current, current + 1, memory_order_relaxed))
+      {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  /***********************************************************************************************/
+  inline bool AtomicReferenceCounting::Decrement(atomic<uint32_t>& count)
+  {
+    if (count.fetch_sub(1, memory_order_release) == 1)
+    {
+      // Synchronize with every other thread's release so the deleting thread sees all of their writes
+      atomic_thread_fence(memory_order_acquire);
+      return true;
+    }
+
+    return false;
+  }
+
+  /***********************************************************************************************/
+  template <typename T>
+  HandleOf<T>::HandleOf()
+  {
+  }
+
+  /***********************************************************************************************/
+  template <typename T>
+  HandleOf<T>::HandleOf(T* instance) :
+    Handle(instance)
+  {
+  }
+
+  /***********************************************************************************************/
+  template <typename T>
+  T* HandleOf<T>::Dereference() const
+  {
+    const SafeObjectTypeInfo* typeInfo = nullptr;
+    SafeObject* safeObject = Handle::Dereference(typeInfo);
+    return SafeObjectCast<T>(safeObject, typeInfo);
+  }
+
+  /***********************************************************************************************/
+  template <typename T>
+  WeakHandleOf<T>::WeakHandleOf()
+  {
+  }
+
+  /***********************************************************************************************/
+  template <typename T>
+  WeakHandleOf<T>::WeakHandleOf(T* instance) :
+    WeakHandle(instance)
+  {
+  }
+
+  /***********************************************************************************************/
+  template <typename T>
+  WeakHandleOf<T>::WeakHandleOf(const HandleOf<T>& handle) :
+    WeakHandle(handle)
+  {
+  }
+
+  /***********************************************************************************************/
+  template <typename T>
+  T* WeakHandleOf<T>::Dereference() const
+  {
+    const SafeObjectTypeInfo* typeInfo = nullptr;
+    SafeObject* safeObject = WeakHandle::Dereference(typeInfo);
+    return SafeObjectCast<T>(safeObject, typeInfo);
+  }
+
+  /***********************************************************************************************/
+  template <typename T>
+  HandleOf<T> WeakHandleOf<T>::Promote() const
+  {
+    HandleOf<T> handle;
+    const SafeObjectTypeInfo* typeInfo = nullptr;
+    SafeObject* safeObject = WeakHandle::Promote(handle, typeInfo);
+    if (safeObject && SafeObjectCast<T>(safeObject, typeInfo) == nullptr)
+    {
+      handle = HandleOf<T>();
+    }
+    return handle;
+  }
+
+  /***********************************************************************************************/
+  template <typename T>
+  SafeObjectRange<T>::iterator::iterator(SafeObject* const* position) :
+    mPosition(position)
+  {
+  }
+
+  /***********************************************************************************************/
+  template <typename T>
+  T& SafeObjectRange<T>::iterator::operator*() const
+  {
+    return *static_cast<T*>(*mPosition);
+  }
+
+  /***********************************************************************************************/
+  template <typename T>
+  T* SafeObjectRange<T>::iterator::operator->() const
+  {
+    return static_cast<T*>(*mPosition);
+  }
+
+  /***********************************************************************************************/
+  template <typename T>
+  typename SafeObjectRange<T>::iterator& SafeObjectRange<T>::iterator::operator++()
+  {
+    ++mPosition;
+    return *this;
+  }
+
+  /***********************************************************************************************/
+  template <typename T>
+  bool SafeObjectRange<T>::iterator::operator==(const iterator& rhs) const
+  {
+    return mPosition == rhs.mPosition;
+  }
+
+  /***********************************************************************************************/
+  template <typename T>
+  bool SafeObjectRange<T>::iterator::operator!=(const iterator& rhs) const
+  {
+    return mPosition != rhs.mPosition;
+  }
+
+  /***********************************************************************************************/
+  template <typename T>
+  SafeObjectRange<T>::SafeObjectRange(SafeObject* const* begin, SafeObject* const* end) :
+    mBegin(begin),
+    mEnd(end)
+  {
+  }
+
+  /***********************************************************************************************/
+  template <typename T>
+  typename SafeObjectRange<T>::iterator SafeObjectRange<T>::begin() const
+  {
+    return iterator(mBegin);
+  }
+
+  /***********************************************************************************************/
+  template <typename T>
+  typename SafeObjectRange<T>::iterator SafeObjectRange<T>::end() const
+  {
+    return iterator(mEnd);
+  }
+
+  /***********************************************************************************************/
+  template <typename T>
+  size_t SafeObjectRange<T>::size() const
+  {
+    return static_cast<size_t>(mEnd - mBegin);
+  }
+
+  /***********************************************************************************************/
+  template <typename T>
+  bool SafeObjectRange<T>::empty() const
+  {
+    return mBegin == mEnd;
   }
 }
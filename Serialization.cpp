@@ -0,0 +1,465 @@
+// Copyright (c) 2017 Trevor Sundberg
+// This code is licensed under the MIT license (see LICENSE.txt for details)
+
+#include "Precompiled.h"
+#include "Serialization.h"
+
+namespace Skugo
+{
+  /***********************************************************************************************/
+  StreamSink::~StreamSink()
+  {
+  }
+
+  /***********************************************************************************************/
+  StreamSource::~StreamSource()
+  {
+  }
+
+  /***********************************************************************************************/
+  void MemoryStreamSink::Write(const void* data, size_t size)
+  {
+    const uint8_t* bytes = static_cast<const uint8_t*>(data);
+    mData.insert(mData.end(), bytes, bytes + size);
+  }
+
+  /***********************************************************************************************/
+  MemoryStreamSource::MemoryStreamSource(const void* data, size_t size) :
+    mPosition(static_cast<const uint8_t*>(data)),
+    mEnd(static_cast<const uint8_t*>(data) + size)
+  {
+  }
+
+  /***********************************************************************************************/
+  size_t MemoryStreamSource::Read(void* buffer, size_t size)
+  {
+    size_t available = min(size, static_cast<size_t>(mEnd - mPosition));
+    memcpy(buffer, mPosition, available);
+    mPosition += available;
+    return available;
+  }
+
+  /***********************************************************************************************/
+  uint64_t MemoryStreamSource::GetRemaining() const
+  {
+    return static_cast<uint64_t>(mEnd - mPosition);
+  }
+
+  /***********************************************************************************************/
+  FileStreamSink::FileStreamSink(const char* path) :
+    mFile(path, ios::binary | ios::trunc)
+  {
+  }
+
+  /***********************************************************************************************/
+  bool FileStreamSink::IsOpen() const
+  {
+    return mFile.is_open();
+  }
+
+  /***********************************************************************************************/
+  void FileStreamSink::Write(const void* data, size_t size)
+  {
+    mFile.write(static_cast<const char*>(data), static_cast<streamsize>(size));
+  }
+
+  /***********************************************************************************************/
+  FileStreamSource::FileStreamSource(const char* path) :
+    mFile(path, ios::binary | ios::ate),
+    mRemaining(0)
+  {
+    // We open at the end to learn the size
+    if (mFile.is_open())
+    {
+      mRemaining = static_cast<uint64_t>(mFile.tellg());
+      mFile.seekg(0);
+    }
+  }
+
+  /***********************************************************************************************/
+  bool FileStreamSource::IsOpen() const
+  {
+    return mFile.is_open();
+  }
+
+  /***********************************************************************************************/
+  size_t FileStreamSource::Read(void* buffer, size_t size)
+  {
+    mFile.read(static_cast<char*>(buffer), static_cast<streamsize>(size));
+    size_t read = static_cast<size_t>(mFile.gcount());
+    mRemaining -= min<uint64_t>(read, mRemaining);
+    return read;
+  }
+
+  /***********************************************************************************************/
+  uint64_t FileStreamSource::GetRemaining() const
+  {
+    return mRemaining;
+  }
+
+  /***********************************************************************************************/
+  GraphWriter::GraphWriter(StreamSink& sink, const unordered_map<SafeObject*, uint32_t>& indices) :
+    mSink(sink),
+    mIndices(indices),
+    mBuffer(GraphSerializer::cChunkSize),
+    mUsed(0)
+  {
+  }
+
+  /***********************************************************************************************/
+  void GraphWriter::WriteString(const string& value)
+  {
+    Write(static_cast<uint32_t>(value.size()));
+    WriteBytes(value.data(), value.size());
+  }
+
+  /***********************************************************************************************/
+  void GraphWriter::WriteHandle(const Handle& handle)
+  {
+    // Indices are offset by one so that 0 can mean null
+    uint32_t index = 0;
+    unordered_map<SafeObject*, uint32_t>::const_iterator it = mIndices.find(handle.Dereference());
+    if (it != mIndices.end())
+    {
+      index = it->second + 1;
+    }
+    Write(index);
+  }
+
+  /***********************************************************************************************/
+  void GraphWriter::WriteSlow(const void* data, size_t size)
+  {
+    Flush();
+
+    // Anything as big as a whole chunk goes straight to the sink rather than through our buffer
+    if (size >= mBuffer.size())
+    {
+      mSink.Write(data, size);
+      return;
+    }
+
+    memcpy(mBuffer.data(), data, size);
+    mUsed = size;
+  }
+
+  /***********************************************************************************************/
+  void GraphWriter::Flush()
+  {
+    if (mUsed != 0)
+    {
+      mSink.Write(mBuffer.data(), mUsed);
+      mUsed = 0;
+    }
+  }
+
+  /***********************************************************************************************/
+  GraphReader::GraphReader(StreamSource& source) :
+    mSource(source),
+    mBuffer(GraphSerializer::cChunkSize),
+    mPosition(0),
+    mEnd(0),
+    mFailed(false)
+  {
+  }
+
+  /***********************************************************************************************/
+  void GraphReader::ReadString(string& value)
+  {
+    uint32_t size = 0;
+    Read(size);
+
+    // Read in pieces so that a corrupt size can't make us allocate a huge string up front
+    value.clear();
+    char piece[256];
+    while (size != 0 && !mFailed)
+    {
+      uint32_t pieceSize = min(size, static_cast<uint32_t>(sizeof(piece)));
+      ReadBytes(piece, pieceSize);
+      value.append(piece, pieceSize);
+      size -= pieceSize;
+    }
+  }
+
+  /***********************************************************************************************/
+  void GraphReader::ReadHandle(Handle& handle)
+  {
+    const SafeObjectTypeInfo* typeInfo = nullptr;
+    handle = Handle(ReadObject(typeInfo));
+  }
+
+  /***********************************************************************************************/
+  bool GraphReader::HasFailed() const
+  {
+    return mFailed;
+  }
+
+  /***********************************************************************************************/
+  void GraphReader::ReadSlow(void* data, size_t size)
+  {
+    uint8_t* bytes = static_cast<uint8_t*>(data);
+    while (size != 0)
+    {
+      if (mPosition == mEnd)
+      {
+        mPosition = 0;
+        mEnd = mFailed ? 0 : mSource.Read(mBuffer.data(), mBuffer.size());
+        if (mEnd == 0)
+        {
+          mFailed = true;
+          memset(bytes, 0, size);
+          return;
+        }
+      }
+
+      size_t available = min(size, mEnd - mPosition);
+      memcpy(bytes, mBuffer.data() + mPosition, available);
+      mPosition += available;
+      bytes += available;
+      size -= available;
+    }
+  }
+
+  /***********************************************************************************************/
+  SafeObject* GraphReader::ReadObject(const SafeObjectTypeInfo*& typeInfoOut)
+  {
+    typeInfoOut = nullptr;
+    uint32_t index = 0;
+    Read(index);
+    if (index == 0 || mFailed)
+    {
+      return nullptr;
+    }
+
+    if (index > mPointers.size())
+    {
+      mFailed = true;
+      return nullptr;
+    }
+    typeInfoOut = mTypeInfos[index - 1];
+    return mPointers[index - 1];
+  }
+
+  /***********************************************************************************************/
+  uint64_t GraphReader::GetRemaining() const
+  {
+    return (mEnd - mPosition) + mSource.GetRemaining();
+  }
+
+  /***********************************************************************************************/
+  const uint32_t GraphSerializer::cMagic;
+  const uint32_t GraphSerializer::cVersion;
+  const uint8_t GraphSerializer::cObjectMarker;
+
+  /***********************************************************************************************/
+  GraphSerializer::GraphCollector::GraphCollector(const GraphSerializer& serializer) :
+    mSerializer(serializer),
+    mCollected(0)
+  {
+  }
+
+  /***********************************************************************************************/
+  void GraphSerializer::GraphCollector::Visit(const Handle& handle)
+  {
+    SafeObject* safeObject = handle.Dereference();
+    if (safeObject == nullptr || mFound.find(safeObject) != mFound.end())
+    {
+      return;
+    }
+
+    // Objects of types that were never registered are left out (and handles to them save as null)
+    unordered_map<type_index, size_t>::const_iterator it = mSerializer.mTypesByTypeId.find(type_index(typeid(*safeObject)));
+    if (it == mSerializer.mTypesByTypeId.end())
+    {
+      return;
+    }
+
+    mFound.insert(make_pair(safeObject, 0));
+    mObjects.push_back(make_pair(it->second, safeObject));
+  }
+
+  /***********************************************************************************************/
+  void GraphSerializer::GraphCollector::Collect()
+  {
+    // Visiting appends to mObjects, so this walks the graph breadth first
+    while (mCollected < mObjects.size())
+    {
+      SafeObject* safeObject = mObjects[mCollected].second;
+      ++mCollected;
+      safeObject->EnumerateHandles(*this);
+    }
+  }
+
+  /***********************************************************************************************/
+  void GraphSerializer::Save(const vector<Handle>& roots, StreamSink& sink) const
+  {
+    GraphCollector collector(*this);
+    for (const Handle& root : roots)
+    {
+      collector.Visit(root);
+    }
+    collector.Collect();
+
+    // Each type's objects are saved together (in the order they were found)
+    vector<pair<size_t, SafeObject*>>& objects = collector.mObjects;
+    stable_sort(objects.begin(), objects.end(), [](const pair<size_t, SafeObject*>& lhs, const pair<size_t, SafeObject*>& rhs)
+    {
+      return lhs.first < rhs.first;
+    });
+
+    vector<uint32_t> counts(mTypes.size(), 0);
+    for (size_t i = 0; i < objects.size(); ++i)
+    {
+      collector.mFound[objects[i].second] = static_cast<uint32_t>(i);
+      ++counts[objects[i].first];
+    }
+
+    GraphWriter writer(sink, collector.mFound);
+    writer.Write(cMagic);
+    writer.Write(cVersion);
+
+    uint32_t typeCount = static_cast<uint32_t>(count_if(counts.begin(), counts.end(), [](uint32_t count)
+    {
+      return count != 0;
+    }));
+    writer.Write(typeCount);
+    for (size_t i = 0; i < mTypes.size(); ++i)
+    {
+      if (counts[i] != 0)
+      {
+        writer.WriteString(mTypes[i].mName);
+        writer.Write(counts[i]);
+      }
+    }
+
+    writer.Write(static_cast<uint32_t>(roots.size()));
+    for (const Handle& root : roots)
+    {
+      writer.WriteHandle(root);
+    }
+
+    for (pair<size_t, SafeObject*>& object : objects)
+    {
+      writer.Write(cObjectMarker);
+      mTypes[object.first].mSave(object.second, writer);
+    }
+    writer.Flush();
+  }
+
+  /***********************************************************************************************/
+  bool GraphSerializer::Load(StreamSource& source, vector<Handle>& rootsOut) const
+  {
+    rootsOut.clear();
+    GraphReader reader(source);
+
+    uint32_t magic = 0;
+    uint32_t version = 0;
+    reader.Read(magic);
+    reader.Read(version);
+    if (magic != cMagic || version != cVersion)
+    {
+      return false;
+    }
+
+    // Find every type before creating anything, so a bad stream creates nothing
+    uint32_t typeCount = 0;
+    reader.Read(typeCount);
+    vector<pair<const SerializedType*, uint32_t>> blocks;
+    string name;
+    uint64_t totalCount = 0;
+    for (uint32_t i = 0; i < typeCount && !reader.HasFailed(); ++i)
+    {
+      uint32_t count = 0;
+      reader.ReadString(name);
+      reader.Read(count);
+
+      unordered_map<string, size_t>::const_iterator it = mTypesByName.find(name);
+      if (it == mTypesByName.end())
+      {
+        return false;
+      }
+
+      // Every object takes at least its marker byte
+      totalCount += count;
+      if (totalCount > reader.GetRemaining())
+      {
+        return false;
+      }
+      blocks.push_back(make_pair(&mTypes[it->second], count));
+    }
+
+    if (reader.HasFailed())
+    {
+      return false;
+    }
+
+    // Every saved index now maps directly to a fresh object
+    vector<Handle> objects;
+    for (pair<const SerializedType*, uint32_t>& block : blocks)
+    {
+      block.first->mCreate(block.second, objects);
+    }
+
+    reader.mPointers.reserve(objects.size());
+    reader.mTypeInfos.reserve(objects.size());
+    for (Handle& object : objects)
+    {
+      const SafeObjectTypeInfo* typeInfo = nullptr;
+      reader.mPointers.push_back(object.Dereference(typeInfo));
+      reader.mTypeInfos.push_back(typeInfo);
+    }
+
+    uint32_t rootCount = 0;
+    reader.Read(rootCount);
+    for (uint32_t i = 0; i < rootCount && !reader.HasFailed(); ++i)
+    {
+      rootsOut.push_back(Handle());
+      reader.ReadHandle(rootsOut.back());
+    }
+
+    size_t index = 0;
+    for (pair<const SerializedType*, uint32_t>& block : blocks)
+    {
+      for (uint32_t i = 0; i < block.second && !reader.HasFailed(); ++i)
+      {
+        uint8_t marker = 0;
+        reader.Read(marker);
+        if (marker != cObjectMarker)
+        {
+          reader.mFailed = true;
+          break;
+        }
+
+        block.first->mLoad(reader.mPointers[index], reader);
+        ++index;
+      }
+    }
+
+    // Only the objects the roots reach stay alive (and if we failed, nothing does)
+    bool succeeded = !reader.HasFailed();
+    if (!succeeded)
+    {
+      rootsOut.clear();
+    }
+
+    // The rest may hold handles to each other, so they are deleted explicitly while we still hold
+    // every object (which means deleting one can never cascade into deleting another)
+    GraphCollector reached(*this);
+    for (const Handle& root : rootsOut)
+    {
+      reached.Visit(root);
+    }
+    reached.Collect();
+
+    SafeObjectSingleton& singleton = SafeObjectSingleton::Instance();
+    for (Handle& object : objects)
+    {
+      SafeObject* safeObject = object.Dereference();
+      if (safeObject && reached.mFound.find(safeObject) == reached.mFound.end())
+      {
+        singleton.Delete(safeObject);
+      }
+    }
+    singleton.ReleaseHandles(objects);
+    return succeeded;
+  }
+}
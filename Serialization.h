@@ -0,0 +1,231 @@
+// Copyright (c) 2017 Trevor Sundberg
+// This code is licensed under the MIT license (see LICENSE.txt for details)
+
+#pragma once
+
+#include "SafeObject.h"
+#include <fstream>
+#include <typeindex>
+
+namespace Skugo
+{
+  // Where serialized bytes go. The graph writer hands over its buffer in large chunks.
+  class StreamSink
+  {
+  public:
+    virtual ~StreamSink();
+    virtual void Write(const void* data, size_t size) = 0;
+  };
+
+  // Where serialized bytes come from. Fills as much of the buffer as it can and returns how much
+  // it filled (0 means the stream has ended).
+  class StreamSource
+  {
+  public:
+    virtual ~StreamSource();
+    virtual size_t Read(void* buffer, size_t size) = 0;
+
+    // How many bytes are left to read (an upper bound is fine), which lets a loader reject counts
+    // that the rest of the stream could never hold before it allocates anything
+    virtual uint64_t GetRemaining() const = 0;
+  };
+
+  class MemoryStreamSink : public StreamSink
+  {
+  public:
+    void Write(const void* data, size_t size) override;
+
+    vector<uint8_t> mData;
+  };
+
+  // Reads from memory that must outlive the source
+  class MemoryStreamSource : public StreamSource
+  {
+  public:
+    MemoryStreamSource(const void* data, size_t size);
+    size_t Read(void* buffer, size_t size) override;
+    uint64_t GetRemaining() const override;
+
+  private:
+    const uint8_t* mPosition;
+    const uint8_t* mEnd;
+  };
+
+  class FileStreamSink : public StreamSink
+  {
+  public:
+    FileStreamSink(const char* path);
+    bool IsOpen() const;
+    void Write(const void* data, size_t size) override;
+
+  private:
+    ofstream mFile;
+  };
+
+  // Reads a file a chunk at a time, so the whole file never has to be in memory at once
+  class FileStreamSource : public StreamSource
+  {
+  public:
+    FileStreamSource(const char* path);
+    bool IsOpen() const;
+    size_t Read(void* buffer, size_t size) override;
+    uint64_t GetRemaining() const override;
+
+  private:
+    ifstream mFile;
+    uint64_t mRemaining;
+  };
+
+  // Given to an object's Serialize function to write its members. Values are written as raw bytes
+  // (in the byte order of the machine), and handles are written as the index of the object they point
+  // at within the saved graph (0 for null, or for objects that are not part of the graph).
+  class GraphWriter
+  {
+  public:
+    friend class GraphSerializer;
+
+    // Values must be trivially copyable
+    template <typename T>
+    void Write(const T& value);
+    void WriteBytes(const void* data, size_t size);
+    void WriteString(const string& value);
+    void WriteHandle(const Handle& handle);
+
+  private:
+    GraphWriter(StreamSink& sink, const unordered_map<SafeObject*, uint32_t>& indices);
+    GraphWriter(const GraphWriter&) = delete;
+    GraphWriter& operator=(const GraphWriter&) = delete;
+
+    void WriteSlow(const void* data, size_t size);
+    void Flush();
+
+    StreamSink& mSink;
+    const unordered_map<SafeObject*, uint32_t>& mIndices;
+    vector<uint8_t> mBuffer;
+    size_t mUsed;
+  };
+
+  // Given to an object's Deserialize function to read back what Serialize wrote. Reading past the
+  // end of the stream (or a handle index that is out of range) marks the reader as failed, and
+  // from then on every value reads as zero and every handle as null.
+  class GraphReader
+  {
+  public:
+    friend class GraphSerializer;
+
+    template <typename T>
+    void Read(T& value);
+    void ReadBytes(void* data, size_t size);
+    void ReadString(string& value);
+    void ReadHandle(Handle& handle);
+
+    // Fails if the object is not a T
+    template <typename T>
+    void ReadHandle(HandleOf<T>& handle);
+
+    bool HasFailed() const;
+
+  private:
+    GraphReader(StreamSource& source);
+    GraphReader(const GraphReader&) = delete;
+    GraphReader& operator=(const GraphReader&) = delete;
+
+    void ReadSlow(void* data, size_t size);
+
+    // Returns the object the next index in the stream refers to (or null), along with its type info
+    SafeObject* ReadObject(const SafeObjectTypeInfo*& typeInfoOut);
+
+    // What is left in our buffer plus what is left in the source
+    uint64_t GetRemaining() const;
+
+    StreamSource& mSource;
+    vector<uint8_t> mBuffer;
+    size_t mPosition;
+    size_t mEnd;
+    bool mFailed;
+
+    // Every object being loaded, in the order they were saved (the serializer keeps them alive)
+    vector<SafeObject*> mPointers;
+
+    // The type info from each object's slot, so typed handles are checked without a dynamic_cast
+    vector<const SafeObjectTypeInfo*> mTypeInfos;
+  };
+
+  // Saves and loads graphs of SafeObjects. Every type that is saved must be registered, be default
+  // constructible, and implement:
+  //   void Serialize(GraphWriter& writer) const;
+  //   void Deserialize(GraphReader& reader);
+  // Saving starts from a set of roots and follows handles (see SafeObject::EnumerateHandles) to find
+  // every registered object they reach. The objects are grouped by type and written as one contiguous
+  // block per type, after a table of how many objects of each type there are.
+  // Loading reads that table first and bulk creates every object (see NewReferenceCountedSafeObjects),
+  // so each saved index maps directly to a fresh handle, and then streams every object's members
+  // in a single pass. Neither direction holds more than one chunk of the stream in memory.
+  // Every object's members are preceded by a marker byte. A stream can then hold at most one object
+  // per remaining byte, so a corrupt count is rejected before anything is created. A type whose
+  // Deserialize reads a different amount than its Serialize wrote fails the load at the next object.
+  // Objects must not be created or destroyed by other threads while their graph is being saved.
+  class GraphSerializer
+  {
+  public:
+    // The name is what gets saved, so it must stay the same across builds (unlike typeid names)
+    template <typename T>
+    void RegisterType(const char* name);
+
+    void Save(const vector<Handle>& roots, StreamSink& sink) const;
+
+    // Replaces rootsOut with handles to the loaded roots (in the order they were saved)
+    // Returns false (and loads nothing) if the stream is not a saved graph or uses unregistered types
+    // Loaded objects the roots don't reach (all of them if the load failed) are deleted explicitly,
+    // since cycles among them would otherwise keep each other alive forever.
+    bool Load(StreamSource& source, vector<Handle>& rootsOut) const;
+
+    // How much of the stream is read or written at once
+    static const size_t cChunkSize = 64 * 1024;
+
+  private:
+    class SerializedType
+    {
+    public:
+      string mName;
+      void (*mSave)(const SafeObject* safeObject, GraphWriter& writer);
+      void (*mLoad)(SafeObject* safeObject, GraphReader& reader);
+
+      // Creates count objects with one bulk allocation and appends handles to them
+      void (*mCreate)(size_t count, vector<Handle>& objectsOut);
+    };
+
+    template <typename T>
+    static void SaveObject(const SafeObject* safeObject, GraphWriter& writer);
+    template <typename T>
+    static void LoadObject(SafeObject* safeObject, GraphReader& reader);
+    template <typename T>
+    static void CreateObjects(size_t count, vector<Handle>& objectsOut);
+
+    // Finds every registered object reachable from the handles it visits
+    class GraphCollector : public HandleEnumerator
+    {
+    public:
+      GraphCollector(const GraphSerializer& serializer);
+      void Visit(const Handle& handle) override;
+      void Collect();
+
+      const GraphSerializer& mSerializer;
+
+      // The type of each object found (an index into mTypes) and the object
+      vector<pair<size_t, SafeObject*>> mObjects;
+      unordered_map<SafeObject*, uint32_t> mFound;
+      size_t mCollected;
+    };
+
+    static const uint32_t cMagic = 0x52474B53;
+    static const uint32_t cVersion = 2;
+    static const uint8_t cObjectMarker = 0xB7;
+
+    vector<SerializedType> mTypes;
+    unordered_map<type_index, size_t> mTypesByTypeId;
+    unordered_map<string, size_t> mTypesByName;
+  };
+}
+
+#include "Serialization.inl"
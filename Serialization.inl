@@ -0,0 +1,109 @@
+// Copyright (c) 2017 Trevor Sundberg
+// This code is licensed under the MIT license (see LICENSE.txt for details)
+
+#pragma once
+
+#include <string.h>
+
+namespace Skugo
+{
+  /***********************************************************************************************/
+  template <typename T>
+  void GraphWriter::Write(const T& value)
+  {
+    static_assert(is_trivially_copyable<T>::value, "Only trivially copyable values can be written as bytes");
+    WriteBytes(&value, sizeof(T));
+  }
+
+  /***********************************************************************************************/
+  inline void GraphWriter::WriteBytes(const void* data, size_t size)
+  {
+    // Almost every write fits in the current chunk
+    if (mBuffer.size() - mUsed >= size)
+    {
+      memcpy(mBuffer.data() + mUsed, data, size);
+      mUsed += size;
+      return;
+    }
+
+    WriteSlow(data, size);
+  }
+
+  /***********************************************************************************************/
+  template <typename T>
+  void GraphReader::Read(T& value)
+  {
+    static_assert(is_trivially_copyable<T>::value, "Only trivially copyable values can be read as bytes");
+    ReadBytes(&value, sizeof(T));
+  }
+
+  /***********************************************************************************************/
+  inline void GraphReader::ReadBytes(void* data, size_t size)
+  {
+    if (mEnd - mPosition >= size)
+    {
+      memcpy(data, mBuffer.data() + mPosition, size);
+      mPosition += size;
+      return;
+    }
+
+    ReadSlow(data, size);
+  }
+
+  /***********************************************************************************************/
+  template <typename T>
+  void GraphReader::ReadHandle(HandleOf<T>& handle)
+  {
+    const SafeObjectTypeInfo* typeInfo = nullptr;
+    SafeObject* safeObject = ReadObject(typeInfo);
+    T* instance = SafeObjectCast<T>(safeObject, typeInfo);
+    if (safeObject && instance == nullptr)
+    {
+      mFailed = true;
+    }
+    handle = HandleOf<T>(instance);
+  }
+
+  /***********************************************************************************************/
+  template <typename T>
+  void GraphSerializer::RegisterType(const char* name)
+  {
+    static_assert(is_base_of<SafeObject, T>::value, "Only SafeObjects can be serialized");
+
+    SerializedType type;
+    type.mName = name;
+    type.mSave = &SaveObject<T>;
+    type.mLoad = &LoadObject<T>;
+    type.mCreate = &CreateObjects<T>;
+
+    mTypesByTypeId[type_index(typeid(T))] = mTypes.size();
+    mTypesByName[type.mName] = mTypes.size();
+    mTypes.push_back(type);
+  }
+
+  /***********************************************************************************************/
+  template <typename T>
+  void GraphSerializer::SaveObject(const SafeObject* safeObject, GraphWriter& writer)
+  {
+    static_cast<const T*>(safeObject)->Serialize(writer);
+  }
+
+  /***********************************************************************************************/
+  template <typename T>
+  void GraphSerializer::LoadObject(SafeObject* safeObject, GraphReader& reader)
+  {
+    static_cast<T*>(safeObject)->Deserialize(reader);
+  }
+
+  /***********************************************************************************************/
+  template <typename T>
+  void GraphSerializer::CreateObjects(size_t count, vector<Handle>& objectsOut)
+  {
+    vector<HandleOf<T>> handles;
+    SafeObjectSingleton::Instance().NewReferenceCountedSafeObjects(count, handles);
+    for (HandleOf<T>& handle : handles)
+    {
+      objectsOut.push_back(move(handle));
+    }
+  }
+}
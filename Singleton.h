@@ -21,6 +21,7 @@ namespace Skugo
     static void Initialize(Args&&... args);
     static void Uninitialize();
     static SelfType& Instance();
+    static bool IsInitialized();
 
   private:
     static SelfType* mInstance;
@@ -45,4 +45,11 @@ namespace Skugo
 
     return *mInstance;
   }
+
+  /***********************************************************************************************/
+  template <typename SelfType, typename BaseType>
+  bool Singleton<SelfType, BaseType>::IsInitialized()
+  {
+    return mInstance != nullptr;
+  }
 }
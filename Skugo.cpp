@@ -2,11 +2,13 @@
 // This code is licensed under the MIT license (see LICENSE.txt for details)
 
 #include "Precompiled.h"
-//#include "SafeObject.h"
-//#include "UnitTests.h"
+#include "SafeObject.h"
+#include "UnitTests.h"
+#include "Benchmarks.h"
 #include "std_intrusive_list.h"
 #include "std_pool.h"
 #include "std_pstring.h"
+#include "std_pstring_map.h"
 #include <string>
 #include <stdio.h>
 #include <time.h>
@@ -26,6 +28,10 @@ public:
 
 int main(void)
 {
+  SafeObjectSingleton::Initialize();
+  RunUnitTests();
+  RunBenchmarks();
+
   //SafeObjectSingleton::Initialize();
   //
   //SafeObject a;
@@ -88,6 +94,7 @@ int main(void)
 
   unordered_map<string, string> test1;
   unordered_map<pstring, pstring> test2;
+  pstring_map<pstring> test3;
 
   const char* tedActual = "OnCollisionStarted";
   const char* ted = "OnCollisionStartea";
@@ -99,22 +106,77 @@ int main(void)
   test2[tedActual] = "homeless";
   test2["ned"] = "jockey";
 
+  test3["bob"] = "employee";
+  test3[tedActual] = "homeless";
+  test3["ned"] = "jockey";
+
+  vector<string> keys1;
+  vector<pstring> keys2;
   for (int i = 0; i < 10000; ++i)
   {
     string str("wtf");
     str += to_string(i);
-    test1[str] = "hello";
-    test2[str] = "hello";
+    keys1.push_back(str);
+    keys2.push_back(pstring(str));
+  }
+
+  // Inserting every key into an empty map (each pass starts over, so every insert adds a key and
+  // the maps grow as they would when they're first filled)
+  size_t insertPasses = 1000;
+  pstring hello("hello");
+  string hello1("hello");
+
+  clock_t insertStart1 = clock();
+  for (size_t pass = 0; pass < insertPasses; ++pass)
+  {
+    unordered_map<string, string> inserted;
+    for (const string& key : keys1)
+    {
+      inserted[key] = hello1;
+    }
+  }
+  clock_t insertEnd1 = clock();
+
+  clock_t insertStart2 = clock();
+  for (size_t pass = 0; pass < insertPasses; ++pass)
+  {
+    unordered_map<pstring, pstring> inserted;
+    for (const pstring& key : keys2)
+    {
+      inserted[key] = hello;
+    }
+  }
+  clock_t insertEnd2 = clock();
+
+  clock_t insertStart3 = clock();
+  for (size_t pass = 0; pass < insertPasses; ++pass)
+  {
+    pstring_map<pstring> inserted;
+    for (const pstring& key : keys2)
+    {
+      inserted[key] = hello;
+    }
+  }
+  clock_t insertEnd3 = clock();
+
+  // The lookups and walks below use maps with every key
+  for (size_t i = 0; i < keys1.size(); ++i)
+  {
+    test1[keys1[i]] = hello1;
+    test2[keys2[i]] = hello;
+    test3[keys2[i]] = hello;
   }
 
   size_t iterations = 200000000;
 
   clock_t start1 = clock();
 
+  // Counting what we find so the lookups can't be thrown away
   string ted1(ted);
+  size_t found1 = 0;
   for (size_t i = 0; i < iterations; ++i)
   {
-    test1.find(ted1);
+    found1 += test1.count(ted1);
   }
 
   clock_t end1 = clock();
@@ -122,15 +184,71 @@ int main(void)
   clock_t start2 = clock();
 
   pstring ted2(ted);
+  size_t found2 = 0;
   for (size_t i = 0; i < iterations; ++i)
   {
-    test2.find(ted2);
+    found2 += test2.count(ted2);
   }
 
   clock_t end2 = clock();
 
-  printf("Test1: %f seconds\n", (end1 - start1) / static_cast<double>(CLOCKS_PER_SEC));
-  printf("Test2: %f seconds\n", (end2 - start2) / static_cast<double>(CLOCKS_PER_SEC));
+  clock_t start3 = clock();
+
+  size_t found3 = 0;
+  for (size_t i = 0; i < iterations; ++i)
+  {
+    found3 += test3.count(ted2);
+  }
+
+  clock_t end3 = clock();
+
+  // Walking every entry (summing the value lengths so the loops can't be thrown away)
+  size_t iteratePasses = 10000;
+  size_t length1 = 0;
+  size_t length2 = 0;
+  size_t length3 = 0;
+
+  clock_t iterateStart1 = clock();
+  for (size_t pass = 0; pass < iteratePasses; ++pass)
+  {
+    for (const pair<const string, string>& entry : test1)
+    {
+      length1 += entry.second.size();
+    }
+  }
+  clock_t iterateEnd1 = clock();
+
+  clock_t iterateStart2 = clock();
+  for (size_t pass = 0; pass < iteratePasses; ++pass)
+  {
+    for (const pair<const pstring, pstring>& entry : test2)
+    {
+      length2 += entry.second->size();
+    }
+  }
+  clock_t iterateEnd2 = clock();
+
+  clock_t iterateStart3 = clock();
+  for (size_t pass = 0; pass < iteratePasses; ++pass)
+  {
+    for (const pair<const pstring, pstring>& entry : test3)
+    {
+      length3 += entry.second->size();
+    }
+  }
+  clock_t iterateEnd3 = clock();
+
+  printf("Test1: %f seconds (found %zu)\n", (end1 - start1) / static_cast<double>(CLOCKS_PER_SEC), found1);
+  printf("Test2: %f seconds (found %zu)\n", (end2 - start2) / static_cast<double>(CLOCKS_PER_SEC), found2);
+  printf("Test3: %f seconds (pstring_map, found %zu)\n", (end3 - start3) / static_cast<double>(CLOCKS_PER_SEC), found3);
+  printf("Insert1: %f seconds\n", (insertEnd1 - insertStart1) / static_cast<double>(CLOCKS_PER_SEC));
+  printf("Insert2: %f seconds\n", (insertEnd2 - insertStart2) / static_cast<double>(CLOCKS_PER_SEC));
+  printf("Insert3: %f seconds (pstring_map)\n", (insertEnd3 - insertStart3) / static_cast<double>(CLOCKS_PER_SEC));
+  printf("Iterate1: %f seconds (%zu)\n", (iterateEnd1 - iterateStart1) / static_cast<double>(CLOCKS_PER_SEC), length1);
+  printf("Iterate2: %f seconds (%zu)\n", (iterateEnd2 - iterateStart2) / static_cast<double>(CLOCKS_PER_SEC), length2);
+  printf("Iterate3: %f seconds (pstring_map, %zu)\n", (iterateEnd3 - iterateStart3) / static_cast<double>(CLOCKS_PER_SEC), length3);
+
+  SafeObjectSingleton::Uninitialize();
 
   getchar();
 }
@@ -0,0 +1,141 @@
+// Copyright (c) 2017 Trevor Sundberg
+// This code is licensed under the MIT license (see LICENSE.txt for details)
+
+#include "Precompiled.h"
+#include "SlabAllocator.h"
+#include "Asserts.h"
+
+namespace Skugo
+{
+  /***********************************************************************************************/
+  SlabAllocator::SlabAllocator(const char* name, size_t blockSize, size_t blockAlignment) :
+    mName(name),
+    mCapacity(0),
+    mFreeList(nullptr),
+    mOccupied(0)
+  {
+    SkugoErrorIf(blockAlignment > alignof(max_align_t),
+      "The SlabAllocator does not support over-aligned blocks");
+
+    // Every block must be able to hold a free list link and keep the next block aligned
+    size_t alignment = max(blockAlignment, alignof(FreeBlock));
+    mBlockSize = max(blockSize, sizeof(FreeBlock));
+    mBlockSize = (mBlockSize + alignment - 1) / alignment * alignment;
+    mBlocksPerSlab = max<size_t>(cTargetSlabBytes / mBlockSize, 1);
+  }
+
+  /***********************************************************************************************/
+  SlabAllocator::~SlabAllocator()
+  {
+    SkugoErrorIf(mOccupied != 0, "Blocks were still allocated when the SlabAllocator was destroyed");
+
+    for (char* slab : mSlabs)
+    {
+      ::operator delete(slab);
+    }
+  }
+
+  /***********************************************************************************************/
+  void* SlabAllocator::Allocate()
+  {
+    lock_guard<mutex> lock(mMutex);
+
+    if (mFreeList == nullptr)
+    {
+      // Thread the new slab onto the free list back to front so blocks are handed out in address order
+      char* slab = static_cast<char*>(::operator new(mBlockSize * mBlocksPerSlab));
+      mSlabs.push_back(slab);
+      mCapacity += mBlocksPerSlab;
+
+      for (size_t i = mBlocksPerSlab; i > 0; --i)
+      {
+        FreeBlock* block = reinterpret_cast<FreeBlock*>(slab + (i - 1) * mBlockSize);
+        block->mNext = mFreeList;
+        mFreeList = block;
+      }
+    }
+
+    FreeBlock* block = mFreeList;
+    mFreeList = block->mNext;
+    ++mOccupied;
+    return block;
+  }
+
+  /***********************************************************************************************/
+  void SlabAllocator::Free(void* memory)
+  {
+    if (memory == nullptr)
+    {
+      return;
+    }
+
+    lock_guard<mutex> lock(mMutex);
+
+    SkugoErrorIf(mOccupied == 0, "More blocks were freed than were allocated");
+    FreeBlock* block = static_cast<FreeBlock*>(memory);
+    block->mNext = mFreeList;
+    mFreeList = block;
+    --mOccupied;
+  }
+
+  /***********************************************************************************************/
+  void SlabAllocator::AllocateBatch(size_t count, vector<void*>& blocksOut)
+  {
+    blocksOut.reserve(blocksOut.size() + count);
+
+    lock_guard<mutex> lock(mMutex);
+    mOccupied += count;
+
+    while (count != 0 && mFreeList != nullptr)
+    {
+      blocksOut.push_back(mFreeList);
+      mFreeList = mFreeList->mNext;
+      --count;
+    }
+
+    if (count == 0)
+    {
+      return;
+    }
+
+    char* slab = static_cast<char*>(::operator new(mBlockSize * count));
+    mSlabs.push_back(slab);
+    mCapacity += count;
+
+    for (size_t i = 0; i < count; ++i)
+    {
+      blocksOut.push_back(slab + i * mBlockSize);
+    }
+  }
+
+  /***********************************************************************************************/
+  void SlabAllocator::FreeBatch(void* const* blocks, size_t count)
+  {
+    lock_guard<mutex> lock(mMutex);
+
+    SkugoErrorIf(mOccupied < count, "More blocks were freed than were allocated");
+
+    // Push back to front so the first block ends up at the head of the free list
+    for (size_t i = count; i > 0; --i)
+    {
+      FreeBlock* block = static_cast<FreeBlock*>(blocks[i - 1]);
+      block->mNext = mFreeList;
+      mFreeList = block;
+    }
+    mOccupied -= count;
+  }
+
+  /***********************************************************************************************/
+  SlabAllocatorStats SlabAllocator::GetStats() const
+  {
+    lock_guard<mutex> lock(mMutex);
+
+    SlabAllocatorStats stats;
+    stats.mName = mName;
+    stats.mBlockSize = mBlockSize;
+    stats.mSlabCount = mSlabs.size();
+    stats.mCapacity = mCapacity;
+    stats.mOccupied = mOccupied;
+    return stats;
+  }
+}
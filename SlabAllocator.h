@@ -0,0 +1,72 @@
+// Copyright (c) 2017 Trevor Sundberg
+// This code is licensed under the MIT license (see LICENSE.txt for details)
+
+#pragma once
+
+namespace Skugo
+{
+  // A snapshot of how much memory a slab allocator has reserved and how much of it is in use
+  class SlabAllocatorStats
+  {
+  public:
+    // Generally the name of the type being allocated
+    const char* mName;
+    size_t mBlockSize;
+    size_t mSlabCount;
+
+    // How many blocks exist across all slabs, and how many of those are currently allocated
+    size_t mCapacity;
+    size_t mOccupied;
+  };
+
+  // Hands out fixed size blocks that are carved from large slabs. Released blocks are kept on
+  // a free list and reused before any new slab is allocated, so churning objects of the same type
+  // never touches the global heap and the objects stay packed together in memory.
+  // Slabs are only returned to the heap when the allocator is destroyed.
+  class SlabAllocator
+  {
+  public:
+    SlabAllocator(const char* name, size_t blockSize, size_t blockAlignment);
+    ~SlabAllocator();
+
+    void* Allocate();
+    void Free(void* block);
+
+    // Allocates many blocks while only taking the lock once. Free blocks are used first and whatever
+    // is left is carved from one new slab, so the new part of the batch is contiguous in memory.
+    void AllocateBatch(size_t count, vector<void*>& blocksOut);
+
+    // Returns many blocks to the free list while only taking the lock once. If the blocks are sorted
+    // by address they will be handed back out in address order (so a batch stays contiguous on reuse).
+    void FreeBatch(void* const* blocks, size_t count);
+
+    SlabAllocatorStats GetStats() const;
+
+  private:
+    SlabAllocator(const SlabAllocator&) = delete;
+    SlabAllocator& operator=(const SlabAllocator&) = delete;
+
+    // Aim for slabs of roughly this size (unless a single block is larger)
+    static const size_t cTargetSlabBytes = 64 * 1024;
+
+    // Free blocks store the pointer to the next free block in their first bytes
+    class FreeBlock
+    {
+    public:
+      FreeBlock* mNext;
+    };
+
+    const char* mName;
+    size_t mBlockSize;
+    size_t mBlocksPerSlab;
+
+    // Slabs and how many blocks they hold in total (batch slabs may differ from mBlocksPerSlab)
+    vector<char*> mSlabs;
+    size_t mCapacity;
+    FreeBlock* mFreeList;
+    size_t mOccupied;
+
+    // Objects may be created and destroyed from any thread
+    mutable mutex mMutex;
+  };
+}
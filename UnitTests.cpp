@@ -2,11 +2,1680 @@
 // This code is licensed under the MIT license (see LICENSE.txt for details)
 
 #include "Precompiled.h"
+#include "UnitTests.h"
+#include "AllocationCounter.h"
+#include "SafeObject.h"
+#include "CycleCollector.h"
+#include "Serialization.h"
+#include "std_arena_pstring.h"
+#include "std_pstring.h"
+#include "std_pstring_map.h"
+#include <random>
+#include <thread>
+#include <stdio.h>
+#include <string.h>
+
+// Asserts may be compiled out, so tests report their own failures
+#define SkugoTest(bool_condition)                                               \
+  do                                                                            \
+  {                                                                             \
+    if (!(bool_condition))                                                      \
+    {                                                                           \
+      printf("Test failed: %s (%s:%d)\n", #bool_condition, __FILE__, __LINE__); \
+    }                                                                           \
+  } while (false)
 
 namespace Skugo
 {
+  /***********************************************************************************************/
+  SlabAllocatorStats GetSlabStats(const char* typeName)
+  {
+    for (SlabAllocatorStats& stats : SafeObjectSingleton::Instance().GetAllocatorStats())
+    {
+      if (strcmp(stats.mName, typeName) == 0)
+      {
+        return stats;
+      }
+    }
+    return SlabAllocatorStats();
+  }
+
+  // Reads the raw ids out of handles
+  class HandleIdReader : public HandleEnumerator
+  {
+  public:
+    void Visit(const Handle& handle) override
+    {
+      mIds.push_back(GetId(handle));
+    }
+
+    vector<uint64_t> mIds;
+  };
+
+  // The simplest possible object
+  class SlotTestObject : public SafeObject
+  {
+  public:
+  };
+
+  /***********************************************************************************************/
+  void TestSlotMapHandles()
+  {
+    // The null id resolves through the permanently empty slot 0
+    Handle null;
+    SkugoTest(null.Dereference() == nullptr);
+
+    SlotTestObject* first = SkugoNew(SlotTestObject);
+    Handle stale(first);
+    HandleIdReader reader;
+    reader.Visit(stale);
+    uint64_t staleId = reader.mIds[0];
+    SkugoTest(staleId != 0);
+    SkugoTest(stale.Dereference() == first);
+    delete first;
+    SkugoTest(stale.Dereference() == nullptr);
+
+    // Once the slot is reused its generation has moved on, so the stale handle still misses
+    vector<Handle> handles;
+    bool reused = false;
+    for (size_t i = 0; i < 100000 && !reused; ++i)
+    {
+      handles.emplace_back(SkugoNew(SlotTestObject));
+      reader.Visit(handles.back());
+      uint64_t id = reader.mIds.back();
+      if (static_cast<uint32_t>(id) == static_cast<uint32_t>(staleId))
+      {
+        reused = true;
+        SkugoTest(id != staleId);
+        SkugoTest(handles.back().Dereference() != nullptr);
+      }
+    }
+    SkugoTest(reused);
+    SkugoTest(stale.Dereference() == nullptr);
+
+    // Objects that were not allocated via SkugoNew are registered too, and unregister when they go away
+    {
+      SlotTestObject onStack;
+      stale = &onStack;
+      SkugoTest(stale.Dereference() == &onStack);
+    }
+    SkugoTest(stale.Dereference() == nullptr);
+  }
+
+  // Counts how many have been destroyed in total and by the current thread
+  class ThreadedTestObject : public SafeObject
+  {
+  public:
+    ~ThreadedTestObject()
+    {
+      ++sDestroyed;
+      ++sDestroyedOnThread;
+    }
+
+    static atomic<size_t> sDestroyed;
+    static thread_local size_t sDestroyedOnThread;
+  };
+  atomic<size_t> ThreadedTestObject::sDestroyed(0);
+  thread_local size_t ThreadedTestObject::sDestroyedOnThread = 0;
+
+  /***********************************************************************************************/
+  void TestThreadedCreation()
+  {
+    const size_t threadCount = 4;
+    const size_t objectsPerThread = 20000;
+
+    // Every thread creates objects on the heap and the stack at the same time, and lets go of half of them
+    vector<vector<Handle>> kept(threadCount);
+    atomic<size_t> miscounted(0);
+    vector<thread> threads;
+    for (size_t t = 0; t < threadCount; ++t)
+    {
+      threads.emplace_back([&, t]()
+      {
+        for (size_t i = 0; i < objectsPerThread; ++i)
+        {
+          Handle handle(SkugoNew(ThreadedTestObject));
+          if (i % 2 == 0)
+          {
+            kept[t].push_back(handle);
+          }
+
+          // Only SkugoNew objects are reference counted, so dropping a handle must never delete this one
+          ThreadedTestObject onStack;
+          size_t destroyed = ThreadedTestObject::sDestroyedOnThread;
+          Handle(&onStack).Dereference();
+          if (ThreadedTestObject::sDestroyedOnThread != destroyed)
+          {
+            ++miscounted;
+          }
+        }
+        SafeObjectSingleton::Instance().ReclaimMemory();
+      });
+    }
+    for (thread& worker : threads)
+    {
+      worker.join();
+    }
+    SkugoTest(miscounted.load() == 0);
+
+    // Ids are reserved per thread, so none were handed out twice and every handle finds its own object
+    HandleIdReader reader;
+    vector<SafeObject*> objects;
+    for (vector<Handle>& handles : kept)
+    {
+      for (Handle& handle : handles)
+      {
+        reader.Visit(handle);
+        objects.push_back(handle.Dereference());
+      }
+    }
+    size_t keptCount = threadCount * objectsPerThread / 2;
+    SkugoTest(objects.size() == keptCount);
+    SkugoTest(find(objects.begin(), objects.end(), nullptr) == objects.end());
+    sort(reader.mIds.begin(), reader.mIds.end());
+    SkugoTest(unique(reader.mIds.begin(), reader.mIds.end()) == reader.mIds.end());
+    sort(objects.begin(), objects.end());
+    SkugoTest(unique(objects.begin(), objects.end()) == objects.end());
+
+    // Every stack object is gone, along with every heap object whose handle was dropped
+    SkugoTest(ThreadedTestObject::sDestroyed.load() == threadCount * objectsPerThread * 2 - keptCount);
+    kept.clear();
+    SkugoTest(ThreadedTestObject::sDestroyed.load() == threadCount * objectsPerThread * 2);
+    SafeObjectSingleton::Instance().ReclaimMemory();
+  }
+
+  // Handles to these are copied across threads
+  class SharedTestObject : public SafeObject
+  {
+  public:
+    typedef AtomicReferenceCounting ReferenceCountingPolicy;
+
+    ~SharedTestObject()
+    {
+      ++sDestroyed;
+    }
+
+    static atomic<size_t> sDestroyed;
+  };
+  atomic<size_t> SharedTestObject::sDestroyed(0);
+
+  /***********************************************************************************************/
+  void TestReferenceCountingPolicies()
+  {
+    atomic<uint32_t> count(1);
+    NonAtomicReferenceCounting::Increment(count);
+    SkugoTest(count.load() == 2);
+    SkugoTest(!NonAtomicReferenceCounting::Decrement(count));
+    SkugoTest(NonAtomicReferenceCounting::Decrement(count));
+
+    count.store(1);
+    SkugoTest(AtomicReferenceCounting::IncrementIfNonZero(count));
+    AtomicReferenceCounting::Increment(count);
+    SkugoTest(count.load() == 3);
+    SkugoTest(!AtomicReferenceCounting::Decrement(count));
+    SkugoTest(!AtomicReferenceCounting::Decrement(count));
+    SkugoTest(AtomicReferenceCounting::Decrement(count));
+    SkugoTest(!AtomicReferenceCounting::IncrementIfNonZero(count));
+    SkugoTest(count.load() == 0);
+
+    // Every thread copies and drops handles to the same objects, and each object dies exactly once
+    const size_t threadCount = 4;
+    const size_t copiesPerThread = 50000;
+    for (size_t round = 0; round < 10; ++round)
+    {
+      size_t destroyedBefore = SharedTestObject::sDestroyed.load();
+      HandleOf<SharedTestObject> shared(SkugoNew(SharedTestObject));
+      vector<thread> threads;
+      for (size_t t = 0; t < threadCount; ++t)
+      {
+        threads.emplace_back([local = shared, copiesPerThread]()
+        {
+          for (size_t i = 0; i < copiesPerThread; ++i)
+          {
+            HandleOf<SharedTestObject> copy = local;
+            copy = local;
+          }
+        });
+      }
+
+      // The last reference is dropped on whichever thread finishes last
+      shared = HandleOf<SharedTestObject>();
+      for (thread& worker : threads)
+      {
+        worker.join();
+      }
+      SkugoTest(SharedTestObject::sDestroyed.load() == destroyedBefore + 1);
+    }
+    SafeObjectSingleton::Instance().ReclaimMemory();
+  }
+
+  // Counts how many are alive, so tests can tell exactly how many references a handle left behind
+  class HandleTestObject : public SafeObject
+  {
+  public:
+    HandleTestObject()
+    {
+      ++sAlive;
+    }
+
+    ~HandleTestObject()
+    {
+      --sAlive;
+    }
+
+    static size_t sAlive;
+  };
+  size_t HandleTestObject::sAlive = 0;
+
+  /***********************************************************************************************/
+  void TestHandleCopyAndMove()
+  {
+    HandleTestObject* object = SkugoNew(HandleTestObject);
+    HandleTestObject* other = SkugoNew(HandleTestObject);
+
+    // A copy holds its own reference, so the object outlives the original but not the copy
+    Handle original(object);
+    Handle copy(original);
+    SkugoTest(copy.Dereference() == object);
+    original = Handle();
+    SkugoTest(HandleTestObject::sAlive == 2);
+    SkugoTest(copy.Dereference() == object);
+
+    // Moving transfers the one reference and leaves the source null
+    Handle moved(move(copy));
+    SkugoTest(copy.Dereference() == nullptr);
+    SkugoTest(moved.Dereference() == object);
+    HandleOf<HandleTestObject> typed(other);
+    HandleOf<HandleTestObject> typedMoved;
+    typedMoved = move(typed);
+    SkugoTest(typed.Dereference() == nullptr);
+    SkugoTest(typedMoved.Dereference() == other);
+
+    // Assigning to itself must neither release nor add a reference
+    Handle& alias = moved;
+    moved = alias;
+    SkugoTest(moved.Dereference() == object);
+    moved = move(alias);
+    SkugoTest(moved.Dereference() == object);
+    HandleOf<HandleTestObject>& typedAlias = typedMoved;
+    typedMoved = move(typedAlias);
+    SkugoTest(typedMoved.Dereference() == other);
+    SkugoTest(HandleTestObject::sAlive == 2);
+
+    // Growing a vector of handles moves them, which must leave exactly one reference per element
+    vector<HandleOf<HandleTestObject>> handles;
+    for (size_t i = 0; i < 1000; ++i)
+    {
+      handles.push_back(typedMoved);
+    }
+    typedMoved = HandleOf<HandleTestObject>();
+    handles.resize(1);
+    SkugoTest(handles[0].Dereference() == other);
+
+    // Move assigning over a handle releases what it held, and the moved reference is the last one
+    handles[0] = HandleOf<HandleTestObject>(SkugoNew(HandleTestObject));
+    SkugoTest(HandleTestObject::sAlive == 2);
+    moved = Handle();
+    SkugoTest(HandleTestObject::sAlive == 1);
+    handles.clear();
+    SkugoTest(HandleTestObject::sAlive == 0);
+    SafeObjectSingleton::Instance().ReclaimMemory();
+  }
+
+  // Only used to check which allocator objects come from
+  class SlabTestObject : public SafeObject
+  {
+  public:
+    char mPayload[40];
+  };
+
+  /***********************************************************************************************/
+  void TestSlabAllocator()
+  {
+    {
+      SlabAllocator allocator("TestSlabAllocator", 24, 8);
+      vector<void*> blocks;
+      for (size_t i = 0; i < 100; ++i)
+      {
+        blocks.push_back(allocator.Allocate());
+      }
+      SlabAllocatorStats stats = allocator.GetStats();
+      SkugoTest(strcmp(stats.mName, "TestSlabAllocator") == 0);
+      SkugoTest(stats.mBlockSize == 24);
+      SkugoTest(stats.mSlabCount == 1);
+      SkugoTest(stats.mOccupied == 100);
+      SkugoTest(stats.mCapacity >= 100);
+
+      // A fresh slab is handed out in address order, so the blocks sit side by side
+      for (size_t i = 1; i < blocks.size(); ++i)
+      {
+        SkugoTest(static_cast<char*>(blocks[i]) - static_cast<char*>(blocks[i - 1]) == 24);
+        SkugoTest(reinterpret_cast<uintptr_t>(blocks[i]) % 8 == 0);
+      }
+
+      // Freed blocks are reused before anything new is carved out
+      allocator.Free(blocks[50]);
+      SkugoTest(allocator.GetStats().mOccupied == 99);
+      SkugoTest(allocator.Allocate() == blocks[50]);
+      for (void* block : blocks)
+      {
+        allocator.Free(block);
+      }
+      SkugoTest(allocator.GetStats().mOccupied == 0);
+      SkugoTest(allocator.GetStats().mCapacity == stats.mCapacity);
+    }
+
+    // Every block has to be able to hold the free list link
+    SlabAllocator tiny("TestTinySlabAllocator", 1, 1);
+    SkugoTest(tiny.GetStats().mBlockSize == sizeof(void*));
+
+    // SkugoNew takes the memory from the type's slab, while a plain new still uses the heap
+    const char* typeName = typeid(SlabTestObject).name();
+    SlabTestObject* pooled = SkugoNew(SlabTestObject);
+    SlabAllocatorStats stats = GetSlabStats(typeName);
+    SkugoTest(stats.mOccupied == 1);
+    SkugoTest(stats.mBlockSize >= sizeof(SlabTestObject));
+    SlabTestObject* heap = new SlabTestObject();
+    SkugoTest(GetSlabStats(typeName).mOccupied == 1);
+    delete heap;
+    delete pooled;
+    SafeObjectSingleton::Instance().ReclaimMemory();
+    SkugoTest(GetSlabStats(typeName).mOccupied == 0);
+  }
+
+  // Counts how many are alive, so tests can tell exactly when each one is destroyed
+  class BatchTestObject : public SafeObject
+  {
+  public:
+    BatchTestObject(int value) :
+      mValue(value)
+    {
+      ++sAlive;
+    }
+
+    ~BatchTestObject()
+    {
+      --sAlive;
+    }
+
+    int mValue;
+    static size_t sAlive;
+  };
+  size_t BatchTestObject::sAlive = 0;
+
+  /***********************************************************************************************/
+  void TestBulkCreation()
+  {
+    SafeObjectSingleton& singleton = SafeObjectSingleton::Instance();
+    const char* typeName = typeid(BatchTestObject).name();
+    const size_t count = 1000;
+
+    vector<HandleOf<BatchTestObject>> handles;
+    handles.emplace_back(SkugoNew(BatchTestObject, -1));
+    singleton.NewReferenceCountedSafeObjects(count, handles, 7);
+    SkugoTest(handles.size() == count + 1);
+    SkugoTest(BatchTestObject::sAlive == count + 1);
+    SkugoTest(GetSlabStats(typeName).mOccupied == count + 1);
+
+    // Every object has its own id, and every handle finds its object once the batch is published
+    HandleIdReader reader;
+    vector<BatchTestObject*> objects;
+    for (const HandleOf<BatchTestObject>& handle : handles)
+    {
+      reader.Visit(handle);
+      objects.push_back(handle.Dereference());
+    }
+    SkugoTest(objects[0] && objects[0]->mValue == -1);
+    for (size_t i = 1; i <= count; ++i)
+    {
+      SkugoTest(objects[i] && objects[i]->mValue == 7);
+    }
+    sort(reader.mIds.begin(), reader.mIds.end());
+    SkugoTest(reader.mIds[0] != 0);
+    SkugoTest(unique(reader.mIds.begin(), reader.mIds.end()) == reader.mIds.end());
+
+    // The handles in the vector hold the only references, so only the copied object survives the release
+    HandleOf<BatchTestObject> kept = handles[count / 2];
+    Handle stale = handles[1];
+    singleton.ReleaseHandles(handles);
+    SkugoTest(handles.empty());
+    SkugoTest(BatchTestObject::sAlive == 2);
+    SkugoTest(kept.Dereference() == objects[count / 2]);
+    SkugoTest(stale.Dereference() == objects[1]);
+    stale = Handle();
+    kept = HandleOf<BatchTestObject>();
+    SkugoTest(BatchTestObject::sAlive == 0);
+
+    // Once no reader can see them every block goes back to the slab, and the next batch reuses them
+    singleton.ReclaimMemory();
+    SkugoTest(GetSlabStats(typeName).mOccupied == 0);
+    size_t capacity = GetSlabStats(typeName).mCapacity;
+    singleton.NewReferenceCountedSafeObjects(count, handles, 7);
+    SkugoTest(GetSlabStats(typeName).mCapacity == capacity);
+    singleton.ReleaseHandles(handles);
+    singleton.ReclaimMemory();
+    SkugoTest(BatchTestObject::sAlive == 0);
+  }
+
+  // Remembers which object it is, so we can tell if its memory was reused by another object
+  class ReadSectionTestObject : public SafeObject
+  {
+  public:
+    ReadSectionTestObject(uint64_t serial) :
+      mSerial(serial)
+    {
+    }
+
+    volatile uint64_t mSerial;
+  };
+
+  // Records whether it could still be found while its destructor was running
+  class DetachTestObject : public SafeObject
+  {
+  public:
+    ~DetachTestObject()
+    {
+      sFoundWhileDestroying = mSelf.Dereference() != nullptr;
+    }
+
+    WeakHandle mSelf;
+    static bool sFoundWhileDestroying;
+  };
+  bool DetachTestObject::sFoundWhileDestroying = false;
+
+  /***********************************************************************************************/
+  void TestSafeObjectReadSections()
+  {
+    const size_t generations = 50;
+    const size_t objectsPerGeneration = 1000;
+    const size_t readerCount = 4;
+
+    // Handles are created up front so that readers never write to them
+    vector<vector<HandleOf<ReadSectionTestObject>>> handles(generations);
+    vector<vector<ReadSectionTestObject*>> objects(generations);
+    uint64_t serial = 0;
+    for (size_t g = 0; g < generations; ++g)
+    {
+      for (size_t i = 0; i < objectsPerGeneration; ++i)
+      {
+        ReadSectionTestObject* object = SkugoNew(ReadSectionTestObject, ++serial);
+        objects[g].push_back(object);
+        handles[g].emplace_back(object);
+      }
+    }
+
+    // Another thread may destroy the object while we look at it (a read section only keeps the memory
+    // from being reused), so readers look at the serial as raw memory rather than through the object
+    ReadSectionTestObject* first = objects[0][0];
+    ptrdiff_t serialOffset = reinterpret_cast<const volatile char*>(&first->mSerial) -
+      reinterpret_cast<const volatile char*>(static_cast<SafeObject*>(first));
+
+    atomic<bool> done(false);
+    atomic<size_t> corruptions(0);
+    vector<thread> readers;
+    for (size_t r = 0; r < readerCount; ++r)
+    {
+      readers.emplace_back([&]()
+      {
+        while (!done.load())
+        {
+          for (size_t g = 0; g < generations; ++g)
+          {
+            SafeObjectReadSection readSection;
+            for (const Handle& handle : handles[g])
+            {
+              SafeObject* object = handle.Dereference();
+              if (object)
+              {
+                // While we're in the read section the memory must not be handed to a new object
+                const volatile uint64_t* serial = reinterpret_cast<const volatile uint64_t*>(
+                  reinterpret_cast<const char*>(object) + serialOffset);
+                uint64_t before = *serial;
+                this_thread::yield();
+                uint64_t after = *serial;
+                if (before != after)
+                {
+                  ++corruptions;
+                }
+              }
+            }
+          }
+        }
+      });
+    }
+
+    // Delete a generation at a time while churning new objects that want to reuse the same memory
+    for (size_t g = 0; g < generations; ++g)
+    {
+      for (ReadSectionTestObject* object : objects[g])
+      {
+        SkugoDelete(object);
+      }
+
+      vector<ReadSectionTestObject*> churn;
+      for (size_t i = 0; i < objectsPerGeneration; ++i)
+      {
+        churn.push_back(SkugoNew(ReadSectionTestObject, ++serial));
+      }
+      for (ReadSectionTestObject* object : churn)
+      {
+        SkugoDelete(object);
+      }
+
+      SafeObjectSingleton::Instance().ReclaimMemory();
+    }
+
+    done.store(true);
+    for (thread& reader : readers)
+    {
+      reader.join();
+    }
+
+    SkugoTest(corruptions.load() == 0);
+    for (size_t g = 0; g < generations; ++g)
+    {
+      for (const Handle& handle : handles[g])
+      {
+        SkugoTest(handle.Dereference() == nullptr);
+      }
+    }
+
+    // Objects are unregistered before their destructors start, whether they are deleted or released
+    DetachTestObject* deleted = SkugoNew(DetachTestObject);
+    deleted->mSelf = WeakHandle(deleted);
+    SkugoDelete(deleted);
+    SkugoTest(!DetachTestObject::sFoundWhileDestroying);
+    DetachTestObject* released = SkugoNew(DetachTestObject);
+    released->mSelf = WeakHandle(released);
+    Handle(released).Dereference();
+    SkugoTest(!DetachTestObject::sFoundWhileDestroying);
+  }
+
+  // Walked with ForEach, which is allowed to delete the object it is given
+  class DenseTestObject : public SafeObject
+  {
+  public:
+    DenseTestObject(int value) :
+      mValue(value),
+      mVisits(0)
+    {
+    }
+
+    int mValue;
+    int mVisits;
+  };
+
+  /***********************************************************************************************/
+  void TestDenseObjectArrays()
+  {
+    SafeObjectSingleton& singleton = SafeObjectSingleton::Instance();
+
+    // Destroying an object moves the last object into its place, so the array stays packed
+    DenseTestObject* a = SkugoNew(DenseTestObject, 0);
+    DenseTestObject* b = SkugoNew(DenseTestObject, 1);
+    DenseTestObject* c = SkugoNew(DenseTestObject, 2);
+    SafeObjectRange<DenseTestObject> range = singleton.GetObjects<DenseTestObject>();
+    SkugoTest(range.size() == 3);
+    SkugoDelete(a);
+    range = singleton.GetObjects<DenseTestObject>();
+    SkugoTest(range.size() == 2);
+    SkugoTest(&*range.begin() == c);
+    SkugoDelete(c);
+    range = singleton.GetObjects<DenseTestObject>();
+    SkugoTest(range.size() == 1);
+    SkugoTest(&*range.begin() == b);
+    SkugoDelete(b);
+    SkugoTest(singleton.GetObjects<DenseTestObject>().empty());
+
+    // Every object is visited exactly once even when the function deletes some of them
+    const int count = 1000;
+    for (int i = 0; i < count; ++i)
+    {
+      SkugoNew(DenseTestObject, i);
+    }
+    int visited = 0;
+    singleton.ForEach<DenseTestObject>([&](DenseTestObject& object)
+    {
+      ++visited;
+      ++object.mVisits;
+      if (object.mValue % 3 != 0)
+      {
+        SkugoDelete(&object);
+      }
+    });
+    SkugoTest(visited == count);
+
+    // Objects created during the walk are not visited
+    int survivors = 0;
+    singleton.ForEach<DenseTestObject>([&](DenseTestObject& object)
+    {
+      ++survivors;
+      SkugoTest(object.mVisits == 1);
+      SkugoTest(object.mValue % 3 == 0);
+      SkugoNew(DenseTestObject, -1);
+    });
+    SkugoTest(survivors == (count + 2) / 3);
+
+    singleton.ForEach<DenseTestObject>([](DenseTestObject& object)
+    {
+      SkugoDelete(&object);
+    });
+    SkugoTest(singleton.GetObjects<DenseTestObject>().empty());
+
+    // Deleting objects that haven't been visited yet (like a parent deleting its children) skips them,
+    // and never moves an object that was already visited into their place
+    vector<DenseTestObject*> byValue;
+    for (int i = 0; i < count; ++i)
+    {
+      byValue.push_back(SkugoNew(DenseTestObject, i));
+    }
+    visited = 0;
+    singleton.ForEach<DenseTestObject>([&](DenseTestObject& object)
+    {
+      ++visited;
+      ++object.mVisits;
+      if (object.mValue % 2 == 1)
+      {
+        SkugoDelete(byValue[object.mValue - 1]);
+        byValue[object.mValue - 1] = nullptr;
+      }
+      if (object.mValue == count - 1)
+      {
+        SkugoDelete(byValue[0]);
+        byValue[0] = nullptr;
+      }
+    });
+    SkugoTest(visited == count / 2);
+    range = singleton.GetObjects<DenseTestObject>();
+    SkugoTest(range.size() == count / 2);
+    int packed = 0;
+    for (DenseTestObject& object : range)
+    {
+      packed += (object.mVisits == 1 && object.mValue % 2 == 1) ? 1 : 0;
+    }
+    SkugoTest(packed == count / 2);
+
+    // The array is packed again once the walk is over
+    singleton.ForEach<DenseTestObject>([](DenseTestObject& object)
+    {
+      SkugoDelete(&object);
+    });
+    SkugoTest(singleton.GetObjects<DenseTestObject>().empty());
+    singleton.ReclaimMemory();
+  }
+
+  // A link in a ring of objects that all keep each other alive
+  class CycleTestObject : public SafeObject
+  {
+  public:
+    CycleTestObject()
+    {
+      ++sAlive;
+    }
+
+    ~CycleTestObject()
+    {
+      --sAlive;
+    }
+
+    void EnumerateHandles(HandleEnumerator& enumerator) override
+    {
+      enumerator.Visit(mNext);
+    }
+
+    Handle mNext;
+    static size_t sAlive;
+  };
+  size_t CycleTestObject::sAlive = 0;
+
+  /***********************************************************************************************/
+  Handle MakeCycleRing(size_t ringSize)
+  {
+    Handle first = SkugoNew(CycleTestObject);
+    Handle previous = first;
+    for (size_t i = 1; i < ringSize; ++i)
+    {
+      Handle next = SkugoNew(CycleTestObject);
+      static_cast<CycleTestObject*>(previous.Dereference())->mNext = next;
+      previous = next;
+    }
+    static_cast<CycleTestObject*>(previous.Dereference())->mNext = first;
+    return first;
+  }
+
+  /***********************************************************************************************/
+  void TestCycleCollector()
+  {
+    const size_t ringCount = 100;
+    const size_t ringSize = 10;
+
+    SafeObjectSingleton& singleton = SafeObjectSingleton::Instance();
+    singleton.SetCycleCollectionEnabled(true);
+
+    // Every ring is dropped except the last, which we keep a handle to
+    Handle kept;
+    for (size_t r = 0; r < ringCount; ++r)
+    {
+      Handle first = MakeCycleRing(ringSize);
+      if (r == ringCount - 1)
+      {
+        kept = first;
+      }
+    }
+    SkugoTest(CycleTestObject::sAlive == ringCount * ringSize);
+
+    // Touching the kept ring in the middle of a collection must not confuse the collector
+    singleton.CollectCycles(0);
+    Handle touched = static_cast<CycleTestObject*>(kept.Dereference())->mNext;
+    touched = Handle();
+
+    while (!singleton.CollectCycles(50))
+    {
+    }
+
+    CycleCollectorStats stats = singleton.GetCycleCollectorStats();
+    SkugoTest(CycleTestObject::sAlive == ringSize);
+    SkugoTest(stats.mGarbageFound == (ringCount - 1) * ringSize);
+    SkugoTest(stats.mRootsScanned != 0);
+    SkugoTest(kept.Dereference() != nullptr);
+
+    // Once the last handle is gone the final ring is garbage too
+    kept = Handle();
+    while (!singleton.CollectCycles(50))
+    {
+    }
+    SkugoTest(CycleTestObject::sAlive == 0);
+
+    // Turning collection off in the middle of a collection winds it down over several slices, and
+    // leaves the rings it was examining untouched
+    vector<WeakHandle> rings;
+    for (size_t r = 0; r < ringCount; ++r)
+    {
+      rings.push_back(WeakHandle(MakeCycleRing(ringSize)));
+    }
+    singleton.CollectCycles(0);
+    singleton.SetCycleCollectionEnabled(false);
+    size_t slices = 1;
+    while (!singleton.CollectCycles(0))
+    {
+      ++slices;
+    }
+    SkugoTest(slices > 1);
+    SkugoTest(CycleTestObject::sAlive == ringCount * ringSize);
+
+    // Breaking the rings by hand frees them, now that nothing is buffered or condemned
+    for (WeakHandle& ring : rings)
+    {
+      Handle first = ring.Promote();
+      static_cast<CycleTestObject*>(first.Dereference())->mNext = Handle();
+    }
+    SkugoTest(CycleTestObject::sAlive == 0);
+
+    // Garbage that was condemned but not yet freed can't be promoted back to life (the first object
+    // is freed last, so it is still waiting while the rest of the ring is freed over many slices)
+    singleton.SetCycleCollectionEnabled(true);
+    const size_t bigRingSize = 20000;
+    WeakHandle condemned(MakeCycleRing(bigRingSize));
+    uint64_t garbageBefore = singleton.GetCycleCollectorStats().mGarbageFound;
+    while (singleton.GetCycleCollectorStats().mGarbageFound == garbageBefore)
+    {
+      singleton.CollectCycles(0);
+    }
+    SkugoTest(CycleTestObject::sAlive != 0 && condemned.Dereference() != nullptr);
+    Handle promoted = condemned.Promote();
+    SkugoTest(promoted.Dereference() == nullptr);
+    while (!singleton.CollectCycles(0))
+    {
+    }
+    SkugoTest(CycleTestObject::sAlive == 0 && condemned.Dereference() == nullptr);
+    singleton.SetCycleCollectionEnabled(false);
+    while (!singleton.CollectCycles(0))
+    {
+    }
+    singleton.ReclaimMemory();
+  }
+
+  // Only used to check the per type counters
+  class StatsTestObject : public SafeObject
+  {
+  public:
+  };
+
+  /***********************************************************************************************/
+  void TestObjectStats()
+  {
+    SafeObjectSingleton& singleton = SafeObjectSingleton::Instance();
+    uint64_t failedBefore = singleton.GetObjectStats().mFailedDereferences;
+
+    StatsTestObject* a = SkugoNew(StatsTestObject);
+    StatsTestObject* b = SkugoNew(StatsTestObject);
+    Handle c = SkugoNew(StatsTestObject);
+    Handle stale = a;
+    delete a;
+    delete b;
+    SkugoTest(stale.Dereference() == nullptr);
+
+    SafeObjectStats stats = singleton.GetObjectStats();
+    SkugoTest(stats.mFailedDereferences == failedBefore + 1);
+
+    bool found = false;
+    for (SafeObjectTypeStats& type : stats.mTypes)
+    {
+      if (strcmp(type.mName, typeid(StatsTestObject).name()) == 0)
+      {
+        found = true;
+        SkugoTest(type.mLive == 1);
+        SkugoTest(type.mCreated == 3);
+        SkugoTest(type.mDestroyed == 2);
+        SkugoTest(type.mHighWaterMark == 3);
+        SkugoTest(type.mLiveBytes == type.mBlockSize);
+        SkugoTest(type.mBytesAllocated == 3 * type.mBlockSize);
+      }
+    }
+    SkugoTest(found);
+  }
+
+  // A node in a saved graph with a value and a couple of handles
+  class GraphTestObject : public SafeObject
+  {
+  public:
+    GraphTestObject() :
+      mValue(0)
+    {
+    }
+
+    void EnumerateHandles(HandleEnumerator& enumerator) override
+    {
+      enumerator.Visit(mNext);
+      enumerator.Visit(mOther);
+    }
+
+    void Serialize(GraphWriter& writer) const
+    {
+      writer.Write(mValue);
+      writer.WriteString(mName);
+      writer.WriteHandle(mNext);
+      writer.WriteHandle(mOther);
+    }
+
+    void Deserialize(GraphReader& reader)
+    {
+      reader.Read(mValue);
+      reader.ReadString(mName);
+      reader.ReadHandle(mNext);
+      reader.ReadHandle(mOther);
+    }
+
+    static GraphTestObject* Get(const Handle& handle)
+    {
+      return static_cast<GraphTestObject*>(handle.Dereference());
+    }
+
+    int mValue;
+    string mName;
+    Handle mNext;
+    HandleOf<GraphTestObject> mOther;
+  };
+
+  /***********************************************************************************************/
+  void TestGraphSerialization()
+  {
+    const int ringSize = 1000;
+
+    GraphSerializer serializer;
+    serializer.RegisterType<GraphTestObject>("GraphTestObject");
+
+    // A ring where every node also points at the first node, plus one object of a type we can't save
+    vector<Handle> roots;
+    roots.push_back(SkugoNew(GraphTestObject));
+    Handle previous = roots[0];
+    for (int i = 0; i < ringSize; ++i)
+    {
+      GraphTestObject* node = GraphTestObject::Get(previous);
+      node->mValue = i;
+      node->mName = to_string(i);
+      node->mOther = HandleOf<GraphTestObject>(GraphTestObject::Get(roots[0]));
+      node->mNext = (i == ringSize - 1) ? roots[0] : Handle(SkugoNew(GraphTestObject));
+      previous = node->mNext;
+    }
+    GraphTestObject::Get(roots[0])->mOther = HandleOf<GraphTestObject>();
+    roots.push_back(Handle(SkugoNew(StatsTestObject)));
+
+    const char* path = "SkugoGraphTest.bin";
+    {
+      FileStreamSink sink(path);
+      SkugoTest(sink.IsOpen());
+      serializer.Save(roots, sink);
+    }
+
+    vector<Handle> loaded;
+    {
+      FileStreamSource source(path);
+      SkugoTest(serializer.Load(source, loaded));
+    }
+    remove(path);
+
+    SkugoTest(loaded.size() == 2);
+    SkugoTest(loaded[1].Dereference() == nullptr);
+
+    Handle node = loaded[0];
+    for (int i = 0; i < ringSize; ++i)
+    {
+      GraphTestObject* object = GraphTestObject::Get(node);
+      SkugoTest(object != nullptr && object != GraphTestObject::Get(roots[0]));
+      if (object == nullptr)
+      {
+        break;
+      }
+      SkugoTest(object->mValue == i && object->mName == to_string(i));
+      SkugoTest(i == 0 ? object->mOther.Dereference() == nullptr : object->mOther.Dereference() == loaded[0].Dereference());
+      node = object->mNext;
+    }
+    SkugoTest(node.Dereference() == loaded[0].Dereference());
+
+    auto countGraphObjects = []()
+    {
+      size_t count = 0;
+      for (GraphTestObject& object : SafeObjectSingleton::Instance().GetObjects<GraphTestObject>())
+      {
+        (void)object;
+        ++count;
+      }
+      return count;
+    };
+    size_t liveBefore = countGraphObjects();
+
+    // A truncated stream loads nothing, and the half it did create (all rings) is deleted
+    MemoryStreamSink memory;
+    serializer.Save(roots, memory);
+    MemoryStreamSource truncated(memory.mData.data(), memory.mData.size() / 2);
+    vector<Handle> failed;
+    SkugoTest(!serializer.Load(truncated, failed) && failed.empty());
+    SkugoTest(countGraphObjects() == liveBefore);
+
+    // The only type's count follows the header (magic, version, type count) and its name
+    const size_t countOffset = 3 * sizeof(uint32_t) + sizeof(uint32_t) + strlen("GraphTestObject");
+    const size_t rootsOffset = countOffset + 2 * sizeof(uint32_t);
+
+    // A count the rest of the stream could never hold is rejected before anything is created
+    vector<uint8_t> corrupt = memory.mData;
+    uint32_t hugeCount = 0xFFFFFFFF;
+    memcpy(&corrupt[countOffset], &hugeCount, sizeof(hugeCount));
+    MemoryStreamSource corruptSource(corrupt.data(), corrupt.size());
+    SkugoTest(!serializer.Load(corruptSource, failed) && failed.empty());
+    SkugoTest(countGraphObjects() == liveBefore);
+
+    // Loaded objects the roots don't reach are deleted, even when they form a cycle
+    vector<Handle> pairRoots;
+    pairRoots.push_back(roots[0]);
+    pairRoots.push_back(SkugoNew(GraphTestObject));
+    GraphTestObject::Get(pairRoots[1])->mNext = Handle(SkugoNew(GraphTestObject));
+    GraphTestObject::Get(GraphTestObject::Get(pairRoots[1])->mNext)->mNext = pairRoots[1];
+    MemoryStreamSink pairMemory;
+    serializer.Save(pairRoots, pairMemory);
+    uint32_t nullRoot = 0;
+    memcpy(&pairMemory.mData[rootsOffset + sizeof(uint32_t)], &nullRoot, sizeof(nullRoot));
+    MemoryStreamSource pairSource(pairMemory.mData.data(), pairMemory.mData.size());
+    liveBefore = countGraphObjects();
+    vector<Handle> partial;
+    SkugoTest(serializer.Load(pairSource, partial));
+    SkugoTest(partial.size() == 2 && partial[1].Dereference() == nullptr);
+    SkugoTest(countGraphObjects() == liveBefore + ringSize);
+    partial.clear();
+    GraphTestObject::Get(pairRoots[1])->mNext = Handle();
+
+    // Break the rings so everything is freed (holding every object until we're done)
+    vector<Handle> objects;
+    for (GraphTestObject& object : SafeObjectSingleton::Instance().GetObjects<GraphTestObject>())
+    {
+      objects.push_back(Handle(&object));
+    }
+    for (Handle& object : objects)
+    {
+      GraphTestObject::Get(object)->mNext = Handle();
+      GraphTestObject::Get(object)->mOther = HandleOf<GraphTestObject>();
+    }
+  }
+
+  // A small declared hierarchy, plus a type that never declares its base
+  class TypeTestShape : public SafeObject
+  {
+  public:
+    SkugoSafeObjectType(TypeTestShape, SafeObject);
+  };
+
+  class TypeTestCircle : public TypeTestShape
+  {
+  public:
+    SkugoSafeObjectType(TypeTestCircle, TypeTestShape);
+  };
+
+  class TypeTestSquare : public TypeTestShape
+  {
+  public:
+    SkugoSafeObjectType(TypeTestSquare, TypeTestShape);
+  };
+
+  class TypeTestUndeclared : public TypeTestCircle
+  {
+  public:
+  };
+
+  /***********************************************************************************************/
+  void TestHandleOfTypes()
+  {
+    SkugoTest(SafeObjectTypeTraits<TypeTestCircle>::cDeclared && SafeObjectTypeTraits<TypeTestCircle>::cDepth == 2);
+    SkugoTest(!SafeObjectTypeTraits<TypeTestUndeclared>::cDeclared);
+
+    TypeTestCircle* circle = SkugoNew(TypeTestCircle);
+    TypeTestUndeclared* undeclared = SkugoNew(TypeTestUndeclared);
+    HandleOf<TypeTestCircle> circleHandle(circle);
+    HandleOf<TypeTestShape> shapeHandle(circle);
+    HandleOf<SafeObject> objectHandle(circle);
+    HandleOf<TypeTestCircle> undeclaredHandle(undeclared);
+    SkugoTest(circleHandle.Dereference() == circle);
+    SkugoTest(shapeHandle.Dereference() == circle);
+    SkugoTest(objectHandle.Dereference() == circle);
+    SkugoTest(undeclaredHandle.Dereference() == undeclared);
+
+    // A handle of the wrong type (which can only happen by assigning through the base) reads as null
+    HandleOf<TypeTestSquare> squareHandle;
+    static_cast<Handle&>(squareHandle) = circleHandle;
+    SkugoTest(squareHandle.Dereference() == nullptr);
+
+    // Objects that were not allocated via SkugoNew have no type info and fall back to dynamic_cast
+    TypeTestSquare square;
+    HandleOf<TypeTestShape> stackHandle(&square);
+    SkugoTest(stackHandle.Dereference() == &square);
+    static_cast<Handle&>(circleHandle) = stackHandle;
+    SkugoTest(circleHandle.Dereference() == nullptr);
+  }
+
+  // Shared across threads, so promoting it has to race against the last release
+  class WeakTestObject : public SafeObject
+  {
+  public:
+    typedef AtomicReferenceCounting ReferenceCountingPolicy;
+  };
+
+  /***********************************************************************************************/
+  void TestWeakHandles()
+  {
+    // Weak handles never keep the object alive
+    HandleOf<TypeTestCircle> strong(SkugoNew(TypeTestCircle));
+    WeakHandleOf<TypeTestCircle> weak(strong);
+    WeakHandleOf<TypeTestCircle> weakCopy = weak;
+    SkugoTest(weakCopy.Dereference() == strong.Dereference());
+    {
+      HandleOf<TypeTestCircle> promoted = weak.Promote();
+      SkugoTest(promoted.Dereference() == strong.Dereference());
+      strong = HandleOf<TypeTestCircle>();
+      SkugoTest(weak.Dereference() != nullptr);
+    }
+    SkugoTest(weak.Dereference() == nullptr);
+    SkugoTest(weak.Promote().Dereference() == nullptr);
+
+    // Promotion checks the type
+    HandleOf<TypeTestShape> shape(SkugoNew(TypeTestSquare));
+    WeakHandleOf<TypeTestCircle> wrongType;
+    static_cast<WeakHandle&>(wrongType) = WeakHandle(shape);
+    SkugoTest(wrongType.Promote().Dereference() == nullptr);
+    SkugoTest(WeakHandle(shape).Promote().Dereference() == shape.Dereference());
+
+    // Promoting while another thread drops the last reference either wins the object or gets nothing
+    for (size_t i = 0; i < 1000; ++i)
+    {
+      Handle shared(SkugoNew(WeakTestObject));
+      WeakHandle sharedWeak(shared);
+      Handle promoted;
+      thread releaser([&]()
+      {
+        shared = Handle();
+      });
+      promoted = sharedWeak.Promote();
+      releaser.join();
+      SkugoTest((promoted.Dereference() != nullptr) == (sharedWeak.Dereference() != nullptr));
+    }
+  }
+
+  /***********************************************************************************************/
+  void TestPooledInterning()
+  {
+    const size_t nameCount = 1000;
+    const size_t threadCount = 4;
+
+    vector<string> names;
+    vector<pstring> expected;
+    for (size_t i = 0; i < nameCount; ++i)
+    {
+      names.push_back("Name" + to_string(i));
+      expected.push_back(pstring(names.back()));
+    }
+
+    // Threads interning the same values (while others come and go, and copies of them are released
+    // without the lock) must all land on the same entries
+    atomic<size_t> mismatches(0);
+    vector<thread> threads;
+    for (size_t t = 0; t < threadCount; ++t)
+    {
+      threads.emplace_back([&, t]()
+      {
+        for (size_t round = 0; round < 20; ++round)
+        {
+          for (size_t i = 0; i < nameCount; ++i)
+          {
+            pstring name(names[i]);
+            pstring temporary("Temporary" + to_string(t * nameCount + i));
+            pstring copy(temporary);
+            if (name != expected[i] || *name != names[i] || copy != temporary || *temporary == *name)
+            {
+              ++mismatches;
+            }
+          }
+        }
+      });
+    }
+
+    for (thread& worker : threads)
+    {
+      worker.join();
+    }
+    SkugoTest(mismatches.load() == 0);
+    SkugoTest(pstring() == pstring(""));
+  }
+
+  /***********************************************************************************************/
+  void TestPooledLookupAllocations()
+  {
+    // Long enough that a std::string holding it would have to allocate
+    const char* name = "Assets/Textures/Environment/MossyRock42.png";
+    string nameString(name);
+    pstring interned(name);
+
+    // Every kind of lookup that hits an existing entry must not touch the heap
+    AllocationCounter hits;
+    for (size_t i = 0; i < 100; ++i)
+    {
+      pstring fromLiteral("Assets/Textures/Environment/MossyRock42.png");
+      pstring fromPointer(name);
+      pstring fromString(nameString);
+      pstring fromView(istring_view(nameString.data(), nameString.size()));
+      pstring copied(fromView);
+      SkugoTest(fromLiteral == interned && fromPointer == interned && fromString == interned);
+      SkugoTest(fromView == interned && copied == interned);
+    }
+    SkugoTest(hits.GetAllocations() == 0);
+
+    // A miss constructs the value from the view
+    AllocationCounter miss;
+    pstring missed(istring_view(name, 15));
+    SkugoTest(!AllocationCounter::IsCounting() || miss.GetAllocations() != 0);
+    SkugoTest(*missed == "Assets/Textures");
+    SkugoTest(missed == pstring("Assets/Textures"));
+    SkugoTest(missed != interned);
+  }
+
+  /***********************************************************************************************/
+  void TestPooledLiterals()
+  {
+    // The compiler's hash has to match the runtime one or the literal would be a separate entry
+    static_assert(istring_hash("OnCollisionStarted", 18) != 0, "The hash must be usable at compile time");
+    SkugoTest(hash<istring>()(string("OnCollisionStarted")) == istring_hash("OnCollisionStarted", 18));
+
+    pstring runtime(string("OnCollisionStarted"));
+    SkugoTest(PSTRING("OnCollisionStarted") == runtime);
+    SkugoTest(*PSTRING("OnCollisionStarted") == "OnCollisionStarted");
+    SkugoTest(PSTRING("") == pstring());
+    SkugoTest(PSTRING("OnCollisionEnded") != runtime);
+
+    // Each use is interned once, and after that is only a reference to the same slot
+    const pstring* slots[3];
+    AllocationCounter counter;
+    for (size_t i = 0; i < 3; ++i)
+    {
+      slots[i] = &PSTRING("OnCollisionPersisted");
+      if (i == 0)
+      {
+        counter = AllocationCounter();
+      }
+    }
+    SkugoTest(counter.GetAllocations() == 0);
+    SkugoTest(slots[0] == slots[1] && slots[1] == slots[2]);
+    SkugoTest(*slots[0] == pstring("OnCollisionPersisted"));
+  }
+
+  /***********************************************************************************************/
+  void TestArenaStrings()
+  {
+    arena_pstring empty;
+    SkugoTest(empty.empty() && empty == arena_pstring(""));
+    SkugoTest(strcmp(empty.c_str(), "") == 0);
+
+    arena_pstring name("Player.Inventory.Slot");
+    SkugoTest(name == arena_pstring(string("Player.Inventory.Slot")));
+    SkugoTest(name == arena_pstring(istring_view("Player.Inventory.Slot.Extra", 21)));
+    SkugoTest(name != arena_pstring("Player.Inventory"));
+    SkugoTest(name.size() == 21 && strcmp(name.c_str(), "Player.Inventory.Slot") == 0);
+    SkugoTest(hash<arena_pstring>()(name) == hash<arena_pstring>()(arena_pstring("Player.Inventory.Slot")));
+
+    // Enough strings to grow the tables and fill many slabs, plus one bigger than a slab
+    vector<arena_pstring> interned;
+    for (size_t i = 0; i < 50000; ++i)
+    {
+      interned.push_back(arena_pstring("Arena" + to_string(i)));
+    }
+    string huge(1024 * 1024, 'x');
+    arena_pstring hugeName(huge);
+    SkugoTest(hugeName.size() == huge.size() && hugeName.view().data()[huge.size()] == '\0');
+    SkugoTest(hugeName == arena_pstring(huge));
+
+    size_t mismatches = 0;
+    for (size_t i = 0; i < interned.size(); ++i)
+    {
+      string expected = "Arena" + to_string(i);
+      if (interned[i] != arena_pstring(expected) || interned[i].c_str() != expected)
+      {
+        ++mismatches;
+      }
+    }
+    SkugoTest(mismatches == 0);
+
+    // Copies are plain pointers
+    AllocationCounter counter;
+    vector<arena_pstring> copied(interned.begin(), interned.begin() + 10);
+    arena_pstring again("Arena42");
+    SkugoTest(again == interned[42]);
+    SkugoTest(!AllocationCounter::IsCounting() || counter.GetAllocations() == 1);
+    SkugoTest(arena_pstring::get_stats().m_entries >= interned.size() + 3);
+  }
+
+  /***********************************************************************************************/
+  void TestArenaStringTables()
+  {
+    vector<string> names;
+    for (size_t i = 0; i < 2000; ++i)
+    {
+      names.push_back("Tables/Asset" + to_string(i) + ".Property" + to_string(i % 17));
+    }
+    names.push_back(names[5]);
+    names.push_back("");
+
+    // Interned before the table is loaded, so it keeps its own entry
+    arena_pstring before(names[7]);
+
+    // Loaded tables are used in place for the rest of the program, so these are never freed
+    const string* table = new string(arena_pstring::build_table(vector<istring_view>(names.begin(), names.end())));
+    SkugoTest(!arena_pstring::load_table(table->data(), table->size() - 4));
+    string corrupt = *table;
+    corrupt[0] = 'X';
+    SkugoTest(!arena_pstring::load_table(corrupt.data(), corrupt.size()));
+
+    // A slot whose characters would run past the end of the table (the first shard's slots follow
+    // the 16 byte header and the 12 byte directory entry of each shard, and each slot is its
+    // location, length and hash)
+    corrupt = *table;
+    uint32_t slots = 0;
+    memcpy(&slots, &corrupt[16], sizeof(slots));
+    while (corrupt[slots] == 0 && corrupt[slots + 1] == 0 && corrupt[slots + 2] == 0 && corrupt[slots + 3] == 0)
+    {
+      slots += 12;
+    }
+    uint32_t location = 0;
+    memcpy(&location, &corrupt[slots], sizeof(location));
+    uint32_t pastEnd = static_cast<uint32_t>(corrupt.size()) - location;
+    memcpy(&corrupt[slots + 4], &pastEnd, sizeof(pastEnd));
+    SkugoTest(!arena_pstring::load_table(corrupt.data(), corrupt.size()));
+    SkugoTest(arena_pstring::load_table(table->data(), table->size()));
+    SkugoTest(arena_pstring::get_stats().m_mapped_entries >= 2001);
+
+    // Found in the table itself, without copying anything
+    AllocationCounter counter;
+    size_t outside = 0;
+    for (size_t i = 0; i < 2000; ++i)
+    {
+      arena_pstring found(names[i]);
+      if (found.c_str() < table->data() || found.c_str() >= table->data() + table->size())
+      {
+        ++outside;
+      }
+      SkugoTest(found.view().size() == names[i].size() && found.c_str() == names[i]);
+    }
+    SkugoTest(counter.GetAllocations() == 0 && outside == 1);
+    SkugoTest(arena_pstring(names[7]) == before);
+
+    // Everything in the pstring pool can be saved as a table too
+    pstring pooledName("Tables/FromThePool");
+    const string* pooledTable = new string(arena_pstring::build_table_from_pstrings());
+    SkugoTest(arena_pstring::load_table(pooledTable->data(), pooledTable->size()));
+    arena_pstring fromPool(*pooledName);
+    SkugoTest(fromPool.c_str() >= pooledTable->data() && fromPool.c_str() < pooledTable->data() + pooledTable->size());
+  }
+
+  /***********************************************************************************************/
+  void TestPooledIds()
+  {
+    pstring first("IdFirst");
+    pstring second("IdSecond");
+    SkugoTest(first.id() != second.id());
+    SkugoTest(first.id() < pstring::id_bound() && second.id() < pstring::id_bound());
+    SkugoTest(pstring("IdFirst").id() == first.id());
+    SkugoTest(pstring::from_id(first.id()) == first);
+
+    // A value found by id is a full reference that keeps it in the pool
+    uint32_t secondId = second.id();
+    pstring found = pstring::from_id(secondId);
+    second = pstring();
+    SkugoTest(*found == "IdSecond" && found.id() == secondId);
+
+    // Every shard hands out its own ids, which never collide with another shard's
+    vector<pstring> many;
+    vector<uint32_t> ids;
+    for (int i = 0; i < 1000; ++i)
+    {
+      many.push_back(pstring("IdMany" + to_string(i)));
+      ids.push_back(many.back().id());
+      SkugoTest(ids.back() < pstring::id_bound());
+      SkugoTest(pstring::from_id(ids.back()) == many.back());
+    }
+    sort(ids.begin(), ids.end());
+    SkugoTest(unique(ids.begin(), ids.end()) == ids.end());
+
+    // Once a value leaves the pool its id is handed to the next new value in its shard
+    typedef pooled<string, hash<string>, equal_to<string>, allocator<string>, 1> OneShardString;
+    uint32_t temporaryId = 0;
+    {
+      OneShardString temporary("IdTemporary");
+      temporaryId = temporary.id();
+    }
+    OneShardString replacement("IdReplacement");
+    SkugoTest(replacement.id() == temporaryId);
+    SkugoTest(OneShardString::from_id(temporaryId) == replacement);
+  }
+
+  /***********************************************************************************************/
+  void TestPStringMap()
+  {
+    vector<pstring> keys;
+    for (size_t i = 0; i < 2000; ++i)
+    {
+      keys.push_back(pstring("MapKey" + to_string(i)));
+    }
+
+    // Random inserts, overwrites and erases (enough to grow and to fill up with deleted slots)
+    pstring_map<int> map;
+    pstring_set set;
+    unordered_map<pstring, int> expected;
+    mt19937 random(7);
+    for (size_t i = 0; i < 50000; ++i)
+    {
+      const pstring& key = keys[random() % keys.size()];
+      int value = static_cast<int>(i);
+      if (random() % 3 == 0)
+      {
+        SkugoTest(map.erase(key) == expected.erase(key));
+        set.erase(key);
+      }
+      else
+      {
+        map[key] = value;
+        set.insert(key);
+        expected[key] = value;
+      }
+    }
+
+    SkugoTest(map.size() == expected.size() && set.size() == expected.size());
+    size_t mismatches = 0;
+    for (const pstring& key : keys)
+    {
+      unordered_map<pstring, int>::iterator it = expected.find(key);
+      pstring_map<int>::iterator found = map.find(key);
+      bool inMap = found != map.end();
+      if (inMap != (it != expected.end()) || set.count(key) != expected.count(key) || (inMap && found->second != it->second))
+      {
+        ++mismatches;
+      }
+    }
+    SkugoTest(mismatches == 0);
+
+    // Iteration visits every key exactly once
+    size_t visited = 0;
+    for (const pair<const pstring, int>& entry : map)
+    {
+      visited += expected.count(entry.first);
+    }
+    for (const pstring& key : set)
+    {
+      visited += expected.count(key);
+    }
+    SkugoTest(visited == expected.size() * 2);
+
+    // Erasing while iterating
+    pstring_map<int> copy(map);
+    for (pstring_map<int>::iterator it = copy.begin(); it != copy.end();)
+    {
+      it = (it->second % 2 == 0) ? copy.erase(it) : ++it;
+    }
+    for (const pair<const pstring, int>& entry : copy)
+    {
+      mismatches += (entry.second % 2 == 0 || map.find(entry.first)->second != entry.second) ? 1 : 0;
+    }
+    SkugoTest(mismatches == 0);
+    SkugoTest(map.insert(make_pair(keys[0], -1)).first->first == keys[0] && map.count(keys[0]) == 1);
+    SkugoTest(!map.insert(make_pair(keys[0], -2)).second);
+
+    map.clear();
+    SkugoTest(map.empty() && map.begin() == map.end() && map.find(keys[0]) == map.end());
+
+    // Move only values are built in place and moved (never copied) when the table grows
+    pstring_map<unique_ptr<int>> owned;
+    vector<int*> pointers;
+    for (size_t i = 0; i < keys.size(); ++i)
+    {
+      pair<pstring_map<unique_ptr<int>>::iterator, bool> inserted = owned.try_emplace(keys[i], new int(static_cast<int>(i)));
+      SkugoTest(inserted.second);
+      pointers.push_back(inserted.first->second.get());
+    }
+    SkugoTest(!owned.try_emplace(keys[0]).second && owned[keys[0]].get() == pointers[0]);
+    for (size_t i = 0; i < keys.size(); ++i)
+    {
+      mismatches += (owned[keys[i]].get() != pointers[i] || *owned[keys[i]] != static_cast<int>(i)) ? 1 : 0;
+    }
+    SkugoTest(mismatches == 0);
+
+    // Only a missing key constructs anything
+    pstring missing("MapMissing");
+    SkugoTest(owned[missing] == nullptr && owned.size() == keys.size() + 1);
+    SkugoTest(owned.emplace(missing, unique_ptr<int>(new int(1))).second == false);
+    owned.erase(missing);
+    SkugoTest(owned.emplace(missing, unique_ptr<int>(new int(1))).second && *owned[missing] == 1);
+  }
+
+  /***********************************************************************************************/
+  void TestPooledThreadCache()
+  {
+    const char* name = "Components/Physics/RigidBody/AngularVelocity";
+    pstring::set_thread_cache_enabled(true);
+
+    pstring first(name);
+    pstring second(name);
+    SkugoTest(first == second && *second == name);
+    SkugoTest(pstring::get_thread_cache_stats().m_hits >= 1);
+
+    // The cache holds its own reference, so the value stays in the pool after we let go of it
+    first = pstring();
+    second = pstring();
+    AllocationCounter cached;
+    pstring third(name);
+    SkugoTest(cached.GetAllocations() == 0 && *third == name);
+
+    // Many more values than the cache has slots (so plenty are evicted and released)
+    size_t mismatches = 0;
+    for (size_t round = 0; round < 2; ++round)
+    {
+      for (size_t i = 0; i < 20000; ++i)
+      {
+        string expected = "CacheName" + to_string(i);
+        if (*pstring(expected) != expected)
+        {
+          ++mismatches;
+        }
+      }
+    }
+    SkugoTest(mismatches == 0);
+
+    // Turning the cache off lets go of everything, so once nobody else holds it the value leaves the pool
+    third = pstring();
+    pstring::set_thread_cache_enabled(false);
+    SkugoTest(pstring::get_thread_cache_stats().m_hits == 0);
+    AllocationCounter released;
+    pstring fourth(name);
+    SkugoTest(*fourth == name);
+    SkugoTest(!AllocationCounter::IsCounting() || released.GetAllocations() != 0);
+  }
+
+  /***********************************************************************************************/
+  void TestPinnedPooledValues()
+  {
+    const char* pinnedName = "Engine/Components/Transform";
+    const char* laterName = "Engine/Events/OnFrameStarted";
+
+    uint32_t pinnedId = 0;
+    uint32_t laterId = 0;
+    {
+      pstring pinned(pinned_t(), pinnedName);
+      SkugoTest(pinned.is_pinned() && *pinned == pinnedName);
+      pinnedId = pinned.id();
+
+      pstring later(laterName);
+      SkugoTest(!later.is_pinned());
+      later.pin();
+      SkugoTest(later.is_pinned() && pstring(laterName).is_pinned());
+      laterId = later.id();
+
+      // Copies and releases leave a pinned value pinned
+      vector<pstring> copies(1000, later);
+      copies.clear();
+      SkugoTest(later.is_pinned());
+    }
+
+    // Nothing holds either value any more, but they are still in the pool (with the same ids)
+    AllocationCounter counter;
+    pstring pinned(pinnedName);
+    pstring later(laterName);
+    SkugoTest(counter.GetAllocations() == 0);
+    SkugoTest(pinned.id() == pinnedId && later.id() == laterId);
+    SkugoTest(pstring::from_id(pinnedId) == pinned);
+
+    SkugoTest(PSTRING("Engine/Events/OnFrameEnded").is_pinned());
+  }
+
+  /***********************************************************************************************/
+  void TestDeferredPooledRelease()
+  {
+    const char* name = "Scripts/Temporaries/SplitResult";
+    pstring::defer_release(1000000);
+
+    uint32_t id = 0;
+    {
+      pstring dropped(name);
+      id = dropped.id();
+    }
+
+    // Dead but not collected, so interning it again brings back the same entry
+    AllocationCounter resurrected;
+    pstring again(name);
+    SkugoTest(resurrected.GetAllocations() == 0 && again.id() == id && *again == name);
+
+    // Once collected it has to be allocated again
+    again = pstring();
+    SkugoTest(pstring::collect() >= 1);
+    AllocationCounter collected;
+    pstring fresh(name);
+    SkugoTest(*fresh == name);
+    SkugoTest(!AllocationCounter::IsCounting() || collected.GetAllocations() != 0);
+
+    // A budget caps how many dead entries one collect looks at
+    for (size_t i = 0; i < 1000; ++i)
+    {
+      pstring("DeadName" + to_string(i));
+    }
+    SkugoTest(pstring::collect(10) <= 10);
+
+    // A low threshold has each shard collect on its own (so none of the 64 shards is left with more than 3)
+    pstring::defer_release(4);
+    for (size_t i = 0; i < 1000; ++i)
+    {
+      pstring("ThresholdName" + to_string(i));
+    }
+    SkugoTest(pstring::collect() <= 3 * 64);
+
+    // Turning deferral off collects everything that's left
+    pstring::defer_release(0);
+    SkugoTest(pstring::collect() == 0);
+    AllocationCounter immediate;
+    pstring("DeadName0");
+    SkugoTest(!AllocationCounter::IsCounting() || immediate.GetAllocations() != 0);
+  }
+
+  /***********************************************************************************************/
+  void TestPStringViews()
+  {
+    pstring line("transform.position = lerp(start, target, 0.5);");
+    pstring keyword("lerp");
+
+    // Slicing never allocates or interns
+    AllocationCounter counter;
+    pstring_view whole(line);
+    pstring_view member = line->slice(10, 8);
+    pstring_view call = whole.substr(whole.find('='), pstring_view::npos).substr(2, 4);
+    pstring_view rest = whole.substr(whole.find('(') + 1);
+    SkugoTest(counter.GetAllocations() == 0);
+
+    SkugoTest(member.size() == 8 && memcmp(member.data(), "position", 8) == 0);
+    SkugoTest(call == keyword && keyword == call && call != line && whole == line);
+    SkugoTest(rest.substr(0, rest.find(',')) == pstring_view("start", 5));
+    SkugoTest(whole.substr(whole.size()).empty() && whole.find('#') == pstring_view::npos);
+    SkugoTest(pstring_view("abc", 3) < pstring_view("abd", 3) && pstring_view("ab", 2) < pstring_view("abc", 3));
+    SkugoTest(hash<pstring_view>()(call) == hash<pstring_view>()(pstring_view(keyword)));
+
+    // Interning only happens when asked for, and finds what's already in the pool
+    AllocationCounter interning;
+    pstring interned = call.intern();
+    SkugoTest(interned == keyword && interning.GetAllocations() == 0);
+    SkugoTest(*member.intern() == "position");
+
+    // substr still makes an interned string of its own, and views can't be made from temporaries
+    pstring owned = line->substr(10, 8);
+    SkugoTest(*owned == "position" && owned == member.intern());
+    static_assert(!is_constructible<pstring_view, pstring>::value, "A view of a temporary pstring would dangle");
+  }
+
   /***********************************************************************************************/
   void RunUnitTests()
   {
+    TestSlotMapHandles();
+    TestThreadedCreation();
+    TestReferenceCountingPolicies();
+    TestHandleCopyAndMove();
+    TestSlabAllocator();
+    TestBulkCreation();
+    TestSafeObjectReadSections();
+    TestDenseObjectArrays();
+    TestCycleCollector();
+    TestObjectStats();
+    TestGraphSerialization();
+    TestHandleOfTypes();
+    TestWeakHandles();
+    TestPooledInterning();
+    TestPooledLookupAllocations();
+    TestPooledLiterals();
+    TestArenaStrings();
+    TestArenaStringTables();
+    TestPooledIds();
+    TestPStringMap();
+    TestPooledThreadCache();
+    TestPinnedPooledValues();
+    TestDeferredPooledRelease();
+    TestPStringViews();
   }
 }
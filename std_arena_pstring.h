@@ -0,0 +1,583 @@
+// Copyright (c) 2017 Trevor Sundberg
+// This code is licensed under the MIT license (see LICENSE.txt for details)
+
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "std_pstring.h"
+
+namespace std
+{
+  // A snapshot of how much memory the arena pool is using
+  struct arena_pstring_stats
+  {
+    size_t m_entries;
+
+    // The open addressed tables (every slot, used or not)
+    size_t m_table_bytes;
+
+    // Every slab that has been allocated, and how much of them is taken by entries
+    size_t m_slab_bytes;
+    size_t m_used_slab_bytes;
+
+    // Entries that live in loaded tables (see arena_pstring::load_table) rather than in slabs
+    size_t m_mapped_entries;
+  };
+
+  // An interned string whose characters live in large append-only slabs. Unlike pstring, interned
+  // strings are never freed (so copying one is just copying a pointer, with no reference count)
+  // and each one only costs its characters, a small length header, and one slot in a compact table.
+  // This suits identifiers that are interned once and live for the whole program, such as names
+  // loaded from assets. Like pstring, equal strings are always the same pointer, so comparing and
+  // hashing only look at the pointer.
+  // Tools can also save the strings a program needs as a prebuilt table (see build_table), which the
+  // program maps into memory at startup and loads in place instead of interning each string.
+  class arena_pstring
+  {
+  public:
+    arena_pstring() :
+      m_data(empty_data())
+    {
+    }
+
+    arena_pstring(const istring_view& view) :
+      m_data(get_pool().intern(view, istring_hash(view.data(), view.size())))
+    {
+    }
+
+    arena_pstring(const char* data) :
+      arena_pstring(istring_view(data))
+    {
+    }
+
+    arena_pstring(const string& value) :
+      arena_pstring(istring_view(value))
+    {
+    }
+
+    // The characters are always null terminated
+    const char* c_str() const
+    {
+      return m_data;
+    }
+
+    const char* data() const
+    {
+      return m_data;
+    }
+
+    size_t size() const
+    {
+      uint32_t length;
+      memcpy(&length, m_data - sizeof(length), sizeof(length));
+      return length;
+    }
+
+    bool empty() const
+    {
+      return size() == 0;
+    }
+
+    istring_view view() const
+    {
+      return istring_view(m_data, size());
+    }
+
+    bool operator==(const arena_pstring& rhs) const
+    {
+      return m_data == rhs.m_data;
+    }
+
+    bool operator!=(const arena_pstring& rhs) const
+    {
+      return m_data != rhs.m_data;
+    }
+
+    bool operator<(const arena_pstring& rhs) const
+    {
+      return m_data < rhs.m_data;
+    }
+
+    static arena_pstring_stats get_stats()
+    {
+      return get_pool().get_stats();
+    }
+
+    // Lays out the distinct names as a table for load_table. The table only holds offsets (so it works
+    // wherever it ends up in memory), and each entry already sits in the shard and slot that interning
+    // would have put it in, so loading it never looks at a character. Numbers are written in the byte
+    // order of the machine, so the table must be built for the platform that loads it.
+    static string build_table(const vector<istring_view>& names)
+    {
+      vector<size_t> hashes(names.size());
+      vector<vector<size_t>> grouped(shard_count);
+      for (size_t i = 0; i < names.size(); ++i)
+      {
+        hashes[i] = istring_hash(names[i].data(), names[i].size());
+        grouped[shard_of(hashes[i])].push_back(i);
+      }
+
+      // Place every name while its location is still its index + 1 (which also finds duplicates)
+      vector<vector<slot>> tables(shard_count);
+      for (size_t i = 0; i < shard_count; ++i)
+      {
+        if (grouped[i].empty())
+        {
+          continue;
+        }
+
+        size_t slot_count = 4;
+        while (slot_count * 3 < grouped[i].size() * 4)
+        {
+          slot_count *= 2;
+        }
+        tables[i].resize(slot_count);
+
+        for (size_t index : grouped[i])
+        {
+          const istring_view& name = names[index];
+          uint32_t hash32 = static_cast<uint32_t>(hashes[index]);
+          const char* found = probe(tables[i].data(), slot_count, name, hash32, [&names](uint32_t location)
+          {
+            return names[location - 1].data();
+          });
+
+          if (!found)
+          {
+            slot placed;
+            placed.m_location = static_cast<uint32_t>(index + 1);
+            placed.m_length = static_cast<uint32_t>(name.size());
+            placed.m_hash = hash32;
+            place(tables[i], placed);
+          }
+        }
+      }
+
+      // The header and each shard's slots come first, and then the entries (laid out just like a slab)
+      vector<table_shard> directory(shard_count);
+      size_t size = sizeof(table_header) + sizeof(table_shard) * shard_count;
+      for (size_t i = 0; i < shard_count; ++i)
+      {
+        directory[i].m_slots = static_cast<uint32_t>(size);
+        directory[i].m_slot_count = static_cast<uint32_t>(tables[i].size());
+        directory[i].m_entries = 0;
+        size += tables[i].size() * sizeof(slot);
+      }
+
+      string table(size, '\0');
+      for (size_t i = 0; i < shard_count; ++i)
+      {
+        for (slot& placed : tables[i])
+        {
+          if (placed.m_location != 0)
+          {
+            const istring_view& name = names[placed.m_location - 1];
+            size_t entry = table.size();
+            table.resize(entry + entry_size(name.size()));
+            memcpy(&table[entry], &placed.m_length, sizeof(placed.m_length));
+            memcpy(&table[entry + sizeof(placed.m_length)], name.data(), name.size());
+
+            placed.m_location = static_cast<uint32_t>(entry + sizeof(placed.m_length));
+            ++directory[i].m_entries;
+          }
+        }
+
+        if (!tables[i].empty())
+        {
+          memcpy(&table[directory[i].m_slots], tables[i].data(), tables[i].size() * sizeof(slot));
+        }
+      }
+      __stl_assert(table.size() <= UINT32_MAX, "A string table can't be bigger than 4GB");
+
+      table_header header;
+      header.m_magic = table_magic;
+      header.m_version = table_version;
+      header.m_shard_count = static_cast<uint32_t>(shard_count);
+      header.m_size = static_cast<uint32_t>(table.size());
+      memcpy(&table[0], &header, sizeof(header));
+      memcpy(&table[sizeof(header)], directory.data(), sizeof(table_shard) * shard_count);
+      return table;
+    }
+
+    // A table of every string that is currently in the pstring pool (so a tool can intern what the
+    // program will need the usual way, and then save all of it)
+    static string build_table_from_pstrings()
+    {
+      vector<string> values;
+      pstring::for_each_value([&values](const istring& value)
+      {
+        values.push_back(value);
+      });
+      return build_table(vector<istring_view>(values.begin(), values.end()));
+    }
+
+    // Makes the strings in a table from build_table internable without copying or hashing them. The
+    // memory is used in place, so it must be 4 byte aligned and must stay (usually mapped from a file)
+    // for the rest of the program, since its entries are immortal like every other.
+    // Strings that were interned before the table was loaded keep their own entries (they are always
+    // found first), so equal strings are still always the same pointer.
+    // Returns false if the memory isn't a table built for this pool. The header, where each shard's
+    // slots are, and where every slot's entry is (its length header, characters and terminator must
+    // all be within the table) get checked without reading any entry, so the entries stay untouched
+    // until they're used. What the entries hold is trusted.
+    static bool load_table(const void* data, size_t size)
+    {
+      const char* base = static_cast<const char*>(data);
+      if (reinterpret_cast<uintptr_t>(base) % alignof(slot) != 0 || size < sizeof(table_header) + sizeof(table_shard) * shard_count)
+      {
+        return false;
+      }
+
+      table_header header;
+      memcpy(&header, base, sizeof(header));
+      if (header.m_magic != table_magic || header.m_version != table_version ||
+        header.m_shard_count != shard_count || header.m_size != size)
+      {
+        return false;
+      }
+
+      const table_shard* directory = reinterpret_cast<const table_shard*>(base + sizeof(header));
+      for (size_t i = 0; i < shard_count; ++i)
+      {
+        // There must always be an empty slot to end a probe
+        const table_shard& loaded = directory[i];
+        if ((loaded.m_slot_count & (loaded.m_slot_count - 1)) != 0 || loaded.m_slots % alignof(slot) != 0 ||
+          loaded.m_slots > size || (size - loaded.m_slots) / sizeof(slot) < loaded.m_slot_count ||
+          static_cast<uint64_t>(loaded.m_entries) * 4 > static_cast<uint64_t>(loaded.m_slot_count) * 3)
+        {
+          return false;
+        }
+
+        // The used slots must be exactly the entries (which also leaves the empty slots)
+        const slot* slots = reinterpret_cast<const slot*>(base + loaded.m_slots);
+        size_t used = 0;
+        for (size_t j = 0; j < loaded.m_slot_count; ++j)
+        {
+          const slot& checked = slots[j];
+          if (checked.m_location == 0)
+          {
+            continue;
+          }
+
+          if (checked.m_location < sizeof(uint32_t) || checked.m_location % alignof(uint32_t) != 0 ||
+            static_cast<uint64_t>(checked.m_location) + checked.m_length + 1 > size)
+          {
+            return false;
+          }
+          ++used;
+        }
+
+        if (used != loaded.m_entries)
+        {
+          return false;
+        }
+      }
+
+      for (size_t i = 0; i < shard_count; ++i)
+      {
+        get_pool().m_shards[i].add_table(base, directory[i]);
+      }
+      return true;
+    }
+
+  private:
+    friend struct hash<arena_pstring>;
+
+    static const size_t shard_count = 64;
+
+    // Entries are 4 byte aligned, so a location packs the slab with the offset divided by 4
+    // (which lets each shard address 2^18 slabs, or 16GB, with 32 bits)
+    static const size_t slab_shift = 16;
+    static const size_t slab_size = 1 << slab_shift;
+
+    // Where an entry's characters are within a shard's slabs
+    static uint32_t make_location(size_t slab, size_t offset)
+    {
+      return static_cast<uint32_t>((slab << (slab_shift - 2)) | (offset >> 2));
+    }
+
+    // An entry in the table. The slab is only touched to compare characters once the
+    // hash and length already match. A location of 0 marks an empty slot (no characters
+    // are ever at offset 0, since every entry starts with its length). In a loaded table
+    // the location is the offset of the characters from the start of the table instead.
+    struct slot
+    {
+      uint32_t m_location;
+      uint32_t m_length;
+      uint32_t m_hash;
+    };
+
+    // Lengths are kept aligned so they can be read directly
+    static size_t entry_size(size_t length)
+    {
+      return (sizeof(uint32_t) + length + 1 + alignof(uint32_t) - 1) & ~(alignof(uint32_t) - 1);
+    }
+
+    // Finds the characters of the view within a table of slots (resolve turns a location into characters)
+    template <typename Resolve>
+    static const char* probe(const slot* slots, size_t slot_count, const istring_view& view, uint32_t hash32, Resolve resolve)
+    {
+      if (slot_count == 0)
+      {
+        return nullptr;
+      }
+
+      size_t mask = slot_count - 1;
+      for (size_t i = hash32 & mask; slots[i].m_location != 0; i = (i + 1) & mask)
+      {
+        const slot& found = slots[i];
+        if (found.m_hash == hash32 && found.m_length == view.size())
+        {
+          const char* data = resolve(found.m_location);
+          if (memcmp(data, view.data(), view.size()) == 0)
+          {
+            return data;
+          }
+        }
+      }
+      return nullptr;
+    }
+
+    static void place(vector<slot>& slots, const slot& placed)
+    {
+      size_t mask = slots.size() - 1;
+      size_t i = placed.m_hash & mask;
+      while (slots[i].m_location != 0)
+      {
+        i = (i + 1) & mask;
+      }
+      slots[i] = placed;
+    }
+
+    // Which shard a string goes in (a loaded table has to agree with the pool)
+    static size_t shard_of(size_t hash)
+    {
+      // The shard uses the low bits of the hash, so pick it with the mixed high bits
+      uint64_t mixed = static_cast<uint64_t>(hash) * 0x9E3779B97F4A7C15ull;
+      return (mixed >> 32) % shard_count;
+    }
+
+    static const uint32_t table_magic = 0x54534B53;
+    static const uint32_t table_version = 1;
+
+    // The start of a table from build_table (every offset in it is from the start of the table)
+    struct table_header
+    {
+      uint32_t m_magic;
+      uint32_t m_version;
+      uint32_t m_shard_count;
+      uint32_t m_size;
+    };
+
+    // Follows the header once for each shard
+    struct table_shard
+    {
+      // The offset of the shard's slots, and how many there are (a power of two, or 0)
+      uint32_t m_slots;
+      uint32_t m_slot_count;
+      uint32_t m_entries;
+    };
+
+    class shard
+    {
+    public:
+      shard() :
+        m_count(0),
+        m_slab_used(slab_size),
+        m_slab_capacity(slab_size)
+      {
+      }
+
+      const char* intern(const istring_view& view, size_t hash)
+      {
+        lock_guard<mutex> guard(m_mutex);
+
+        uint32_t length = static_cast<uint32_t>(view.size());
+        uint32_t hash32 = static_cast<uint32_t>(hash);
+        const char* found = probe(m_slots.data(), m_slots.size(), view, hash32, [this](uint32_t location)
+        {
+          return resolve(location);
+        });
+
+        // Loaded tables are only searched after our own entries (and in the order they were loaded)
+        for (size_t i = 0; !found && i < m_tables.size(); ++i)
+        {
+          const loaded_table& table = m_tables[i];
+          found = probe(table.m_slots, table.m_slot_count, view, hash32, [&table](uint32_t location)
+          {
+            return table.m_base + location;
+          });
+        }
+
+        if (found)
+        {
+          return found;
+        }
+
+        // Keep the table at most three quarters full
+        if ((m_count + 1) * 4 > m_slots.size() * 3)
+        {
+          grow();
+        }
+
+        slot created;
+        created.m_location = append(view);
+        created.m_length = length;
+        created.m_hash = hash32;
+        place(m_slots, created);
+        ++m_count;
+        return resolve(created.m_location);
+      }
+
+      void add_table(const char* base, const table_shard& loaded)
+      {
+        if (loaded.m_slot_count == 0)
+        {
+          return;
+        }
+
+        loaded_table table;
+        table.m_base = base;
+        table.m_slots = reinterpret_cast<const slot*>(base + loaded.m_slots);
+        table.m_slot_count = loaded.m_slot_count;
+        table.m_entries = loaded.m_entries;
+
+        lock_guard<mutex> guard(m_mutex);
+        m_tables.push_back(table);
+      }
+
+      void add_stats(arena_pstring_stats& stats)
+      {
+        lock_guard<mutex> guard(m_mutex);
+        stats.m_entries += m_count;
+        for (const loaded_table& table : m_tables)
+        {
+          stats.m_entries += table.m_entries;
+          stats.m_mapped_entries += table.m_entries;
+        }
+        stats.m_table_bytes += m_slots.size() * sizeof(slot);
+        for (size_t i = 0; i < m_slab_sizes.size(); ++i)
+        {
+          stats.m_slab_bytes += m_slab_sizes[i];
+          stats.m_used_slab_bytes += (i + 1 == m_slab_sizes.size()) ? m_slab_used : m_slab_sizes[i];
+        }
+      }
+
+    private:
+      const char* resolve(uint32_t location) const
+      {
+        size_t offset = (location & ((1 << (slab_shift - 2)) - 1)) << 2;
+        return m_slabs[location >> (slab_shift - 2)].get() + offset;
+      }
+
+      // Copies the characters (after their length, and followed by a null) to the end of the current slab
+      uint32_t append(const istring_view& view)
+      {
+        uint32_t length = static_cast<uint32_t>(view.size());
+        size_t needed = entry_size(view.size());
+        if (m_slab_capacity - m_slab_used < needed)
+        {
+          // Strings too big for a normal slab get a slab of their own (they are
+          // always at the start of it, so their offset still fits in a location)
+          m_slab_capacity = max(needed, static_cast<size_t>(slab_size));
+          m_slabs.push_back(unique_ptr<char[]>(new char[m_slab_capacity]));
+          m_slab_sizes.push_back(m_slab_capacity);
+          m_slab_used = 0;
+        }
+
+        char* entry = m_slabs.back().get() + m_slab_used;
+        memcpy(entry, &length, sizeof(length));
+        memcpy(entry + sizeof(length), view.data(), view.size());
+        entry[sizeof(length) + view.size()] = '\0';
+
+        uint32_t location = make_location(m_slabs.size() - 1, m_slab_used + sizeof(length));
+        m_slab_used += needed;
+        return location;
+      }
+
+      // Every slot remembers its hash, so growing never has to look at the characters
+      void grow()
+      {
+        vector<slot> slots(max<size_t>(16, m_slots.size() * 2));
+        for (const slot& moved : m_slots)
+        {
+          if (moved.m_location != 0)
+          {
+            place(slots, moved);
+          }
+        }
+        m_slots.swap(slots);
+      }
+
+      // A shard's part of a table that was loaded in place
+      struct loaded_table
+      {
+        const char* m_base;
+        const slot* m_slots;
+        size_t m_slot_count;
+        size_t m_entries;
+      };
+
+      mutex m_mutex;
+      vector<slot> m_slots;
+      size_t m_count;
+      vector<unique_ptr<char[]>> m_slabs;
+      vector<size_t> m_slab_sizes;
+      size_t m_slab_used;
+      size_t m_slab_capacity;
+      vector<loaded_table> m_tables;
+    };
+
+    class shared_pool
+    {
+    public:
+      const char* intern(const istring_view& view, size_t hash)
+      {
+        return m_shards[shard_of(hash)].intern(view, hash);
+      }
+
+      arena_pstring_stats get_stats()
+      {
+        arena_pstring_stats stats = {};
+        for (shard& each : m_shards)
+        {
+          each.add_stats(stats);
+        }
+        return stats;
+      }
+
+      shard m_shards[shard_count];
+    };
+
+    static shared_pool& get_pool()
+    {
+      static shared_pool instance;
+      return instance;
+    }
+
+    static const char* empty_data()
+    {
+      static const char* empty = get_pool().intern(istring_view("", 0), istring_hash("", 0));
+      return empty;
+    }
+
+    const char* m_data;
+  };
+
+  template <>
+  struct hash<arena_pstring>
+  {
+    typedef arena_pstring argument_type;
+    typedef size_t result_type;
+    result_type operator()(const argument_type& value) const
+    {
+      // Hash the pointer since we know all interned strings are shared (and entries are 4 byte aligned)
+      return reinterpret_cast<size_t>(value.m_data) >> 2;
+    }
+  };
+}
@@ -4,8 +4,14 @@
 #pragma once
 
 #include <cassert>
+#include <climits>
+#include <cstdint>
+#include <cstring>
 #include <utility>
-#include <unordered_map>
+#include <memory>
+#include <atomic>
+#include <algorithm>
+#include <vector>
 #include <mutex>
 
 #ifndef __stl_assert
@@ -18,35 +24,83 @@
 
 namespace std
 {
+  // Passed to a pooled constructor along with a hash that was computed ahead of time
+  struct prehashed_t
+  {
+  };
+
+  // Passed to a pooled constructor to pin the value as it's interned (see pooled::pin)
+  struct pinned_t
+  {
+  };
+
+  // How often a thread's intern cache found what was being interned (see pooled::set_thread_cache_enabled)
+  struct pooled_cache_stats
+  {
+    size_t m_hits;
+    size_t m_misses;
+  };
+
+  // How much memory a pool's own structures take (see pooled::get_memory_stats)
+  struct pooled_memory_stats
+  {
+    // Entries in the pool (dead ones included, since they still hold their memory)
+    size_t m_values;
+
+    // The entries themselves, each of which holds its value inline
+    size_t m_node_bytes;
+
+    // The buckets, id tables and lists of dead entries of every shard
+    size_t m_table_bytes;
+  };
+
   // A pooled object is allocated and shared with all other objects that
   // are equal and hash to the same value. Since a pooled object is shared
   // it is considered immutable (hence we only return a const interface).
   // Note that the default constructor for a pooled object will always
   // construct a default T. A pooled object is never null and will always
   // at least point at a default constructed instance of T (e.g. when moved).
+  // The pool is split into ShardCount shards (selected by the hash of the value), each with
+  // its own lock and table, so that threads interning different values rarely contend.
+  // Reference counts are atomic, so copying and destroying a pooled object only takes
+  // the lock when the last reference goes away.
+  // Every value in the pool also has a 32-bit id, so tables keyed by pooled objects can be flat
+  // arrays indexed by id. Each shard hands out its own ids (every ShardCount-th one, reusing those of
+  // values that left), so ids stay dense as long as the hash spreads values evenly over the shards.
+  // Threads that intern the same values over and over can turn on a small cache of their own,
+  // which finds recently interned values without taking any lock.
+  // Values that live for the whole program can be pinned, after which copying and destroying
+  // them no longer touches their reference count at all.
+  // Releases can also be deferred (see defer_release), so values that are dropped and interned
+  // again soon after are brought back instead of being freed and allocated each time.
   template <
     typename T,
     typename Hash = hash<T>,
     typename KeyEqual = equal_to<T>,
-    typename Allocator = allocator<pair<T, int>>>
+    typename Allocator = allocator<pair<T, int>>,
+    size_t ShardCount = 64>
   class pooled
   {
   public:
-    friend struct hash<pooled<T, Hash, KeyEqual, Allocator>>;
+    friend struct hash<pooled<T, Hash, KeyEqual, Allocator, ShardCount>>;
 
     pooled(pooled& rhs) :
       pooled(const_cast<const pooled&>(rhs))
     {
     }
 
-    pooled(const pooled& rhs)
+    // Moving a const pooled object (like the key of a map's pair) is a copy, not an intern
+    pooled(const pooled&& rhs) :
+      pooled(static_cast<const pooled&>(rhs))
     {
-      m_pair = rhs.m_pair;
-
-      shared_pool& pool = get_pool();
-      lock_guard<mutex> guard(pool.m_mutex);
+    }
 
-      ++m_pair->second;
+    pooled(const pooled& rhs)
+    {
+      // Whoever we copy from already holds a reference, so the node can't
+      // go away underneath us and we never need the shard's lock
+      m_node = rhs.m_node;
+      add_reference(m_node);
     }
 
     pooled(pooled&& rhs)
@@ -54,9 +108,9 @@ namespace std
       // PERFORMANCE (trevor): We could cache a direct pointer to a default
       // constructed instance on the pool to make this even faster.
 
-      m_pair = rhs.m_pair;
+      m_node = rhs.m_node;
       
-      rhs.m_pair = nullptr;
+      rhs.m_node = nullptr;
       rhs = pooled();
     }
 
@@ -71,98 +125,728 @@ namespace std
     template <typename... Args>
     pooled(Args&&... args)
     {
-      T value(std::forward<Args>(args)...);
-      shared_pool& pool = get_pool();
-      lock_guard<mutex> guard(pool.m_mutex);
-      
-      auto it = pool.m_map.find(value);
-      if (it != pool.m_map.end())
+      intern(lookup_by_argument<Args...>(), std::forward<Args>(args)...);
+    }
+
+    // The hash must be exactly what Hash would have returned for the key
+    template <typename Key>
+    pooled(prehashed_t, size_t hash, Key&& key)
+    {
+      intern_hashed(hash, std::forward<Key>(key));
+    }
+
+    template <typename... Args>
+    pooled(pinned_t, Args&&... args) :
+      pooled(std::forward<Args>(args)...)
+    {
+      pin();
+    }
+
+    template <typename Key>
+    pooled(pinned_t, prehashed_t, size_t hash, Key&& key) :
+      pooled(prehashed_t(), hash, std::forward<Key>(key))
+    {
+      pin();
+    }
+
+    ~pooled()
+    {
+      // This only happens during the move constructor when
+      // operator= explicitly calls the destructor ~pooled()
+      if (m_node)
+      {
+        release(m_node);
+      }
+    }
+
+    // Turns the calling thread's intern cache on or off. The cache holds the 8192 values the thread
+    // interned most recently (in 128KB), and each slot holds a reference to its value, so a value can't
+    // leave the pool while a thread has it cached (it leaves once it's evicted, or the cache is turned
+    // off, or the thread exits). Hits still hash and compare the value, but take no lock.
+    // Only turn it on for threads that intern the same few thousand values over and over (like a
+    // script VM resolving names), where it saves a lock and a bucket walk on almost every intern.
+    // A miss costs a little more than no cache at all, so threads that mostly intern new values,
+    // or that work through far more distinct values than the cache holds, are better off without it.
+    static void set_thread_cache_enabled(bool enabled)
+    {
+      unique_ptr<thread_cache>& cache = get_thread_cache();
+      if (enabled && !cache)
       {
-        // We're adding another reference to this pooled argument
-        ++it->second;
+        cache.reset(new thread_cache());
       }
-      else
+      else if (!enabled)
       {
-        // Move the value into the pool and start our reference count at 1
-        it = pool.m_map.insert(it, make_pair(move(value), 1));
+        cache.reset();
       }
-      
-      // Our class is very optimal because it stores a direct pointer
-      // and uses that pointer for all comparisons, hashing, etc!
-      m_pair = &*it;
     }
 
-    ~pooled()
+    // Counts for the calling thread since its cache was turned on
+    static pooled_cache_stats get_thread_cache_stats()
     {
-      // This only happens during the move constructor when
-      // operator= explicitly calls the destructor ~pooled()
-      if (!m_pair)
+      unique_ptr<thread_cache>& cache = get_thread_cache();
+      pooled_cache_stats empty = {};
+      return cache ? cache->m_stats : empty;
+    }
+
+    // Keeps the value in the pool for the rest of the program. From then on copies and destruction
+    // of every pooled object with this value skip the reference count (which stays negative, so no
+    // amount of racing copies or releases can ever bring it back to zero).
+    void pin() const
+    {
+      m_node->m_count.store(pinned_count, memory_order_relaxed);
+    }
+
+    bool is_pinned() const
+    {
+      return m_node->m_count.load(memory_order_relaxed) < 0;
+    }
+
+    // From now on, values whose last reference goes away stay in the pool as dead entries until
+    // they're collected, and interning a dead value again brings it back without allocating. Each
+    // shard collects its own dead entries once it has threshold of them, and collect() does the
+    // rest. A threshold of 0 goes back to freeing values right away (and collects every dead entry).
+    static void defer_release(size_t threshold)
+    {
+      get_pool().m_defer_threshold.store(threshold, memory_order_relaxed);
+      if (threshold == 0)
       {
-        return;
+        collect();
       }
+    }
 
+    // Frees dead entries (looking at no more than budget of them) and returns how many were freed.
+    // Each call picks up with the shard after the last one it looked at, so a small budget can be
+    // spent every frame and still get through the whole pool.
+    static size_t collect(size_t budget = SIZE_MAX)
+    {
       shared_pool& pool = get_pool();
-      lock_guard<mutex> guard(pool.m_mutex);
+      size_t freed = 0;
+      for (size_t i = 0; i < ShardCount && budget != 0; ++i)
+      {
+        shard& swept = pool.m_shards[pool.m_next_collected.fetch_add(1, memory_order_relaxed) % ShardCount];
+        lock_guard<mutex> guard(swept.m_mutex);
+        freed += swept.sweep(budget);
+      }
+      return freed;
+    }
 
-      auto it = pool.m_map.find(m_pair->first);
-      __stl_assert(it != pool.m_map.end(),
-        "The pooled object was not within the pool's map");
-      
-      // Since we're being destructed, we can release a reference
-      --it->second;
-      if (it->second == 0)
+    // Calls function with each value in the pool (one shard at a time while holding its lock, so
+    // the function must not intern or release values of this type). Dead entries are skipped.
+    template <typename Function>
+    static void for_each_value(Function function)
+    {
+      for (shard& visited : get_pool().m_shards)
       {
-        // Remove the object from the pool entirely
-        pool.m_map.erase(it);
+        lock_guard<mutex> guard(visited.m_mutex);
+        visited.for_each_value(function);
+      }
+    }
+
+    // Only counts what the pool allocates itself, so values that allocate memory of their own (like
+    // strings too long to be stored inline) take that much more. Takes each shard's lock in turn.
+    static pooled_memory_stats get_memory_stats()
+    {
+      pooled_memory_stats stats = {};
+      for (shard& counted : get_pool().m_shards)
+      {
+        lock_guard<mutex> guard(counted.m_mutex);
+        counted.add_memory_stats(stats);
+      }
+      return stats;
+    }
+
+    // Unique among the values currently in the pool, and less than id_bound()
+    uint32_t id() const
+    {
+      return m_node->m_id;
+    }
+
+    // Returns the value with the given id, which must currently be in the pool
+    static pooled from_id(uint32_t id)
+    {
+      shard& owner = get_pool().m_shards[id % ShardCount];
+      node* found = nullptr;
+      {
+        lock_guard<mutex> guard(owner.m_mutex);
+        found = owner.add_reference(id);
+      }
+      if (!found)
+      {
+        __stl_assert(false, "No value in the pool has this id");
+        return pooled();
       }
+      return pooled(found);
+    }
+
+    // One more than the highest id that has been handed out (the size a table indexed by id needs)
+    static uint32_t id_bound()
+    {
+      uint32_t bound = 0;
+      for (shard& counted : get_pool().m_shards)
+      {
+        bound = max(bound, counted.m_id_bound.load(memory_order_relaxed));
+      }
+      return bound;
     }
 
     const T& operator*() const
     {
-      return m_pair->first;
+      return m_node->m_value;
     }
 
     const T* operator->() const
     {
-      return &m_pair->first;
+      return &m_node->m_value;
     }
 
     bool operator==(const pooled& rhs) const
     {
-      return m_pair == rhs.m_pair;
+      return m_node == rhs.m_node;
     }
 
     bool operator!=(const pooled& rhs) const
     {
-      return m_pair != rhs.m_pair;
+      return m_node != rhs.m_node;
     }
 
     bool operator<(const pooled& rhs) const
     {
-      return m_pair < rhs.m_pair;
+      return m_node < rhs.m_node;
     }
 
     bool operator<=(const pooled& rhs) const
     {
-      return m_pair <= rhs.m_pair;
+      return m_node <= rhs.m_node;
     }
 
     bool operator>(const pooled& rhs) const
     {
-      return m_pair > rhs.m_pair;
+      return m_node > rhs.m_node;
     }
 
     bool operator>=(const pooled& rhs) const
     {
-      return m_pair >= rhs.m_pair;
+      return m_node >= rhs.m_node;
     }
 
   private:
-    class shared_pool
+    class node;
+
+    // Adopts a reference that was already added to the node
+    explicit pooled(node* adopted) :
+      m_node(adopted)
+    {
+    }
+
+    template <typename Function, typename = void>
+    struct is_transparent : false_type
+    {
+    };
+
+    template <typename Function>
+    struct is_transparent<Function, typename conditional<true, void, typename Function::is_transparent>::type> : true_type
+    {
+    };
+
+    // When the hash and equality are transparent (like the heterogeneous lookup of the standard
+    // containers) a single argument is looked up as is, and a T is only constructed from it on a miss
+    template <typename... Args>
+    struct lookup_by_argument : false_type
+    {
+    };
+
+    template <typename Arg>
+    struct lookup_by_argument<Arg> :
+      integral_constant<bool, is_transparent<Hash>::value && is_transparent<KeyEqual>::value>
+    {
+    };
+
+    template <typename Key>
+    void intern(true_type, Key&& key)
+    {
+      size_t hash = Hash()(key);
+      intern_hashed(hash, std::forward<Key>(key));
+    }
+
+    template <typename Key>
+    void intern_hashed(size_t hash, Key&& key)
+    {
+      thread_cache* cache = get_thread_cache().get();
+      if (cache)
+      {
+        m_node = cache->find(hash, key);
+        if (m_node)
+        {
+          return;
+        }
+      }
+
+      {
+        shard& owner = get_shard(hash);
+        lock_guard<mutex> guard(owner.m_mutex);
+
+        m_node = owner.find(key, hash);
+        if (m_node)
+        {
+          // We're adding another reference to this pooled argument (which also brings
+          // back a dead entry, since nothing but the lock we hold can touch a count of 0)
+          add_reference(m_node);
+        }
+        else
+        {
+          // Move the value into the pool and start our reference count at 1
+          m_node = owner.insert(T(std::forward<Key>(key)), hash);
+        }
+      }
+
+      // Outside of the lock, since evicting may release a value in another shard
+      if (cache)
+      {
+        cache->store(hash, m_node);
+      }
+    }
+
+    // Pinned values never leave the pool, so their count is left alone
+    static const int pinned_count = INT_MIN / 2;
+
+    static void add_reference(node* referenced)
+    {
+      if (referenced->m_count.load(memory_order_relaxed) >= 0)
+      {
+        referenced->m_count.fetch_add(1, memory_order_relaxed);
+      }
+    }
+
+    static void release(node* released)
+    {
+      // Releasing a reference that isn't the last one never needs the lock
+      int count = released->m_count.load(memory_order_relaxed);
+      if (count < 0)
+      {
+        return;
+      }
+
+      while (count > 1)
+      {
+        if (released->m_count.compare_exchange_weak(count, count - 1, memory_order_release, memory_order_relaxed))
+        {
+          return;
+        }
+      }
+
+      // We may hold the last reference, but only the lock stops another thread from
+      // finding the value in the pool (and adding a reference) while we remove it
+      shard& owner = get_shard(released->m_hash);
+      lock_guard<mutex> guard(owner.m_mutex);
+      if (released->m_count.fetch_sub(1, memory_order_acq_rel) != 1)
+      {
+        return;
+      }
+
+      size_t threshold = get_pool().m_defer_threshold.load(memory_order_relaxed);
+      if (threshold == 0)
+      {
+        // Remove the object from the pool entirely
+        owner.erase(released);
+        return;
+      }
+
+      // Leave it to be collected (it may have died, come back, and died again before then)
+      if (!released->m_dead)
+      {
+        released->m_dead = true;
+        owner.m_dead.push_back(released);
+      }
+      if (owner.m_dead.size() >= threshold)
+      {
+        size_t budget = SIZE_MAX;
+        owner.sweep(budget);
+      }
+    }
+
+    template <typename... Args>
+    void intern(false_type, Args&&... args)
+    {
+      intern(true_type(), T(std::forward<Args>(args)...));
+    }
+
+    // Every value in the pool is its own node in its shard's table. The node remembers
+    // its hash so that destruction can find and unlink it without hashing the value again
+    // (only the low 32 bits, which is all the shard and the buckets use, so the dead flag
+    // fits in what would otherwise be padding).
+    class node
+    {
+    public:
+      node(T&& value, size_t hash) :
+        m_value(move(value)),
+        m_count(1),
+        m_id(0),
+        m_hash(static_cast<uint32_t>(hash)),
+        m_dead(false),
+        m_next(nullptr)
+      {
+      }
+
+      T m_value;
+      atomic<int> m_count;
+      uint32_t m_id;
+      uint32_t m_hash;
+
+      // Whether the node is on its shard's list of dead entries (only touched under the shard's lock)
+      bool m_dead;
+      node* m_next;
+    };
+
+    typedef typename allocator_traits<Allocator>::template rebind_alloc<node> node_allocator;
+    typedef typename allocator_traits<Allocator>::template rebind_alloc<node*> bucket_allocator;
+    typedef typename allocator_traits<Allocator>::template rebind_alloc<uint32_t> id_allocator;
+
+    // A chained hash table of nodes (only touched while holding the shard's lock)
+    // The shard also hands out the ids of its nodes and maps them back, so a value entering or
+    // leaving the pool only ever takes its own shard's lock.
+    class shard
     {
     public:
-      unordered_map<T, int, Hash, KeyEqual, Allocator> m_map;
+      shard() :
+        m_id_bound(0),
+        m_index(0),
+        m_size(0)
+      {
+      }
+
+      ~shard()
+      {
+        for (node* bucket : m_buckets)
+        {
+          while (bucket)
+          {
+            node* next = bucket->m_next;
+            destroy(bucket);
+            bucket = next;
+          }
+        }
+      }
+
+      template <typename Key>
+      node* find(const Key& key, size_t hash) const
+      {
+        if (m_buckets.empty())
+        {
+          return nullptr;
+        }
+
+        for (node* it = m_buckets[hash & (m_buckets.size() - 1)]; it; it = it->m_next)
+        {
+          if (it->m_hash == static_cast<uint32_t>(hash) && KeyEqual()(it->m_value, key))
+          {
+            return it;
+          }
+        }
+        return nullptr;
+      }
+
+      node* insert(T&& value, size_t hash)
+      {
+        if (m_size >= m_buckets.size())
+        {
+          grow();
+        }
+
+        node* created = allocator_traits<node_allocator>::allocate(m_allocator, 1);
+        allocator_traits<node_allocator>::construct(m_allocator, created, move(value), hash);
+
+        node*& bucket = m_buckets[hash & (m_buckets.size() - 1)];
+        created->m_next = bucket;
+        bucket = created;
+        ++m_size;
+
+        created->m_id = acquire_id(created);
+        return created;
+      }
+
+      void erase(node* erased)
+      {
+        node** link = &m_buckets[erased->m_hash & (m_buckets.size() - 1)];
+        while (*link != erased)
+        {
+          __stl_assert(*link, "The pooled object was not within the pool's table");
+          link = &(*link)->m_next;
+        }
+
+        *link = erased->m_next;
+        --m_size;
+
+        // Only when deferring was turned off after it died, came back, and is now dying again
+        if (erased->m_dead)
+        {
+          typename vector<node*, bucket_allocator>::iterator listed = std::find(m_dead.begin(), m_dead.end(), erased);
+          *listed = m_dead.back();
+          m_dead.pop_back();
+        }
+
+        // Must happen before the node is destroyed
+        uint32_t local = erased->m_id / ShardCount;
+        m_ids[local] = nullptr;
+        m_free_ids.push_back(local);
+        destroy(erased);
+      }
+
+      // Returns null if the id isn't in use, or if its value is dead or in the middle of leaving
+      // the pool (its count already hit zero, so only interning it again can bring it back)
+      node* add_reference(uint32_t id)
+      {
+        uint32_t local = id / ShardCount;
+        node* found = local < m_ids.size() ? m_ids[local] : nullptr;
+        if (!found)
+        {
+          return nullptr;
+        }
+
+        int count = found->m_count.load(memory_order_relaxed);
+        do
+        {
+          if (count == 0)
+          {
+            return nullptr;
+          }
+          if (count < 0)
+          {
+            return found;
+          }
+        } while (!found->m_count.compare_exchange_weak(count, count + 1, memory_order_relaxed));
+        return found;
+      }
+
+      // Frees the dead entries that are still dead (looking at no more than budget of them,
+      // and taking that many off the budget) and returns how many were freed
+      size_t sweep(size_t& budget)
+      {
+        size_t freed = 0;
+        for (; budget != 0 && !m_dead.empty(); --budget)
+        {
+          node* swept = m_dead.back();
+          m_dead.pop_back();
+          swept->m_dead = false;
+
+          // Interning it again since it died brought it back
+          if (swept->m_count.load(memory_order_relaxed) == 0)
+          {
+            erase(swept);
+            ++freed;
+          }
+        }
+        return freed;
+      }
+
+      void add_memory_stats(pooled_memory_stats& stats) const
+      {
+        stats.m_values += m_size;
+        stats.m_node_bytes += m_size * sizeof(node);
+        stats.m_table_bytes += (m_buckets.capacity() + m_ids.capacity() + m_dead.capacity()) * sizeof(node*) +
+          m_free_ids.capacity() * sizeof(uint32_t);
+      }
+
+      template <typename Function>
+      void for_each_value(Function& function) const
+      {
+        for (node* bucket : m_buckets)
+        {
+          for (; bucket; bucket = bucket->m_next)
+          {
+            if (bucket->m_count.load(memory_order_relaxed) != 0)
+            {
+              function(static_cast<const T&>(bucket->m_value));
+            }
+          }
+        }
+      }
+
       mutex m_mutex;
+
+      // Nodes whose count hit zero while releases were deferred (some may have come back since)
+      vector<node*, bucket_allocator> m_dead;
+
+      // One more than the highest id this shard has handed out (read without the lock by id_bound)
+      atomic<uint32_t> m_id_bound;
+
+      // Where we are in the pool's shards (our ids are all this modulo ShardCount)
+      uint32_t m_index;
+
+    private:
+      uint32_t acquire_id(node* owner)
+      {
+        uint32_t local = 0;
+        if (!m_free_ids.empty())
+        {
+          local = m_free_ids.back();
+          m_free_ids.pop_back();
+          m_ids[local] = owner;
+        }
+        else
+        {
+          local = static_cast<uint32_t>(m_ids.size());
+          m_ids.push_back(owner);
+          m_id_bound.store(local * ShardCount + m_index + 1, memory_order_relaxed);
+        }
+        return local * ShardCount + m_index;
+      }
+
+      // The number of buckets is always a power of two (so we can mask the hash)
+      void grow()
+      {
+        vector<node*, bucket_allocator> buckets(max<size_t>(8, m_buckets.size() * 2), nullptr);
+        for (node* bucket : m_buckets)
+        {
+          while (bucket)
+          {
+            node* next = bucket->m_next;
+            node*& moved = buckets[bucket->m_hash & (buckets.size() - 1)];
+            bucket->m_next = moved;
+            moved = bucket;
+            bucket = next;
+          }
+        }
+        m_buckets.swap(buckets);
+      }
+
+      void destroy(node* destroyed)
+      {
+        allocator_traits<node_allocator>::destroy(m_allocator, destroyed);
+        allocator_traits<node_allocator>::deallocate(m_allocator, destroyed, 1);
+      }
+
+      vector<node*, bucket_allocator> m_buckets;
+      size_t m_size;
+      node_allocator m_allocator;
+
+      // Our nodes indexed by id / ShardCount (null for ids on the free list)
+      vector<node*, bucket_allocator> m_ids;
+      vector<uint32_t, id_allocator> m_free_ids;
+    };
+
+    // Two way set associative (the most recently used way of each set comes first), since a direct
+    // mapped cache loses too many hot values to collisions once a thread's values near its size
+    class thread_cache
+    {
+    public:
+      thread_cache() :
+        m_stats()
+      {
+        memset(m_sets, 0, sizeof(m_sets));
+      }
+
+      ~thread_cache()
+      {
+        for (cache_set& cached : m_sets)
+        {
+          for (slot& way : cached.m_ways)
+          {
+            if (way.m_node)
+            {
+              release(way.m_node);
+            }
+          }
+        }
+      }
+
+      // Adds a reference for the caller if the value is cached
+      template <typename Key>
+      node* find(size_t hash, const Key& key)
+      {
+        cache_set& cached = m_sets[index_of(hash)];
+        for (size_t i = 0; i < way_count; ++i)
+        {
+          slot& way = cached.m_ways[i];
+          if (way.m_node && way.m_hash == hash && KeyEqual()(way.m_node->m_value, key))
+          {
+            ++m_stats.m_hits;
+            node* found = way.m_node;
+            add_reference(found);
+            if (i != 0)
+            {
+              std::swap(cached.m_ways[0], way);
+            }
+            return found;
+          }
+        }
+
+        ++m_stats.m_misses;
+        return nullptr;
+      }
+
+      // Replaces the least recently used way of the set
+      void store(size_t hash, node* stored)
+      {
+        cache_set& cached = m_sets[index_of(hash)];
+        node* evicted = cached.m_ways[way_count - 1].m_node;
+        for (size_t i = way_count - 1; i != 0; --i)
+        {
+          cached.m_ways[i] = cached.m_ways[i - 1];
+        }
+
+        add_reference(stored);
+        cached.m_ways[0].m_node = stored;
+        cached.m_ways[0].m_hash = hash;
+
+        if (evicted)
+        {
+          release(evicted);
+        }
+      }
+
+      pooled_cache_stats m_stats;
+
+    private:
+      static const size_t set_count = 4096;
+      static const size_t way_count = 2;
+
+      struct slot
+      {
+        node* m_node;
+        size_t m_hash;
+      };
+
+      struct cache_set
+      {
+        slot m_ways[way_count];
+      };
+
+      // Mixes the hash in case it's weak in its low bits
+      static size_t index_of(size_t hash)
+      {
+        uint64_t mixed = static_cast<uint64_t>(hash) * 0x9E3779B97F4A7C15ull;
+        return static_cast<size_t>(mixed >> 32) & (set_count - 1);
+      }
+
+      cache_set m_sets[set_count];
+    };
+
+    static unique_ptr<thread_cache>& get_thread_cache()
+    {
+      static thread_local unique_ptr<thread_cache> instance;
+      return instance;
+    }
+
+    class shared_pool
+    {
+    public:
+      shared_pool() :
+        m_defer_threshold(0),
+        m_next_collected(0)
+      {
+        for (size_t i = 0; i < ShardCount; ++i)
+        {
+          m_shards[i].m_index = static_cast<uint32_t>(i);
+        }
+      }
+
+      shard m_shards[ShardCount];
+
+      // 0 when releases aren't deferred
+      atomic<size_t> m_defer_threshold;
+
+      // Where the next collect starts
+      atomic<size_t> m_next_collected;
     };
     
     static shared_pool& get_pool()
@@ -171,23 +855,31 @@ namespace std
       return instance;
     }
 
-    pair<const T, int>* m_pair;
+    static shard& get_shard(size_t hash)
+    {
+      // Mix the hash so that the shard doesn't only depend on the low bits (which the table's buckets use)
+      uint64_t mixed = static_cast<uint64_t>(static_cast<uint32_t>(hash)) * 0x9E3779B97F4A7C15ull;
+      return get_pool().m_shards[(mixed >> 32) % ShardCount];
+    }
+
+    node* m_node;
   };
 
   template <
     typename T,
     typename Hash,
     typename KeyEqual,
-    typename Allocator>
-  struct hash<pooled<T, Hash, KeyEqual, Allocator>>
+    typename Allocator,
+    size_t ShardCount>
+  struct hash<pooled<T, Hash, KeyEqual, Allocator, ShardCount>>
   {
-    typedef pooled<T, Hash, KeyEqual, Allocator> argument_type;
+    typedef pooled<T, Hash, KeyEqual, Allocator, ShardCount> argument_type;
     typedef size_t result_type;
     result_type operator()(const argument_type& value) const
     {
       // Hash the pointer since we know all pooled objects are shared!
       static const size_t shift = (size_t)log2(1 + sizeof(argument_type));
-      return (size_t)(value.m_pair) >> shift;
+      return (size_t)(value.m_node) >> shift;
     }
   };
 }
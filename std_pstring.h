@@ -4,10 +4,89 @@
 #pragma once
 
 #include <string>
+#include <cstdint>
+#include <cstring>
 #include "std_pool.h"
 
 namespace std
 {
+  constexpr uint64_t istring_hash_byte(const char* data, size_t index)
+  {
+    return static_cast<uint64_t>(static_cast<unsigned char>(data[index])) << (index * 8);
+  }
+
+  // Hashes 8 characters at a time (read as a little endian word, in a way that is allowed at compile time
+  // and that compilers turn into a single load) and finishes with the murmur3 mix. This is a constexpr
+  // function so that literals can be hashed at compile time and still match strings hashed at runtime.
+  constexpr size_t istring_hash(const char* data, size_t size)
+  {
+    uint64_t hash = 0x9E3779B97F4A7C15ull ^ size;
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8)
+    {
+      const char* word = data + i;
+      hash ^= istring_hash_byte(word, 0) | istring_hash_byte(word, 1) | istring_hash_byte(word, 2) |
+        istring_hash_byte(word, 3) | istring_hash_byte(word, 4) | istring_hash_byte(word, 5) |
+        istring_hash_byte(word, 6) | istring_hash_byte(word, 7);
+      hash *= 0xFF51AFD7ED558CCDull;
+      hash ^= hash >> 32;
+    }
+
+    uint64_t tail = 0;
+    for (size_t j = 0; i + j < size; ++j)
+    {
+      tail |= istring_hash_byte(data + i, j);
+    }
+    hash ^= tail;
+
+    hash *= 0xC4CEB9FE1A85EC53ull;
+    hash ^= hash >> 33;
+    hash *= 0xFF51AFD7ED558CCDull;
+    hash ^= hash >> 33;
+    return static_cast<size_t>(hash);
+  }
+
+  // Characters that something else owns, used to look up interned strings without building a string
+  // first (pstring can be constructed from a view, a const char*, or a string, and on a hit none of
+  // those allocate). The characters must outlive the view.
+  class istring_view
+  {
+  public:
+    istring_view(const char* data) :
+      m_data(data),
+      m_size(strlen(data))
+    {
+    }
+
+    istring_view(const char* data, size_t size) :
+      m_data(data),
+      m_size(size)
+    {
+    }
+
+    istring_view(const string& value) :
+      m_data(value.data()),
+      m_size(value.size())
+    {
+    }
+
+    const char* data() const
+    {
+      return m_data;
+    }
+
+    size_t size() const
+    {
+      return m_size;
+    }
+
+  private:
+    const char* m_data;
+    size_t m_size;
+  };
+
+  class pstring_view;
+
   // Extend the string interface with some immutable const functions
   // This is intended to work directly with pstring.
   class istring : public string
@@ -40,7 +119,12 @@ namespace std
     }
 
     istring(istring&& rhs) :
-      string(rhs)
+      string(move(rhs))
+    {
+    }
+
+    explicit istring(const istring_view& view) :
+      string(view.data(), view.size())
     {
     }
 
@@ -48,17 +132,36 @@ namespace std
     {
       return pooled<istring>(move(string::substr(pos, len)));
     }
+
+    // Like substr, but a view of our characters rather than a new interned string, so it never
+    // allocates. The view only lives as long as we do (call intern on it to keep it).
+    pstring_view slice(size_t pos = 0, size_t len = npos) const;
   };
 
+  // Both the hash and equality of istring are transparent so that the pool can look up
+  // anything that converts to an istring_view without constructing an istring
   template <>
   struct hash<istring>
   {
     typedef istring argument_type;
     typedef size_t result_type;
-    result_type operator()(const argument_type& value) const
+    typedef void is_transparent;
+    result_type operator()(const istring_view& value) const
+    {
+      return istring_hash(value.data(), value.size());
+    }
+  };
+
+  template <>
+  struct equal_to<istring>
+  {
+    typedef istring first_argument_type;
+    typedef istring second_argument_type;
+    typedef bool result_type;
+    typedef void is_transparent;
+    result_type operator()(const istring_view& lhs, const istring_view& rhs) const
     {
-      // Hash the pointer since we know all pooled objects are shared!
-      return hash<string>()(value);
+      return lhs.size() == rhs.size() && memcmp(lhs.data(), rhs.data(), lhs.size()) == 0;
     }
   };
 
@@ -66,4 +169,169 @@ namespace std
   // are as simple as comparing a pointer. Due to this behaivor we're able to use the pointer as the hash,
   // which also makes string lookups incredibly fast in unordered_maps.
   typedef pooled<istring> pstring;
+
+  // A range of the characters of an interned string (or of any string that outlives the view), so
+  // slicing and tokenizing never allocate or touch the pool. Views compare and hash by their
+  // characters, can be sliced again, and only become a pstring when intern is called.
+  class pstring_view
+  {
+  public:
+    static const size_t npos = static_cast<size_t>(-1);
+
+    pstring_view() :
+      m_data(""),
+      m_size(0)
+    {
+    }
+
+    pstring_view(const pstring& value) :
+      m_data(value->data()),
+      m_size(value->size())
+    {
+    }
+
+    // A temporary pstring may be the last reference to its characters
+    pstring_view(pstring&&) = delete;
+
+    pstring_view(const char* data, size_t size) :
+      m_data(data),
+      m_size(size)
+    {
+    }
+
+    // Not null terminated (unless the view happens to reach the end of its string)
+    const char* data() const
+    {
+      return m_data;
+    }
+
+    size_t size() const
+    {
+      return m_size;
+    }
+
+    bool empty() const
+    {
+      return m_size == 0;
+    }
+
+    char operator[](size_t index) const
+    {
+      return m_data[index];
+    }
+
+    const char* begin() const
+    {
+      return m_data;
+    }
+
+    const char* end() const
+    {
+      return m_data + m_size;
+    }
+
+    pstring_view substr(size_t pos = 0, size_t len = npos) const
+    {
+      __stl_assert(pos <= m_size, "The slice starts past the end of the view");
+      pos = min(pos, m_size);
+      return pstring_view(m_data + pos, min(len, m_size - pos));
+    }
+
+    size_t find(char character, size_t pos = 0) const
+    {
+      for (size_t i = pos; i < m_size; ++i)
+      {
+        if (m_data[i] == character)
+        {
+          return i;
+        }
+      }
+      return npos;
+    }
+
+    istring_view view() const
+    {
+      return istring_view(m_data, m_size);
+    }
+
+    // Looks the characters up in the pool (and only allocates if they aren't there yet)
+    pstring intern() const
+    {
+      return pstring(view());
+    }
+
+  private:
+    const char* m_data;
+    size_t m_size;
+  };
+
+  inline pstring_view istring::slice(size_t pos, size_t len) const
+  {
+    return pstring_view(data(), size()).substr(pos, len);
+  }
+
+  inline bool operator==(const pstring_view& lhs, const pstring_view& rhs)
+  {
+    return lhs.size() == rhs.size() && (lhs.data() == rhs.data() || memcmp(lhs.data(), rhs.data(), lhs.size()) == 0);
+  }
+
+  inline bool operator!=(const pstring_view& lhs, const pstring_view& rhs)
+  {
+    return !(lhs == rhs);
+  }
+
+  // These match exactly, so comparing with a pstring never has to guess which side to convert
+  inline bool operator==(const pstring_view& lhs, const pstring& rhs)
+  {
+    return lhs == pstring_view(rhs);
+  }
+
+  inline bool operator!=(const pstring_view& lhs, const pstring& rhs)
+  {
+    return !(lhs == pstring_view(rhs));
+  }
+
+  inline bool operator==(const pstring& lhs, const pstring_view& rhs)
+  {
+    return pstring_view(lhs) == rhs;
+  }
+
+  inline bool operator!=(const pstring& lhs, const pstring_view& rhs)
+  {
+    return !(pstring_view(lhs) == rhs);
+  }
+
+  // Orders by characters (unlike pstring, which orders by pointer)
+  inline bool operator<(const pstring_view& lhs, const pstring_view& rhs)
+  {
+    int compared = memcmp(lhs.data(), rhs.data(), min(lhs.size(), rhs.size()));
+    return compared < 0 || (compared == 0 && lhs.size() < rhs.size());
+  }
+
+  // Hashes the characters, so it doesn't match the hash of a pstring (which is its pointer)
+  template <>
+  struct hash<pstring_view>
+  {
+    typedef pstring_view argument_type;
+    typedef size_t result_type;
+    result_type operator()(const argument_type& value) const
+    {
+      return istring_hash(value.data(), value.size());
+    }
+  };
 }
+
+// Interns a string literal once (the first time this line runs) and from then on just returns a
+// reference to it, so the literal is never hashed or looked up at runtime again:
+//   if (eventName == PSTRING("OnCollisionStarted"))
+// The hash is computed by the compiler. Each use of the macro has its own static slot, and the
+// value is pinned (it lives as long as the slot anyway), so copies of it skip reference counting.
+#define PSTRING(string_literal)                                                \
+  ([]() -> const std::pstring&                                                 \
+  {                                                                            \
+    static const std::pstring interned(std::pinned_t(), std::prehashed_t(),    \
+      std::integral_constant<size_t,                                           \
+        std::istring_hash(string_literal, sizeof(string_literal) - 1)>::value, \
+      std::istring_view(string_literal, sizeof(string_literal) - 1));          \
+    return interned;                                                           \
+  }())
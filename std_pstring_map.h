@@ -0,0 +1,513 @@
+// Copyright (c) 2017 Trevor Sundberg
+// This code is licensed under the MIT license (see LICENSE.txt for details)
+
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include "std_pstring.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define __stl_pstring_map_sse2 1
+#include <emmintrin.h>
+#endif
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+namespace std
+{
+  // The open addressing table behind pstring_map and pstring_set. Slots (which hold the pstring
+  // inline) are split into groups of 16, and each slot has a control byte that is either empty,
+  // deleted, or 7 bits of the key's hash. A lookup compares a whole group of control bytes at
+  // once (with SSE2 where we have it) and only looks at the slots whose bits match, and since
+  // keys are interned those are checked by comparing pointers (never by comparing strings).
+  // Groups are probed linearly until one has an empty slot.
+  // Slots are constructed in place and moved when the table grows, so values may be move only.
+  template <typename Slot>
+  class pstring_table
+  {
+  public:
+    typedef Slot value_type;
+    typedef size_t size_type;
+
+    template <typename Table, typename Value>
+    class basic_iterator
+    {
+    public:
+      friend class pstring_table;
+
+      basic_iterator() :
+        m_table(nullptr),
+        m_index(0)
+      {
+      }
+
+      // Lets an iterator be turned into a const_iterator
+      template <typename OtherTable, typename OtherValue>
+      basic_iterator(const basic_iterator<OtherTable, OtherValue>& rhs) :
+        m_table(rhs.m_table),
+        m_index(rhs.m_index)
+      {
+      }
+
+      Value& operator*() const
+      {
+        return m_table->m_slots[m_index];
+      }
+
+      Value* operator->() const
+      {
+        return &m_table->m_slots[m_index];
+      }
+
+      basic_iterator& operator++()
+      {
+        m_index = m_table->next_full(m_index + 1);
+        return *this;
+      }
+
+      basic_iterator operator++(int)
+      {
+        basic_iterator previous = *this;
+        ++*this;
+        return previous;
+      }
+
+      bool operator==(const basic_iterator& rhs) const
+      {
+        return m_index == rhs.m_index;
+      }
+
+      bool operator!=(const basic_iterator& rhs) const
+      {
+        return m_index != rhs.m_index;
+      }
+
+    private:
+      template <typename OtherTable, typename OtherValue>
+      friend class basic_iterator;
+
+      basic_iterator(Table* table, size_t index) :
+        m_table(table),
+        m_index(index)
+      {
+      }
+
+      Table* m_table;
+      size_t m_index;
+    };
+
+    // The keys of a set can't be changed through an iterator (just like the keys of a map)
+    typedef basic_iterator<pstring_table, typename conditional<is_same<Slot, pstring>::value, const Slot, Slot>::type> iterator;
+    typedef basic_iterator<const pstring_table, const Slot> const_iterator;
+
+    pstring_table() :
+      m_control(nullptr),
+      m_slots(nullptr),
+      m_capacity(0),
+      m_size(0),
+      m_deleted(0)
+    {
+    }
+
+    pstring_table(const pstring_table& rhs) :
+      pstring_table()
+    {
+      reserve(rhs.m_size);
+      for (const Slot& slot : rhs)
+      {
+        insert_unique(key_of(slot), slot);
+      }
+    }
+
+    pstring_table(pstring_table&& rhs) :
+      pstring_table()
+    {
+      swap(rhs);
+    }
+
+    ~pstring_table()
+    {
+      release();
+    }
+
+    pstring_table& operator=(pstring_table rhs)
+    {
+      swap(rhs);
+      return *this;
+    }
+
+    void swap(pstring_table& rhs)
+    {
+      std::swap(m_control, rhs.m_control);
+      std::swap(m_slots, rhs.m_slots);
+      std::swap(m_capacity, rhs.m_capacity);
+      std::swap(m_size, rhs.m_size);
+      std::swap(m_deleted, rhs.m_deleted);
+    }
+
+    iterator begin()
+    {
+      return iterator(this, next_full(0));
+    }
+
+    iterator end()
+    {
+      return iterator(this, m_capacity);
+    }
+
+    const_iterator begin() const
+    {
+      return const_iterator(this, next_full(0));
+    }
+
+    const_iterator end() const
+    {
+      return const_iterator(this, m_capacity);
+    }
+
+    size_t size() const
+    {
+      return m_size;
+    }
+
+    bool empty() const
+    {
+      return m_size == 0;
+    }
+
+    iterator find(const pstring& key)
+    {
+      return iterator(this, find_index(key));
+    }
+
+    const_iterator find(const pstring& key) const
+    {
+      return const_iterator(this, find_index(key));
+    }
+
+    size_t count(const pstring& key) const
+    {
+      return find_index(key) != m_capacity ? 1 : 0;
+    }
+
+    // Returns the slot that has the key (and whether it was inserted)
+    pair<iterator, bool> insert(const Slot& slot)
+    {
+      size_t index = find_index(key_of(slot));
+      if (index != m_capacity)
+      {
+        return make_pair(iterator(this, index), false);
+      }
+      return make_pair(iterator(this, insert_unique(key_of(slot), slot)), true);
+    }
+
+    pair<iterator, bool> insert(Slot&& slot)
+    {
+      size_t index = find_index(key_of(slot));
+      if (index != m_capacity)
+      {
+        return make_pair(iterator(this, index), false);
+      }
+      return make_pair(iterator(this, insert_unique(key_of(slot), std::move(slot))), true);
+    }
+
+    // The key is only known once the slot is built, so the slot is built first and then moved in
+    // (pstring_map::try_emplace builds the value in place, and only if the key is missing)
+    template <typename... Args>
+    pair<iterator, bool> emplace(Args&&... args)
+    {
+      return insert(Slot(std::forward<Args>(args)...));
+    }
+
+    size_t erase(const pstring& key)
+    {
+      size_t index = find_index(key);
+      if (index == m_capacity)
+      {
+        return 0;
+      }
+
+      erase(const_iterator(this, index));
+      return 1;
+    }
+
+    // Every pstring is implicitly constructible, so without this an iterator would be ambiguous
+    iterator erase(iterator it)
+    {
+      return erase(const_iterator(it));
+    }
+
+    // Erasing never moves other slots, so only iterators to the erased slot are invalidated
+    iterator erase(const_iterator it)
+    {
+      m_slots[it.m_index].~Slot();
+      m_control[it.m_index] = deleted_control;
+      --m_size;
+      ++m_deleted;
+      return iterator(this, next_full(it.m_index + 1));
+    }
+
+    void clear()
+    {
+      pstring_table().swap(*this);
+    }
+
+    // Makes room for count keys without rehashing again
+    void reserve(size_t count)
+    {
+      size_t capacity = group_size;
+      while (capacity * max_load_numerator < count * max_load_denominator)
+      {
+        capacity *= 2;
+      }
+
+      if (capacity > m_capacity)
+      {
+        rehash(capacity);
+      }
+    }
+
+  protected:
+    // Finds where a key that isn't in the table should go (growing if the table is too full) and
+    // constructs the slot there from the arguments
+    template <typename... Args>
+    size_t insert_unique(const pstring& key, Args&&... args)
+    {
+      // Deleted slots still lengthen probes, so they count towards the load
+      if ((m_size + m_deleted + 1) * max_load_denominator > m_capacity * max_load_numerator)
+      {
+        // Only grow if most of the load is real keys (otherwise just clear out the deleted slots)
+        size_t capacity = m_capacity != 0 ? m_capacity : group_size;
+        if ((m_size + 1) * 2 * max_load_denominator > capacity * max_load_numerator)
+        {
+          capacity *= 2;
+        }
+        rehash(capacity);
+      }
+
+      size_t hash = mix(key);
+      size_t group_mask = m_capacity / group_size - 1;
+      for (size_t group = (hash >> 7) & group_mask;; group = (group + 1) & group_mask)
+      {
+        uint32_t available = match_empty_or_deleted(m_control + group * group_size);
+        if (available != 0)
+        {
+          size_t index = group * group_size + first_bit(available);
+          new (&m_slots[index]) Slot(std::forward<Args>(args)...);
+          if (m_control[index] == deleted_control)
+          {
+            --m_deleted;
+          }
+          m_control[index] = static_cast<uint8_t>(hash & 0x7F);
+          ++m_size;
+          return index;
+        }
+      }
+    }
+
+    size_t find_index(const pstring& key) const
+    {
+      if (m_size == 0)
+      {
+        return m_capacity;
+      }
+
+      size_t hash = mix(key);
+      uint8_t bits = static_cast<uint8_t>(hash & 0x7F);
+      size_t group_mask = m_capacity / group_size - 1;
+      for (size_t group = (hash >> 7) & group_mask;; group = (group + 1) & group_mask)
+      {
+        const uint8_t* control = m_control + group * group_size;
+        for (uint32_t matches = match(control, bits); matches != 0; matches &= matches - 1)
+        {
+          size_t index = group * group_size + first_bit(matches);
+          if (key_of(m_slots[index]) == key)
+          {
+            return index;
+          }
+        }
+
+        if (match(control, empty_control) != 0)
+        {
+          return m_capacity;
+        }
+      }
+    }
+
+    iterator iterator_at(size_t index)
+    {
+      return iterator(this, index);
+    }
+
+    // What find_index returns when the key isn't found
+    size_t end_index() const
+    {
+      return m_capacity;
+    }
+
+  private:
+    static const size_t group_size = 16;
+    static const uint8_t empty_control = 0x80;
+    static const uint8_t deleted_control = 0xFE;
+
+    // Tables are at most 7/8 full
+    static const size_t max_load_numerator = 7;
+    static const size_t max_load_denominator = 8;
+
+    static const pstring& key_of(const pstring& slot)
+    {
+      return slot;
+    }
+
+    template <typename Value>
+    static const pstring& key_of(const pair<const pstring, Value>& slot)
+    {
+      return slot.first;
+    }
+
+    // The pstring hash is a pointer, so mix it before taking the group from the high bits
+    // and the control bits from the low ones
+    static size_t mix(const pstring& key)
+    {
+      uint64_t mixed = static_cast<uint64_t>(hash<pstring>()(key)) * 0x9E3779B97F4A7C15ull;
+      return static_cast<size_t>(mixed ^ (mixed >> 32));
+    }
+
+    // A bit for each control byte in the group that equals the value
+    static uint32_t match(const uint8_t* control, uint8_t value)
+    {
+#ifdef __stl_pstring_map_sse2
+      __m128i group = _mm_loadu_si128(reinterpret_cast<const __m128i*>(control));
+      return static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8(static_cast<char>(value)))));
+#else
+      uint32_t matches = 0;
+      for (size_t i = 0; i < group_size; ++i)
+      {
+        matches |= static_cast<uint32_t>(control[i] == value) << i;
+      }
+      return matches;
+#endif
+    }
+
+    // Empty and deleted are the only control bytes with the high bit set
+    static uint32_t match_empty_or_deleted(const uint8_t* control)
+    {
+#ifdef __stl_pstring_map_sse2
+      return static_cast<uint32_t>(_mm_movemask_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(control))));
+#else
+      uint32_t matches = 0;
+      for (size_t i = 0; i < group_size; ++i)
+      {
+        matches |= static_cast<uint32_t>(control[i] >> 7) << i;
+      }
+      return matches;
+#endif
+    }
+
+    static size_t first_bit(uint32_t bits)
+    {
+#ifdef _MSC_VER
+      unsigned long index;
+      _BitScanForward(&index, bits);
+      return index;
+#else
+      return static_cast<size_t>(__builtin_ctz(bits));
+#endif
+    }
+
+    size_t next_full(size_t index) const
+    {
+      while (index < m_capacity && (m_control[index] & 0x80) != 0)
+      {
+        ++index;
+      }
+      return index;
+    }
+
+    void rehash(size_t capacity)
+    {
+      pstring_table rehashed;
+      rehashed.allocate(capacity);
+      for (size_t i = 0; i < m_capacity; ++i)
+      {
+        if ((m_control[i] & 0x80) == 0)
+        {
+          rehashed.insert_unique(key_of(m_slots[i]), std::move(m_slots[i]));
+        }
+      }
+      swap(rehashed);
+    }
+
+    void allocate(size_t capacity)
+    {
+      m_control = allocator<uint8_t>().allocate(capacity);
+      memset(m_control, empty_control, capacity);
+      m_slots = allocator<Slot>().allocate(capacity);
+      m_capacity = capacity;
+    }
+
+    void release()
+    {
+      for (size_t i = 0; i < m_capacity; ++i)
+      {
+        if ((m_control[i] & 0x80) == 0)
+        {
+          m_slots[i].~Slot();
+        }
+      }
+
+      if (m_capacity != 0)
+      {
+        allocator<uint8_t>().deallocate(m_control, m_capacity);
+        allocator<Slot>().deallocate(m_slots, m_capacity);
+      }
+    }
+
+    uint8_t* m_control;
+    Slot* m_slots;
+    size_t m_capacity;
+    size_t m_size;
+    size_t m_deleted;
+  };
+
+  template <typename Value>
+  class pstring_map : public pstring_table<pair<const pstring, Value>>
+  {
+  public:
+    typedef pstring key_type;
+    typedef Value mapped_type;
+
+    Value& operator[](const pstring& key)
+    {
+      return try_emplace(key).first->second;
+    }
+
+    // Constructs the value in place from the arguments, but only if the key isn't already in the map
+    template <typename... Args>
+    pair<typename pstring_map::iterator, bool> try_emplace(const pstring& key, Args&&... args)
+    {
+      size_t index = this->find_index(key);
+      if (index != this->end_index())
+      {
+        return make_pair(this->iterator_at(index), false);
+      }
+
+      index = this->insert_unique(key, piecewise_construct, forward_as_tuple(key), forward_as_tuple(std::forward<Args>(args)...));
+      return make_pair(this->iterator_at(index), true);
+    }
+  };
+
+  class pstring_set : public pstring_table<pstring>
+  {
+  public:
+    typedef pstring key_type;
+  };
+}